@@ -0,0 +1,516 @@
+//
+// Benchmarks for loading and rendering. Run with `cargo bench`, optionally
+// followed by a substring to only run matching benchmarks:
+//
+//     cargo bench -- tilemap
+//
+// All inputs are generated, so that each benchmark can be run at several
+// canvas sizes, layer counts, and frame counts to show how the time scales.
+// Timing uses a small built-in harness: each benchmark is calibrated to run
+// for at least `SAMPLE_TIME` per sample, and the median time per iteration of
+// `SAMPLES` samples is reported.
+//
+use asefile::{AsepriteFile, FrameCache, RenderContext};
+use flate2::{write::ZlibEncoder, Compression};
+use std::{
+    hint::black_box,
+    io::Write,
+    time::{Duration, Instant},
+};
+
+const SAMPLES: usize = 11;
+const SAMPLE_TIME: Duration = Duration::from_millis(20);
+
+fn main() {
+    let filter = std::env::args().skip(1).find(|arg| !arg.starts_with('-'));
+    let b = Bencher { filter };
+
+    bench_read(&b);
+    bench_blend_modes(&b);
+    bench_pixel_formats(&b);
+    bench_scaling(&b);
+    bench_tilemaps(&b);
+    bench_linked_cels(&b);
+    bench_thumbnails(&b);
+}
+
+// --- Benchmarks --------------------------------------------------------------
+
+fn bench_read(b: &Bencher) {
+    for &size in &[64, 256, 1024] {
+        for &compressed in &[false, true] {
+            let data = Sprite {
+                size: (size, size),
+                layers: 4,
+                compressed,
+                ..Sprite::default()
+            }
+            .build();
+            let kind = if compressed { "compressed" } else { "raw" };
+            b.bench(&format!("read/{}/{}x{}", kind, size, size), || {
+                AsepriteFile::read(&data[..]).unwrap()
+            });
+            b.bench(&format!("read_bytes/{}/{}x{}", kind, size, size), || {
+                AsepriteFile::read_bytes(&data).unwrap()
+            });
+        }
+    }
+}
+
+fn bench_blend_modes(b: &Bencher) {
+    for (mode, name) in BLEND_MODES.iter().enumerate() {
+        let ase = Sprite {
+            size: (256, 256),
+            layers: 2,
+            blend_mode: mode as u16,
+            ..Sprite::default()
+        }
+        .load();
+        b.bench(&format!("blend/{}/256x256", name), || ase.frame(0).image());
+    }
+}
+
+fn bench_pixel_formats(b: &Bencher) {
+    for &indexed in &[false, true] {
+        let ase = Sprite {
+            size: (256, 256),
+            layers: 4,
+            indexed,
+            ..Sprite::default()
+        }
+        .load();
+        let kind = if indexed { "indexed" } else { "rgba" };
+        b.bench(&format!("format/{}/256x256x4", kind), || {
+            ase.frame(0).image()
+        });
+        let mut image = ase.frame(0).image();
+        let mut context = RenderContext::new();
+        b.bench(&format!("format/{}/256x256x4/into", kind), || {
+            ase.render_frame_into(0, &mut image, &mut context)
+        });
+    }
+}
+
+fn bench_scaling(b: &Bencher) {
+    for &size in &[64, 256, 1024] {
+        let ase = Sprite {
+            size: (size, size),
+            layers: 4,
+            ..Sprite::default()
+        }
+        .load();
+        b.bench(&format!("scale/canvas/{}x{}", size, size), || {
+            ase.frame(0).image()
+        });
+    }
+    for &layers in &[1, 4, 16, 64] {
+        let ase = Sprite {
+            size: (256, 256),
+            layers,
+            ..Sprite::default()
+        }
+        .load();
+        b.bench(&format!("scale/layers/{}", layers), || ase.frame(0).image());
+    }
+    for &frames in &[1, 16, 64] {
+        let data = Sprite {
+            size: (128, 128),
+            layers: 2,
+            frames,
+            ..Sprite::default()
+        }
+        .build();
+        b.bench(&format!("scale/frames/{}/read", frames), || {
+            AsepriteFile::read(&data[..]).unwrap()
+        });
+        let ase = AsepriteFile::read(&data[..]).unwrap();
+        b.bench(&format!("scale/frames/{}/render", frames), || {
+            (0..ase.num_frames())
+                .map(|frame| ase.frame(frame).image())
+                .count()
+        });
+        b.bench(&format!("scale/frames/{}/render_all", frames), || {
+            ase.render_all_frames()
+        });
+    }
+}
+
+fn bench_tilemaps(b: &Bencher) {
+    for &(tiles, tile_size) in &[(16, 16), (64, 16), (128, 16), (64, 8)] {
+        let ase = AsepriteFile::read(&tilemap_sprite(tiles, tile_size, 64)[..]).unwrap();
+        b.bench(
+            &format!("tilemap/{}x{}_tiles/{}px", tiles, tiles, tile_size),
+            || ase.frame(0).image(),
+        );
+    }
+}
+
+fn bench_linked_cels(b: &Bencher) {
+    // Every frame links all but one layer to the first frame.
+    let ase = Sprite {
+        size: (256, 256),
+        layers: 8,
+        frames: 64,
+        linked: true,
+        ..Sprite::default()
+    }
+    .load();
+    b.bench("linked/64_frames/image", || {
+        (0..ase.num_frames())
+            .map(|frame| ase.frame(frame).image())
+            .count()
+    });
+    b.bench("linked/64_frames/frame_cache", || {
+        let mut cache = FrameCache::new(&ase);
+        (0..ase.num_frames())
+            .map(|frame| cache.frame(frame))
+            .count()
+    });
+}
+
+fn bench_thumbnails(b: &Bencher) {
+    let ase = Sprite {
+        size: (1024, 1024),
+        layers: 4,
+        ..Sprite::default()
+    }
+    .load();
+    for &factor in &[1, 2, 4, 8] {
+        b.bench(&format!("thumbnail/1024x1024/1_{}", factor), || {
+            ase.render_frame_scaled(0, factor)
+        });
+    }
+}
+
+// --- Harness -----------------------------------------------------------------
+
+struct Bencher {
+    filter: Option<String>,
+}
+
+impl Bencher {
+    fn bench<T, F: FnMut() -> T>(&self, name: &str, mut f: F) {
+        if let Some(filter) = &self.filter {
+            if !name.contains(filter.as_str()) {
+                return;
+            }
+        }
+        // Find an iteration count that makes a sample long enough to time.
+        let mut iterations = 1_u32;
+        while time(&mut f, iterations) < SAMPLE_TIME && iterations < 1 << 20 {
+            iterations *= 2;
+        }
+        let mut samples: Vec<Duration> = (0..SAMPLES)
+            .map(|_| time(&mut f, iterations) / iterations)
+            .collect();
+        samples.sort();
+        println!("{:<44} {:>12?}", name, samples[SAMPLES / 2]);
+    }
+}
+
+fn time<T, F: FnMut() -> T>(f: &mut F, iterations: u32) -> Duration {
+    let start = Instant::now();
+    for _ in 0..iterations {
+        black_box(f());
+    }
+    start.elapsed()
+}
+
+// --- Synthetic files ---------------------------------------------------------
+
+// Blend mode names in file format order.
+const BLEND_MODES: [&str; 19] = [
+    "normal",
+    "multiply",
+    "screen",
+    "overlay",
+    "darken",
+    "lighten",
+    "color_dodge",
+    "color_burn",
+    "hard_light",
+    "soft_light",
+    "difference",
+    "exclusion",
+    "hue",
+    "saturation",
+    "color",
+    "luminosity",
+    "addition",
+    "subtract",
+    "divide",
+];
+
+// Description of a generated sprite with image layers. Each layer has one
+// cel per frame that covers the whole canvas.
+struct Sprite {
+    size: (u16, u16),
+    layers: u16,
+    frames: u16,
+    // Indexed colors with a 256 color palette instead of RGBA.
+    indexed: bool,
+    // Zlib-compressed cels instead of raw ones.
+    compressed: bool,
+    // Blend mode of all layers but the bottom one.
+    blend_mode: u16,
+    // Link the cels of all layers but the top one to the first frame.
+    linked: bool,
+}
+
+impl Default for Sprite {
+    fn default() -> Self {
+        Self {
+            size: (256, 256),
+            layers: 1,
+            frames: 1,
+            indexed: false,
+            compressed: true,
+            blend_mode: 0,
+            linked: false,
+        }
+    }
+}
+
+impl Sprite {
+    fn load(&self) -> AsepriteFile {
+        AsepriteFile::read(&self.build()[..]).unwrap()
+    }
+
+    fn build(&self) -> Vec<u8> {
+        let (width, height) = self.size;
+        let depth = if self.indexed { 8 } else { 32 };
+        let mut file = AseWriter::new(width, height, depth);
+        let mut noise = Noise(self.layers as u32 * 7919 + self.frames as u32);
+        for frame in 0..self.frames {
+            let mut chunks = Vec::new();
+            if frame == 0 {
+                if self.indexed {
+                    chunks.push(palette_chunk(&mut noise));
+                }
+                for layer in 0..self.layers {
+                    let blend_mode = if layer == 0 { 0 } else { self.blend_mode };
+                    chunks.push(layer_chunk(&format!("Layer {}", layer), 0, blend_mode));
+                }
+            }
+            for layer in 0..self.layers {
+                let is_linked = self.linked && frame > 0 && layer + 1 < self.layers;
+                let chunk = if is_linked {
+                    let mut cel = cel_header(layer, 0, 0, 1);
+                    cel.extend_from_slice(&0_u16.to_le_bytes());
+                    cel
+                } else {
+                    let pixel_count = width as usize * height as usize;
+                    let pixels = if self.indexed {
+                        noise.indexed_pixels(pixel_count)
+                    } else {
+                        noise.rgba_pixels(pixel_count)
+                    };
+                    let cel_type = if self.compressed { 2 } else { 0 };
+                    let mut cel = cel_header(layer, 0, 0, cel_type);
+                    cel.extend_from_slice(&width.to_le_bytes());
+                    cel.extend_from_slice(&height.to_le_bytes());
+                    if self.compressed {
+                        cel.extend_from_slice(&zlib(&pixels));
+                    } else {
+                        cel.extend_from_slice(&pixels);
+                    }
+                    cel
+                };
+                chunks.push(chunk_bytes(0x2005, &chunk));
+            }
+            file.add_frame(&chunks);
+        }
+        file.finish()
+    }
+}
+
+// An RGBA sprite with a single tilemap layer of `tiles` x `tiles` tiles that
+// uses a tileset of `tile_count` tiles of `tile_size` x `tile_size` pixels.
+fn tilemap_sprite(tiles: u16, tile_size: u16, tile_count: u32) -> Vec<u8> {
+    let canvas = tiles * tile_size;
+    let mut file = AseWriter::new(canvas, canvas, 32);
+    let mut noise = Noise(tile_count);
+
+    let mut tileset = Vec::new();
+    tileset.extend_from_slice(&0_u32.to_le_bytes()); // id
+    tileset.extend_from_slice(&(2_u32 | 4).to_le_bytes()); // includes tiles, tile 0 is empty
+    tileset.extend_from_slice(&tile_count.to_le_bytes());
+    tileset.extend_from_slice(&tile_size.to_le_bytes());
+    tileset.extend_from_slice(&tile_size.to_le_bytes());
+    tileset.extend_from_slice(&1_i16.to_le_bytes()); // base index
+    tileset.extend_from_slice(&[0; 14]);
+    push_string(&mut tileset, "Tileset");
+    let pixel_count = tile_count as usize * tile_size as usize * tile_size as usize;
+    let tile_pixels = zlib(&noise.rgba_pixels(pixel_count));
+    tileset.extend_from_slice(&(tile_pixels.len() as u32).to_le_bytes());
+    tileset.extend_from_slice(&tile_pixels);
+
+    let mut tilemap = Vec::new();
+    for _ in 0..tiles as usize * tiles as usize {
+        tilemap.extend_from_slice(&(noise.next() % tile_count).to_le_bytes());
+    }
+    let mut cel = cel_header(0, 0, 0, 3);
+    cel.extend_from_slice(&tiles.to_le_bytes());
+    cel.extend_from_slice(&tiles.to_le_bytes());
+    cel.extend_from_slice(&32_u16.to_le_bytes());
+    for mask in &[0x1fff_ffff_u32, 0x8000_0000, 0x4000_0000, 0x2000_0000] {
+        cel.extend_from_slice(&mask.to_le_bytes());
+    }
+    cel.extend_from_slice(&[0; 10]);
+    cel.extend_from_slice(&zlib(&tilemap));
+
+    file.add_frame(&[
+        chunk_bytes(0x2023, &tileset),
+        layer_chunk("Tilemap", 2, 0),
+        chunk_bytes(0x2005, &cel),
+    ]);
+    file.finish()
+}
+
+// Writes the parts of the file format that the generated sprites need. See
+// https://github.com/aseprite/aseprite/blob/master/docs/ase-file-specs.md
+struct AseWriter {
+    data: Vec<u8>,
+    num_frames: u16,
+}
+
+impl AseWriter {
+    fn new(width: u16, height: u16, color_depth: u16) -> Self {
+        let mut data = Vec::new();
+        data.extend_from_slice(&0_u32.to_le_bytes()); // file size, set in finish
+        data.extend_from_slice(&0xA5E0_u16.to_le_bytes());
+        data.extend_from_slice(&0_u16.to_le_bytes()); // frames, set in finish
+        data.extend_from_slice(&width.to_le_bytes());
+        data.extend_from_slice(&height.to_le_bytes());
+        data.extend_from_slice(&color_depth.to_le_bytes());
+        data.extend_from_slice(&1_u32.to_le_bytes()); // flags
+        data.extend_from_slice(&100_u16.to_le_bytes()); // speed
+        data.extend_from_slice(&[0; 8]);
+        data.push(0); // transparent color index
+        data.extend_from_slice(&[0; 3]);
+        data.extend_from_slice(&256_u16.to_le_bytes()); // number of colors
+        data.extend_from_slice(&[1, 1]); // pixel ratio
+        data.extend_from_slice(&[0; 8]); // grid
+        data.extend_from_slice(&[0; 84]);
+        Self {
+            data,
+            num_frames: 0,
+        }
+    }
+
+    fn add_frame(&mut self, chunks: &[Vec<u8>]) {
+        let size: usize = 16 + chunks.iter().map(Vec::len).sum::<usize>();
+        self.data.extend_from_slice(&(size as u32).to_le_bytes());
+        self.data.extend_from_slice(&0xF1FA_u16.to_le_bytes());
+        self.data.extend_from_slice(&0xFFFF_u16.to_le_bytes()); // old chunk count
+        self.data.extend_from_slice(&100_u16.to_le_bytes()); // duration
+        self.data.extend_from_slice(&[0; 2]);
+        self.data
+            .extend_from_slice(&(chunks.len() as u32).to_le_bytes());
+        for chunk in chunks {
+            self.data.extend_from_slice(chunk);
+        }
+        self.num_frames += 1;
+    }
+
+    fn finish(mut self) -> Vec<u8> {
+        let size = self.data.len() as u32;
+        self.data[0..4].copy_from_slice(&size.to_le_bytes());
+        self.data[6..8].copy_from_slice(&self.num_frames.to_le_bytes());
+        self.data
+    }
+}
+
+fn chunk_bytes(chunk_type: u16, data: &[u8]) -> Vec<u8> {
+    let mut chunk = Vec::with_capacity(data.len() + 6);
+    chunk.extend_from_slice(&(data.len() as u32 + 6).to_le_bytes());
+    chunk.extend_from_slice(&chunk_type.to_le_bytes());
+    chunk.extend_from_slice(data);
+    chunk
+}
+
+fn layer_chunk(name: &str, layer_type: u16, blend_mode: u16) -> Vec<u8> {
+    let mut layer = Vec::new();
+    layer.extend_from_slice(&3_u16.to_le_bytes()); // visible, editable
+    layer.extend_from_slice(&layer_type.to_le_bytes());
+    layer.extend_from_slice(&0_u16.to_le_bytes()); // child level
+    layer.extend_from_slice(&[0; 4]); // default size
+    layer.extend_from_slice(&blend_mode.to_le_bytes());
+    layer.push(255); // opacity
+    layer.extend_from_slice(&[0; 3]);
+    push_string(&mut layer, name);
+    if layer_type == 2 {
+        layer.extend_from_slice(&0_u32.to_le_bytes()); // tileset index
+    }
+    chunk_bytes(0x2004, &layer)
+}
+
+fn palette_chunk(noise: &mut Noise) -> Vec<u8> {
+    let mut palette = Vec::new();
+    palette.extend_from_slice(&256_u32.to_le_bytes());
+    palette.extend_from_slice(&0_u32.to_le_bytes());
+    palette.extend_from_slice(&255_u32.to_le_bytes());
+    palette.extend_from_slice(&[0; 8]);
+    for _ in 0..256 {
+        palette.extend_from_slice(&0_u16.to_le_bytes()); // no name
+        palette.extend_from_slice(&noise.next().to_le_bytes());
+    }
+    chunk_bytes(0x2019, &palette)
+}
+
+fn cel_header(layer: u16, x: i16, y: i16, cel_type: u16) -> Vec<u8> {
+    let mut cel = Vec::new();
+    cel.extend_from_slice(&layer.to_le_bytes());
+    cel.extend_from_slice(&x.to_le_bytes());
+    cel.extend_from_slice(&y.to_le_bytes());
+    cel.push(255); // opacity
+    cel.extend_from_slice(&cel_type.to_le_bytes());
+    cel.extend_from_slice(&[0; 7]);
+    cel
+}
+
+fn push_string(data: &mut Vec<u8>, s: &str) {
+    data.extend_from_slice(&(s.len() as u16).to_le_bytes());
+    data.extend_from_slice(s.as_bytes());
+}
+
+fn zlib(data: &[u8]) -> Vec<u8> {
+    let mut encoder = ZlibEncoder::new(Vec::new(), Compression::fast());
+    encoder.write_all(data).unwrap();
+    encoder.finish().unwrap()
+}
+
+// A small deterministic pseudo-random generator (xorshift), so that the
+// inputs are the same on every run.
+struct Noise(u32);
+
+impl Noise {
+    fn next(&mut self) -> u32 {
+        let mut x = self.0.max(1);
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        self.0 = x;
+        x
+    }
+
+    // Random colors, with a mix of opaque, translucent, and transparent
+    // pixels so that blending does real work.
+    fn rgba_pixels(&mut self, count: usize) -> Vec<u8> {
+        let mut pixels = Vec::with_capacity(count * 4);
+        for _ in 0..count {
+            let [r, g, b, a] = self.next().to_le_bytes();
+            let alpha = match a % 4 {
+                0 => 0,
+                1 => a,
+                _ => 255,
+            };
+            pixels.extend_from_slice(&[r, g, b, alpha]);
+        }
+        pixels
+    }
+
+    fn indexed_pixels(&mut self, count: usize) -> Vec<u8> {
+        (0..count).map(|_| self.next() as u8).collect()
+    }
+}
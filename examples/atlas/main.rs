@@ -8,6 +8,9 @@
 // The rect packer tells us where to place each image and then we must create
 // the final texture ourselves.
 //
+// With the `utils` feature, `asefile::util::build_atlas` does all of this in
+// one step and renders each frame directly into its place in the atlas.
+//
 use asefile::AsepriteFile;
 use image::{ImageFormat, RgbaImage};
 use rect_packer::{Config, Packer, Rect};
@@ -0,0 +1,219 @@
+// Reference values for the HSL blend modes.
+//
+// The color math of Aseprite's rgba_blender_hsl_{hue,saturation,color,
+// luminosity} (the part before rgba_blender_normal), run over a sample of
+// random color pairs. Prints one FNV-1a hash of all results per mode, which
+// `test_hsl_colors_match_aseprite` in src/blend.rs compares against.
+//
+//     g++ -O2 -ffp-contract=off -o hsl_blend_tests hsl_blend_tests.cc
+//     ./hsl_blend_tests
+//
+// -ffp-contract=off keeps the compiler from fusing multiplies and adds, which
+// Aseprite's release builds don't do either and which would change the
+// rounding.
+
+#include "stdint.h"
+#include <stdio.h>
+
+typedef uint32_t color_t;
+
+const uint32_t rgba_r_shift = 0;
+const uint32_t rgba_g_shift = 8;
+const uint32_t rgba_b_shift = 16;
+const uint32_t rgba_a_shift = 24;
+
+const uint32_t rgba_a_mask = 0xff000000;
+
+inline uint8_t rgba_getr(uint32_t c) { return (c >> rgba_r_shift) & 0xff; }
+inline uint8_t rgba_getg(uint32_t c) { return (c >> rgba_g_shift) & 0xff; }
+inline uint8_t rgba_getb(uint32_t c) { return (c >> rgba_b_shift) & 0xff; }
+
+inline uint32_t rgba(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+  return ((r << rgba_r_shift) | (g << rgba_g_shift) | (b << rgba_b_shift) |
+          (a << rgba_a_shift));
+}
+
+// From base/base.h. Both return an lvalue for lvalue arguments, which set_sat
+// relies on.
+#define MIN(x,y)     (((x) < (y)) ? (x) : (y))
+#define MAX(x,y)     (((x) > (y)) ? (x) : (y))
+
+// --- From Aseprite's blend_funcs.cpp -----------------------------------------
+
+static double lum(double r, double g, double b)
+{
+  return 0.3*r + 0.59*g + 0.11*b;
+}
+
+static double sat(double r, double g, double b)
+{
+  return MAX(r, MAX(g, b)) - MIN(r, MIN(g, b));
+}
+
+static void clip_color(double& r, double& g, double& b)
+{
+  double l = lum(r, g, b);
+  double n = MIN(r, MIN(g, b));
+  double x = MAX(r, MAX(g, b));
+
+  if (n < 0) {
+    r = l + (((r - l) * l) / (l - n));
+    g = l + (((g - l) * l) / (l - n));
+    b = l + (((b - l) * l) / (l - n));
+  }
+
+  if (x > 1) {
+    r = l + (((r - l) * (1 - l)) / (x - l));
+    g = l + (((g - l) * (1 - l)) / (x - l));
+    b = l + (((b - l) * (1 - l)) / (x - l));
+  }
+}
+
+static void set_lum(double& r, double& g, double& b, double l)
+{
+  double d = l - lum(r, g, b);
+  r += d;
+  g += d;
+  b += d;
+  clip_color(r, g, b);
+}
+
+static void set_sat(double& r, double& g, double& b, double s)
+{
+#undef MID
+#define MID(x,y,z)   ((x) > (y) ? ((y) > (z) ? (y) : ((x) > (z) ?    \
+                       (z) : (x))) : ((y) > (z) ? ((z) > (x) ? (z) : \
+                       (x)): (y)))
+
+  double& min = MIN(r, MIN(g, b));
+  double& mid = MID(r, g, b);
+  double& max = MAX(r, MAX(g, b));
+
+  if (max > min) {
+    mid = ((mid - min)*s) / (max - min);
+    max = s;
+  }
+  else
+    mid = max = 0;
+
+  min = 0;
+}
+
+// The blenders return rgba_blender_normal(backdrop, src, opacity) with this
+// `src`. We stop before that, the Rust tests cover `normal` on their own.
+
+static color_t hsl_hue(color_t backdrop, color_t src)
+{
+  double r = rgba_getr(backdrop)/255.0;
+  double g = rgba_getg(backdrop)/255.0;
+  double b = rgba_getb(backdrop)/255.0;
+  double s = sat(r, g, b);
+  double l = lum(r, g, b);
+
+  r = rgba_getr(src)/255.0;
+  g = rgba_getg(src)/255.0;
+  b = rgba_getb(src)/255.0;
+
+  set_sat(r, g, b, s);
+  set_lum(r, g, b, l);
+
+  return rgba(int(255.0*r), int(255.0*g), int(255.0*b), 0) | (src & rgba_a_mask);
+}
+
+static color_t hsl_saturation(color_t backdrop, color_t src)
+{
+  double r = rgba_getr(src)/255.0;
+  double g = rgba_getg(src)/255.0;
+  double b = rgba_getb(src)/255.0;
+  double s = sat(r, g, b);
+
+  r = rgba_getr(backdrop)/255.0;
+  g = rgba_getg(backdrop)/255.0;
+  b = rgba_getb(backdrop)/255.0;
+  double l = lum(r, g, b);
+
+  set_sat(r, g, b, s);
+  set_lum(r, g, b, l);
+
+  return rgba(int(255.0*r), int(255.0*g), int(255.0*b), 0) | (src & rgba_a_mask);
+}
+
+static color_t hsl_color(color_t backdrop, color_t src)
+{
+  double r = rgba_getr(backdrop)/255.0;
+  double g = rgba_getg(backdrop)/255.0;
+  double b = rgba_getb(backdrop)/255.0;
+  double l = lum(r, g, b);
+
+  r = rgba_getr(src)/255.0;
+  g = rgba_getg(src)/255.0;
+  b = rgba_getb(src)/255.0;
+
+  set_lum(r, g, b, l);
+
+  return rgba(int(255.0*r), int(255.0*g), int(255.0*b), 0) | (src & rgba_a_mask);
+}
+
+static color_t hsl_luminosity(color_t backdrop, color_t src)
+{
+  double r = rgba_getr(src)/255.0;
+  double g = rgba_getg(src)/255.0;
+  double b = rgba_getb(src)/255.0;
+  double l = lum(r, g, b);
+
+  r = rgba_getr(backdrop)/255.0;
+  g = rgba_getg(backdrop)/255.0;
+  b = rgba_getb(backdrop)/255.0;
+
+  set_lum(r, g, b, l);
+
+  return rgba(int(255.0*r), int(255.0*g), int(255.0*b), 0) | (src & rgba_a_mask);
+}
+
+// -----------------------------------------------------------------------------
+
+#define NUM_SAMPLES (1 << 20)
+
+// Same generator (xorshift32) and seed as the Rust test.
+static uint32_t xorshift(uint32_t& state) {
+  uint32_t x = state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  state = x;
+  return x;
+}
+
+static color_t random_color(uint32_t& state) {
+  uint8_t r = xorshift(state) >> 24;
+  uint8_t g = xorshift(state) >> 24;
+  uint8_t b = xorshift(state) >> 24;
+  uint8_t a = xorshift(state) >> 24;
+  return rgba(r, g, b, a);
+}
+
+static uint64_t fnv1a(uint64_t hash, color_t c) {
+  for (int i = 0; i < 4; ++i) {
+    hash ^= (c >> (8 * i)) & 0xff;
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+int main(int argc, char* argv[]) {
+  typedef color_t (*color_fn)(color_t, color_t);
+  const color_fn fns[] = {hsl_hue, hsl_saturation, hsl_color, hsl_luminosity};
+  const char* names[] = {"hue", "saturation", "color", "luminosity"};
+
+  for (int mode = 0; mode < 4; ++mode) {
+    uint32_t state = 0x2545f491;
+    uint64_t hash = 0xcbf29ce484222325;
+    for (int i = 0; i < NUM_SAMPLES; ++i) {
+      color_t backdrop = random_color(state);
+      color_t src = random_color(state);
+      hash = fnv1a(hash, fns[mode](backdrop, src));
+    }
+    printf("%-10s 0x%016llx\n", names[mode], (unsigned long long)hash);
+  }
+  return 0;
+}
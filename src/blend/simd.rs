@@ -0,0 +1,1467 @@
+// SIMD versions of the integer and HSL blend modes.
+//
+// These produce bit-identical results to the scalar functions in `blend.rs`.
+// Each vector lane holds one pixel as a little-endian `u32` (i.e., `r` in the
+// lowest byte), so a 128-bit register processes 4 pixels and a 256-bit
+// register processes 8 pixels. The blend math is written once against the
+// `Simd` trait and instantiated for SSE2, AVX2 (both selected at runtime) and
+// NEON.
+//
+// Scalar code branches on alpha values. We instead compute all branches for
+// every lane and pick the result with a mask.
+//
+// The only non-trivial part is the truncating integer division in `normal`.
+// There's no SIMD integer division, so we use `f32` division followed by
+// truncation. This is exact: the numerator is at most `255 * 255` in absolute
+// value, the divisor is in `1..=255` and the quotient is at most 255 in
+// absolute value. If the quotient is not an integer, it is at least `1/255`
+// away from the next integer which is far larger than the rounding error of
+// a single `f32` division.
+//
+// The HSL modes compute in `f64` and have their own kernels, see the `hsl`
+// module below.
+
+use super::Color8;
+use image::Rgba;
+
+/// Blends a row of `src` pixels onto a row of RGBA bytes (`dst`). Both rows
+/// must have the same number of pixels.
+pub(crate) type RowKernel = fn(dst: &mut [u8], src: &[Color8], opacity: u8);
+
+/// Returns a vectorized row kernel for `mode`, if one is available for the
+/// current CPU.
+pub(crate) fn row_kernel(mode: crate::BlendMode) -> Option<RowKernel> {
+    use crate::BlendMode;
+    match mode {
+        BlendMode::Normal => kernel_for::<Normal>(),
+        BlendMode::Multiply => kernel_for::<Multiply>(),
+        BlendMode::Screen => kernel_for::<Screen>(),
+        BlendMode::Darken => kernel_for::<Darken>(),
+        BlendMode::Lighten => kernel_for::<Lighten>(),
+        BlendMode::Difference => kernel_for::<Difference>(),
+        BlendMode::Exclusion => kernel_for::<Exclusion>(),
+        BlendMode::Addition => kernel_for::<Addition>(),
+        BlendMode::Subtract => kernel_for::<Subtract>(),
+        #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+        BlendMode::Hue => hsl::kernel_for::<hsl::Hue>(),
+        #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+        BlendMode::Saturation => hsl::kernel_for::<hsl::Saturation>(),
+        #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+        BlendMode::Color => hsl::kernel_for::<hsl::Color>(),
+        #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+        BlendMode::Luminosity => hsl::kernel_for::<hsl::Luminosity>(),
+        _ => None,
+    }
+}
+
+#[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+fn kernel_for<M: Mode>() -> Option<RowKernel> {
+    if is_x86_feature_detected!("avx2") {
+        Some(x86::blend_row_avx2::<M>)
+    } else if is_x86_feature_detected!("sse2") {
+        Some(x86::blend_row_sse2::<M>)
+    } else {
+        None
+    }
+}
+
+#[cfg(target_arch = "aarch64")]
+fn kernel_for<M: Mode>() -> Option<RowKernel> {
+    Some(neon::blend_row_neon::<M>)
+}
+
+#[cfg(not(any(target_arch = "x86", target_arch = "x86_64", target_arch = "aarch64")))]
+fn kernel_for<M: Mode>() -> Option<RowKernel> {
+    None
+}
+
+// --- Vector abstraction ------------------------------------------------------
+
+// Operations on vectors of `i32` lanes.
+//
+// All methods are unsafe because they may only be called if the CPU supports
+// the corresponding instruction set. They are `inline(always)` so that they
+// get inlined into the `target_feature` entry points below.
+trait Simd {
+    type V: Copy;
+    /// Number of pixels (lanes) per vector.
+    const LANES: usize;
+
+    unsafe fn splat(x: i32) -> Self::V;
+    /// Loads `LANES` pixels from `4 * LANES` bytes.
+    unsafe fn load(bytes: &[u8]) -> Self::V;
+    /// Stores `LANES` pixels into `4 * LANES` bytes.
+    unsafe fn store(v: Self::V, bytes: &mut [u8]);
+
+    unsafe fn add(a: Self::V, b: Self::V) -> Self::V;
+    unsafe fn sub(a: Self::V, b: Self::V) -> Self::V;
+    /// Low 32 bits of the product.
+    unsafe fn mul(a: Self::V, b: Self::V) -> Self::V;
+    unsafe fn and(a: Self::V, b: Self::V) -> Self::V;
+    unsafe fn or(a: Self::V, b: Self::V) -> Self::V;
+    unsafe fn min(a: Self::V, b: Self::V) -> Self::V;
+    unsafe fn max(a: Self::V, b: Self::V) -> Self::V;
+    unsafe fn abs(a: Self::V) -> Self::V;
+    /// Arithmetic shift right by 8.
+    unsafe fn sra8(a: Self::V) -> Self::V;
+    /// Logical shift right by 8, 16, 24.
+    unsafe fn srl8(a: Self::V) -> Self::V;
+    unsafe fn srl16(a: Self::V) -> Self::V;
+    unsafe fn srl24(a: Self::V) -> Self::V;
+    /// Shift left by 8, 16, 24.
+    unsafe fn sll8(a: Self::V) -> Self::V;
+    unsafe fn sll16(a: Self::V) -> Self::V;
+    unsafe fn sll24(a: Self::V) -> Self::V;
+    /// All bits set in lanes where `a == b`.
+    unsafe fn eq(a: Self::V, b: Self::V) -> Self::V;
+    /// Per lane `if mask { a } else { b }`. Mask lanes must be all ones or
+    /// all zeros.
+    unsafe fn select(mask: Self::V, a: Self::V, b: Self::V) -> Self::V;
+    /// `a / b` rounded towards zero. See module comment for preconditions.
+    unsafe fn div(a: Self::V, b: Self::V) -> Self::V;
+}
+
+#[derive(Clone, Copy)]
+struct Px<V> {
+    r: V,
+    g: V,
+    b: V,
+    a: V,
+}
+
+#[inline(always)]
+unsafe fn unpack<S: Simd>(v: S::V) -> Px<S::V> {
+    let mask = S::splat(0xff);
+    Px {
+        r: S::and(v, mask),
+        g: S::and(S::srl8(v), mask),
+        b: S::and(S::srl16(v), mask),
+        a: S::srl24(v),
+    }
+}
+
+#[inline(always)]
+unsafe fn pack<S: Simd>(p: Px<S::V>) -> S::V {
+    S::or(
+        S::or(p.r, S::sll8(p.g)),
+        S::or(S::sll16(p.b), S::sll24(p.a)),
+    )
+}
+
+#[inline(always)]
+unsafe fn select_px<S: Simd>(mask: S::V, a: Px<S::V>, b: Px<S::V>) -> Px<S::V> {
+    Px {
+        r: S::select(mask, a.r, b.r),
+        g: S::select(mask, a.g, b.g),
+        b: S::select(mask, a.b, b.b),
+        a: S::select(mask, a.a, b.a),
+    }
+}
+
+// See `blend::mul_un8`.
+#[inline(always)]
+unsafe fn mul_un8<S: Simd>(a: S::V, b: S::V) -> S::V {
+    let t = S::add(S::mul(a, b), S::splat(0x80));
+    S::sra8(S::add(S::sra8(t), t))
+}
+
+// See `blend::blend8`.
+#[inline(always)]
+unsafe fn blend8<S: Simd>(back: S::V, src: S::V, opacity: S::V) -> S::V {
+    let t = S::add(S::mul(S::sub(src, back), opacity), S::splat(0x80));
+    S::add(back, S::sra8(S::add(S::sra8(t), t)))
+}
+
+// See `blend::normal`.
+#[inline(always)]
+unsafe fn normal<S: Simd>(back: Px<S::V>, src: Px<S::V>, opacity: S::V) -> Px<S::V> {
+    let zero = S::splat(0);
+    let src_a = mul_un8::<S>(src.a, opacity);
+    let res_a = S::sub(S::add(src_a, back.a), mul_un8::<S>(back.a, src_a));
+    let blended = Px {
+        r: normal_channel::<S>(back.r, src.r, src_a, res_a),
+        g: normal_channel::<S>(back.g, src.g, src_a, res_a),
+        b: normal_channel::<S>(back.b, src.b, src_a, res_a),
+        a: res_a,
+    };
+    let transparent_back = Px { a: src_a, ..src };
+    let res = select_px::<S>(S::eq(src.a, zero), back, blended);
+    select_px::<S>(S::eq(back.a, zero), transparent_back, res)
+}
+
+// Helpers are functions rather than closures: closures don't inherit the
+// target features of the entry points below, so they would not get inlined.
+#[inline(always)]
+unsafe fn normal_channel<S: Simd>(b: S::V, s: S::V, src_a: S::V, res_a: S::V) -> S::V {
+    S::add(b, S::div(S::mul(S::sub(s, b), src_a), res_a))
+}
+
+#[inline(always)]
+unsafe fn merge_channel<S: Simd>(
+    b: S::V,
+    s: S::V,
+    opacity: S::V,
+    back_is_transparent: S::V,
+    src_is_transparent: S::V,
+) -> S::V {
+    let res = S::select(src_is_transparent, b, blend8::<S>(b, s, opacity));
+    S::select(back_is_transparent, s, res)
+}
+
+// See `blend::merge`.
+#[inline(always)]
+unsafe fn merge<S: Simd>(back: Px<S::V>, src: Px<S::V>, opacity: S::V) -> Px<S::V> {
+    let zero = S::splat(0);
+    let back_is_transparent = S::eq(back.a, zero);
+    let src_is_transparent = S::eq(src.a, zero);
+    let res_a = blend8::<S>(back.a, src.a, opacity);
+    let res_is_transparent = S::eq(res_a, zero);
+    let res = Px {
+        r: merge_channel::<S>(
+            back.r,
+            src.r,
+            opacity,
+            back_is_transparent,
+            src_is_transparent,
+        ),
+        g: merge_channel::<S>(
+            back.g,
+            src.g,
+            opacity,
+            back_is_transparent,
+            src_is_transparent,
+        ),
+        b: merge_channel::<S>(
+            back.b,
+            src.b,
+            opacity,
+            back_is_transparent,
+            src_is_transparent,
+        ),
+        a: res_a,
+    };
+    select_px::<S>(
+        res_is_transparent,
+        Px {
+            r: zero,
+            g: zero,
+            b: zero,
+            a: zero,
+        },
+        res,
+    )
+}
+
+// See `blend::blender` and `blend::blend_channel`.
+#[inline(always)]
+unsafe fn blender<S: Simd, M: Mode>(back: Px<S::V>, src: Px<S::V>, opacity: S::V) -> Px<S::V> {
+    let blend_src = Px {
+        r: M::channel::<S>(back.r, src.r),
+        g: M::channel::<S>(back.g, src.g),
+        b: M::channel::<S>(back.b, src.b),
+        a: src.a,
+    };
+    composite::<S>(back, src, blend_src, opacity)
+}
+
+// See `blend::blender`. `blend_src` is `src` with the colors of the blend mode.
+#[inline(always)]
+unsafe fn composite<S: Simd>(
+    back: Px<S::V>,
+    src: Px<S::V>,
+    blend_src: Px<S::V>,
+    opacity: S::V,
+) -> Px<S::V> {
+    let norm = normal::<S>(back, src, opacity);
+    let blend = normal::<S>(back, blend_src, opacity);
+    let normal_to_blend_merge = merge::<S>(norm, blend, back.a);
+    let src_total_alpha = mul_un8::<S>(src.a, opacity);
+    let composite_alpha = mul_un8::<S>(back.a, src_total_alpha);
+    let res = merge::<S>(normal_to_blend_merge, blend, composite_alpha);
+    select_px::<S>(S::eq(back.a, S::splat(0)), norm, res)
+}
+
+#[inline(always)]
+unsafe fn blend_row_impl<S: Simd, M: Mode>(dst: &mut [u8], src: &[Color8], opacity: u8) {
+    assert_eq!(dst.len(), src.len() * 4);
+    let opacity_v = S::splat(opacity as i32);
+    let chunk_bytes = S::LANES * 4;
+    let mut dst_chunks = dst.chunks_exact_mut(chunk_bytes);
+    let mut src_chunks = src.chunks_exact(S::LANES);
+    for (dst, src) in (&mut dst_chunks).zip(&mut src_chunks) {
+        let src_bytes = rgba_as_bytes(src);
+        let back = unpack::<S>(S::load(dst));
+        let src = unpack::<S>(S::load(src_bytes));
+        let res = if M::IS_NORMAL {
+            normal::<S>(back, src, opacity_v)
+        } else {
+            blender::<S, M>(back, src, opacity_v)
+        };
+        S::store(pack::<S>(res), dst);
+    }
+    for (dst, src) in dst_chunks
+        .into_remainder()
+        .chunks_exact_mut(4)
+        .zip(src_chunks.remainder())
+    {
+        let backdrop = Rgba([dst[0], dst[1], dst[2], dst[3]]);
+        dst.copy_from_slice(&M::scalar(backdrop, *src, opacity).0);
+    }
+}
+
+pub(crate) fn rgba_as_bytes(pixels: &[Color8]) -> &[u8] {
+    // SAFETY: `Rgba<u8>` is a `#[repr(C)]` wrapper around `[u8; 4]`, so a
+    // slice of pixels has the same layout as a byte slice 4 times as long.
+    unsafe { std::slice::from_raw_parts(pixels.as_ptr() as *const u8, pixels.len() * 4) }
+}
+
+// --- Blend modes -------------------------------------------------------------
+
+trait Mode {
+    /// Use `normal` instead of `blender`.
+    const IS_NORMAL: bool = false;
+    /// The scalar blend function. Used for leftover pixels.
+    fn scalar(backdrop: Color8, src: Color8, opacity: u8) -> Color8;
+    /// The per-channel blend function (see `blend::blend_channel`). Unused
+    /// for normal.
+    unsafe fn channel<S: Simd>(b: S::V, s: S::V) -> S::V;
+}
+
+struct Normal;
+struct Multiply;
+struct Screen;
+struct Darken;
+struct Lighten;
+struct Difference;
+struct Exclusion;
+struct Addition;
+struct Subtract;
+
+impl Mode for Normal {
+    const IS_NORMAL: bool = true;
+    #[inline(always)]
+    fn scalar(backdrop: Color8, src: Color8, opacity: u8) -> Color8 {
+        super::normal(backdrop, src, opacity)
+    }
+    #[inline(always)]
+    unsafe fn channel<S: Simd>(_b: S::V, s: S::V) -> S::V {
+        s
+    }
+}
+
+impl Mode for Multiply {
+    #[inline(always)]
+    fn scalar(backdrop: Color8, src: Color8, opacity: u8) -> Color8 {
+        super::multiply(backdrop, src, opacity)
+    }
+    #[inline(always)]
+    unsafe fn channel<S: Simd>(b: S::V, s: S::V) -> S::V {
+        mul_un8::<S>(b, s)
+    }
+}
+
+impl Mode for Screen {
+    #[inline(always)]
+    fn scalar(backdrop: Color8, src: Color8, opacity: u8) -> Color8 {
+        super::screen(backdrop, src, opacity)
+    }
+    #[inline(always)]
+    unsafe fn channel<S: Simd>(b: S::V, s: S::V) -> S::V {
+        S::sub(S::add(b, s), mul_un8::<S>(b, s))
+    }
+}
+
+impl Mode for Darken {
+    #[inline(always)]
+    fn scalar(backdrop: Color8, src: Color8, opacity: u8) -> Color8 {
+        super::darken(backdrop, src, opacity)
+    }
+    #[inline(always)]
+    unsafe fn channel<S: Simd>(b: S::V, s: S::V) -> S::V {
+        S::min(b, s)
+    }
+}
+
+impl Mode for Lighten {
+    #[inline(always)]
+    fn scalar(backdrop: Color8, src: Color8, opacity: u8) -> Color8 {
+        super::lighten(backdrop, src, opacity)
+    }
+    #[inline(always)]
+    unsafe fn channel<S: Simd>(b: S::V, s: S::V) -> S::V {
+        S::max(b, s)
+    }
+}
+
+impl Mode for Difference {
+    #[inline(always)]
+    fn scalar(backdrop: Color8, src: Color8, opacity: u8) -> Color8 {
+        super::difference(backdrop, src, opacity)
+    }
+    #[inline(always)]
+    unsafe fn channel<S: Simd>(b: S::V, s: S::V) -> S::V {
+        S::abs(S::sub(b, s))
+    }
+}
+
+impl Mode for Exclusion {
+    #[inline(always)]
+    fn scalar(backdrop: Color8, src: Color8, opacity: u8) -> Color8 {
+        super::exclusion(backdrop, src, opacity)
+    }
+    #[inline(always)]
+    unsafe fn channel<S: Simd>(b: S::V, s: S::V) -> S::V {
+        let t = mul_un8::<S>(b, s);
+        S::sub(S::add(b, s), S::add(t, t))
+    }
+}
+
+impl Mode for Addition {
+    #[inline(always)]
+    fn scalar(backdrop: Color8, src: Color8, opacity: u8) -> Color8 {
+        super::addition(backdrop, src, opacity)
+    }
+    #[inline(always)]
+    unsafe fn channel<S: Simd>(b: S::V, s: S::V) -> S::V {
+        S::min(S::add(b, s), S::splat(255))
+    }
+}
+
+impl Mode for Subtract {
+    #[inline(always)]
+    fn scalar(backdrop: Color8, src: Color8, opacity: u8) -> Color8 {
+        super::subtract(backdrop, src, opacity)
+    }
+    #[inline(always)]
+    unsafe fn channel<S: Simd>(b: S::V, s: S::V) -> S::V {
+        S::max(S::sub(b, s), S::splat(0))
+    }
+}
+
+// --- HSL blend modes ---------------------------------------------------------
+
+// The non-separable blend modes compute in `f64` (see `blend.rs`), so they need
+// `f64` lanes on top of `Simd`. Every lane does the same `f64` operations in
+// the same order as the scalar functions, so the results are bit-identical.
+// Branches are replaced by selects like above.
+//
+// Only implemented for x86. Other targets use the scalar functions.
+#[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+mod hsl {
+    use super::{composite, pack, rgba_as_bytes, unpack, Color8, Px, RowKernel, Simd};
+    use image::Rgba;
+
+    // Operations on `LANES` `f64` values, for the `i32` lanes of `Simd`.
+    pub(super) trait SimdF64: Simd {
+        type F: Copy;
+
+        unsafe fn to_f64(a: Self::V) -> Self::F;
+        /// Rounded towards zero. Lanes must be in the `i32` range.
+        unsafe fn trunc(a: Self::F) -> Self::V;
+        unsafe fn fsplat(x: f64) -> Self::F;
+        unsafe fn fadd(a: Self::F, b: Self::F) -> Self::F;
+        unsafe fn fsub(a: Self::F, b: Self::F) -> Self::F;
+        unsafe fn fmul(a: Self::F, b: Self::F) -> Self::F;
+        unsafe fn fdiv(a: Self::F, b: Self::F) -> Self::F;
+        unsafe fn fmin(a: Self::F, b: Self::F) -> Self::F;
+        unsafe fn fmax(a: Self::F, b: Self::F) -> Self::F;
+        /// All bits set in lanes where `a < b`.
+        unsafe fn flt(a: Self::F, b: Self::F) -> Self::F;
+        unsafe fn mask_and(a: Self::F, b: Self::F) -> Self::F;
+        unsafe fn mask_or(a: Self::F, b: Self::F) -> Self::F;
+        /// `!a & b`.
+        unsafe fn mask_andnot(a: Self::F, b: Self::F) -> Self::F;
+        /// Per lane `if mask { a } else { b }`. Mask lanes must be all ones or
+        /// all zeros.
+        unsafe fn fselect(mask: Self::F, a: Self::F, b: Self::F) -> Self::F;
+        /// True if all lanes of `a` and `b` are equal.
+        unsafe fn all_eq(a: Self::V, b: Self::V) -> bool;
+    }
+
+    pub(super) fn kernel_for<M: HslMode>() -> Option<RowKernel> {
+        use super::x86;
+        if is_x86_feature_detected!("avx2") {
+            Some(x86::blend_row_hsl_avx2::<M>)
+        } else if is_x86_feature_detected!("sse2") {
+            Some(x86::blend_row_hsl_sse2::<M>)
+        } else {
+            None
+        }
+    }
+
+    #[derive(Clone, Copy)]
+    pub(super) struct Rgb<F> {
+        r: F,
+        g: F,
+        b: F,
+    }
+
+    // See `blend::as_rgb_f64`.
+    #[inline(always)]
+    unsafe fn as_rgb_f64<S: SimdF64>(p: Px<S::V>) -> Rgb<S::F> {
+        let max = S::fsplat(255.0);
+        Rgb {
+            r: S::fdiv(S::to_f64(p.r), max),
+            g: S::fdiv(S::to_f64(p.g), max),
+            b: S::fdiv(S::to_f64(p.b), max),
+        }
+    }
+
+    // See `blend::from_rgb_f64`, which truncates with `as i32` and then keeps
+    // the low byte with `as u8`. `as i32` maps NaN to 0 and saturates, which
+    // we take care of before truncating.
+    #[inline(always)]
+    unsafe fn from_rgb_f64<S: SimdF64>(c: Rgb<S::F>, a: S::V) -> Px<S::V> {
+        Px {
+            r: from_f64_channel::<S>(c.r),
+            g: from_f64_channel::<S>(c.g),
+            b: from_f64_channel::<S>(c.b),
+            a,
+        }
+    }
+
+    // Like in the parent module, the helpers here are functions rather than
+    // closures so they get inlined into the kernels.
+    #[inline(always)]
+    unsafe fn from_f64_channel<S: SimdF64>(x: S::F) -> S::V {
+        let x = S::fmul(x, S::fsplat(255.0));
+        let x = S::fselect(S::flt(S::fsplat(i32::MIN as f64), x), x, S::fsplat(0.0));
+        let x = S::fselect(S::flt(S::fsplat(i32::MAX as f64), x), S::fsplat(255.0), x);
+        S::and(S::trunc(x), S::splat(0xff))
+    }
+
+    // See `blend::saturation`.
+    #[inline(always)]
+    unsafe fn saturation<S: SimdF64>(c: Rgb<S::F>) -> S::F {
+        S::fsub(
+            S::fmax(c.r, S::fmax(c.g, c.b)),
+            S::fmin(c.r, S::fmin(c.g, c.b)),
+        )
+    }
+
+    // See `blend::luminosity`.
+    #[inline(always)]
+    unsafe fn luminosity<S: SimdF64>(c: Rgb<S::F>) -> S::F {
+        S::fadd(
+            S::fadd(S::fmul(S::fsplat(0.3), c.r), S::fmul(S::fsplat(0.59), c.g)),
+            S::fmul(S::fsplat(0.11), c.b),
+        )
+    }
+
+    // See `blend::set_luminocity`.
+    #[inline(always)]
+    unsafe fn set_luminosity<S: SimdF64>(c: Rgb<S::F>, lum: S::F) -> Rgb<S::F> {
+        let delta = S::fsub(lum, luminosity::<S>(c));
+        clip_color::<S>(Rgb {
+            r: S::fadd(c.r, delta),
+            g: S::fadd(c.g, delta),
+            b: S::fadd(c.b, delta),
+        })
+    }
+
+    // See `blend::clip_color`.
+    #[inline(always)]
+    unsafe fn clip_color<S: SimdF64>(c: Rgb<S::F>) -> Rgb<S::F> {
+        let lum = luminosity::<S>(c);
+        let min = S::fmin(c.r, S::fmin(c.g, c.b));
+        let max = S::fmax(c.r, S::fmax(c.g, c.b));
+
+        // lum + (x - lum) * lum / (lum - min)
+        let below = S::flt(min, S::fsplat(0.0));
+        let lum_min = S::fsub(lum, min);
+        let c = Rgb {
+            r: clip_channel::<S>(below, c.r, lum, lum, lum_min),
+            g: clip_channel::<S>(below, c.g, lum, lum, lum_min),
+            b: clip_channel::<S>(below, c.b, lum, lum, lum_min),
+        };
+
+        // lum + (x - lum) * (1 - lum) / (max - lum)
+        let above = S::flt(S::fsplat(1.0), max);
+        let one_lum = S::fsub(S::fsplat(1.0), lum);
+        let max_lum = S::fsub(max, lum);
+        Rgb {
+            r: clip_channel::<S>(above, c.r, lum, one_lum, max_lum),
+            g: clip_channel::<S>(above, c.g, lum, one_lum, max_lum),
+            b: clip_channel::<S>(above, c.b, lum, one_lum, max_lum),
+        }
+    }
+
+    // `lum + (x - lum) * num / den` in lanes where `mask` is set, `x` elsewhere.
+    #[inline(always)]
+    unsafe fn clip_channel<S: SimdF64>(
+        mask: S::F,
+        x: S::F,
+        lum: S::F,
+        num: S::F,
+        den: S::F,
+    ) -> S::F {
+        let clipped = S::fadd(lum, S::fdiv(S::fmul(S::fsub(x, lum), num), den));
+        S::fselect(mask, clipped, x)
+    }
+
+    // See `blend::set_saturation`, including the way `static_sort3_orig`
+    // picks the channels (which `ASEPRITE_SATURATION_BUG_COMPATIBLE` asks for).
+    #[inline(always)]
+    unsafe fn set_saturation<S: SimdF64>(c: Rgb<S::F>, sat: S::F) -> Rgb<S::F> {
+        let r_lt_g = S::flt(c.r, c.g);
+        let g_lt_b = S::flt(c.g, c.b);
+        let g_lt_r = S::flt(c.g, c.r);
+        let b_lt_g = S::flt(c.b, c.g);
+        let b_lt_r = S::flt(c.b, c.r);
+        let r_lt_b = S::flt(c.r, c.b);
+
+        let min_is_r = S::mask_and(r_lt_g, r_lt_b);
+        let min_is_g = S::mask_andnot(min_is_r, g_lt_b);
+        let max_is_r = S::mask_and(g_lt_r, b_lt_r);
+        let max_is_g = S::mask_andnot(max_is_r, b_lt_g);
+        // `mid` is `g` if `r > g > b` or `!(r > g) && !(g > b)`, and `b` if
+        // `r > g && !(g > b) && r > b` or `!(r > g) && g > b && b > r`.
+        let mid_is_g = S::mask_or(
+            S::mask_and(g_lt_r, b_lt_g),
+            mask_not::<S>(S::mask_or(g_lt_r, b_lt_g)),
+        );
+        let mid_is_b = S::mask_or(
+            S::mask_and(S::mask_andnot(b_lt_g, g_lt_r), b_lt_r),
+            S::mask_and(S::mask_andnot(g_lt_r, b_lt_g), r_lt_b),
+        );
+        let mid_is_r = mask_not::<S>(S::mask_or(mid_is_g, mid_is_b));
+
+        let min = pick::<S>(c, min_is_r, min_is_g);
+        let mid = pick::<S>(c, mid_is_r, mid_is_g);
+        let max = pick::<S>(c, max_is_r, max_is_g);
+
+        let zero = S::fsplat(0.0);
+        let has_range = S::flt(min, max);
+        let new_mid = S::fselect(
+            has_range,
+            S::fdiv(S::fmul(S::fsub(mid, min), sat), S::fsub(max, min)),
+            zero,
+        );
+        let new_max = S::fselect(has_range, sat, zero);
+        let min_is_b = mask_not::<S>(S::mask_or(min_is_r, min_is_g));
+        let max_is_b = mask_not::<S>(S::mask_or(max_is_r, max_is_g));
+        let new = (new_mid, new_max);
+        Rgb {
+            r: saturation_channel::<S>(c.r, new, min_is_r, mid_is_r, max_is_r),
+            g: saturation_channel::<S>(c.g, new, min_is_g, mid_is_g, max_is_g),
+            b: saturation_channel::<S>(c.b, new, min_is_b, mid_is_b, max_is_b),
+        }
+    }
+
+    // The scalar version assigns `mid`, then `max`, then `min`, so later ones
+    // win if `static_sort3_orig` returns the same channel twice.
+    #[inline(always)]
+    unsafe fn saturation_channel<S: SimdF64>(
+        x: S::F,
+        (new_mid, new_max): (S::F, S::F),
+        is_min: S::F,
+        is_mid: S::F,
+        is_max: S::F,
+    ) -> S::F {
+        let x = S::fselect(is_mid, new_mid, x);
+        let x = S::fselect(is_max, new_max, x);
+        S::fselect(is_min, S::fsplat(0.0), x)
+    }
+
+    #[inline(always)]
+    unsafe fn mask_not<S: SimdF64>(mask: S::F) -> S::F {
+        S::mask_andnot(mask, S::fsplat(f64::from_bits(!0)))
+    }
+
+    // `c.r` in lanes where `is_r` is set, otherwise `c.g` where `is_g` is set,
+    // otherwise `c.b`.
+    #[inline(always)]
+    unsafe fn pick<S: SimdF64>(c: Rgb<S::F>, is_r: S::F, is_g: S::F) -> S::F {
+        S::fselect(is_r, c.r, S::fselect(is_g, c.g, c.b))
+    }
+
+    #[inline(always)]
+    pub(super) unsafe fn blend_row_impl<S: SimdF64, M: HslMode>(
+        dst: &mut [u8],
+        src: &[Color8],
+        opacity: u8,
+    ) {
+        assert_eq!(dst.len(), src.len() * 4);
+        let opacity_v = S::splat(opacity as i32);
+        let chunk_bytes = S::LANES * 4;
+        let mut dst_chunks = dst.chunks_exact_mut(chunk_bytes);
+        let mut src_chunks = src.chunks_exact(S::LANES);
+        // Like `render::blend_row_memoized`, skip the math if the pixels are
+        // the same as the previous ones, which is common in flat areas.
+        let mut last: Option<(S::V, S::V, S::V)> = None;
+        for (dst, src) in (&mut dst_chunks).zip(&mut src_chunks) {
+            let back_v = S::load(dst);
+            let src_v = S::load(rgba_as_bytes(src));
+            let res = match last {
+                Some((last_back, last_src, last_res))
+                    if S::all_eq(last_back, back_v) && S::all_eq(last_src, src_v) =>
+                {
+                    last_res
+                }
+                _ => {
+                    let back = unpack::<S>(back_v);
+                    let src = unpack::<S>(src_v);
+                    let color = M::color::<S>(as_rgb_f64::<S>(back), as_rgb_f64::<S>(src));
+                    let blend_src = from_rgb_f64::<S>(color, src.a);
+                    let res = pack::<S>(composite::<S>(back, src, blend_src, opacity_v));
+                    last = Some((back_v, src_v, res));
+                    res
+                }
+            };
+            S::store(res, dst);
+        }
+        for (dst, src) in dst_chunks
+            .into_remainder()
+            .chunks_exact_mut(4)
+            .zip(src_chunks.remainder())
+        {
+            let backdrop = Rgba([dst[0], dst[1], dst[2], dst[3]]);
+            dst.copy_from_slice(&M::scalar(backdrop, *src, opacity).0);
+        }
+    }
+
+    pub(super) trait HslMode {
+        /// The scalar blend function. Used for leftover pixels.
+        fn scalar(backdrop: Color8, src: Color8, opacity: u8) -> Color8;
+        /// The color the blend mode composites onto the backdrop. See
+        /// `blend::hsl_hue_color` and friends.
+        unsafe fn color<S: SimdF64>(back: Rgb<S::F>, src: Rgb<S::F>) -> Rgb<S::F>;
+    }
+
+    pub(super) struct Hue;
+    pub(super) struct Saturation;
+    pub(super) struct Color;
+    pub(super) struct Luminosity;
+
+    impl HslMode for Hue {
+        #[inline(always)]
+        fn scalar(backdrop: Color8, src: Color8, opacity: u8) -> Color8 {
+            super::super::hsl_hue(backdrop, src, opacity)
+        }
+        #[inline(always)]
+        unsafe fn color<S: SimdF64>(back: Rgb<S::F>, src: Rgb<S::F>) -> Rgb<S::F> {
+            let sat = saturation::<S>(back);
+            let lum = luminosity::<S>(back);
+            set_luminosity::<S>(set_saturation::<S>(src, sat), lum)
+        }
+    }
+
+    impl HslMode for Saturation {
+        #[inline(always)]
+        fn scalar(backdrop: Color8, src: Color8, opacity: u8) -> Color8 {
+            super::super::hsl_saturation(backdrop, src, opacity)
+        }
+        #[inline(always)]
+        unsafe fn color<S: SimdF64>(back: Rgb<S::F>, src: Rgb<S::F>) -> Rgb<S::F> {
+            let sat = saturation::<S>(src);
+            let lum = luminosity::<S>(back);
+            set_luminosity::<S>(set_saturation::<S>(back, sat), lum)
+        }
+    }
+
+    impl HslMode for Color {
+        #[inline(always)]
+        fn scalar(backdrop: Color8, src: Color8, opacity: u8) -> Color8 {
+            super::super::hsl_color(backdrop, src, opacity)
+        }
+        #[inline(always)]
+        unsafe fn color<S: SimdF64>(back: Rgb<S::F>, src: Rgb<S::F>) -> Rgb<S::F> {
+            set_luminosity::<S>(src, luminosity::<S>(back))
+        }
+    }
+
+    impl HslMode for Luminosity {
+        #[inline(always)]
+        fn scalar(backdrop: Color8, src: Color8, opacity: u8) -> Color8 {
+            super::super::hsl_luminosity(backdrop, src, opacity)
+        }
+        #[inline(always)]
+        unsafe fn color<S: SimdF64>(back: Rgb<S::F>, src: Rgb<S::F>) -> Rgb<S::F> {
+            set_luminosity::<S>(back, luminosity::<S>(src))
+        }
+    }
+}
+
+// --- x86 / x86_64 ------------------------------------------------------------
+
+#[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+mod x86 {
+    use super::{
+        blend_row_impl,
+        hsl::{self, HslMode, SimdF64},
+        Color8, Mode, Simd,
+    };
+    #[cfg(target_arch = "x86")]
+    use std::arch::x86::*;
+    #[cfg(target_arch = "x86_64")]
+    use std::arch::x86_64::*;
+
+    // Only handed out by `kernel_for` after checking for SSE2 support.
+    pub(super) fn blend_row_sse2<M: Mode>(dst: &mut [u8], src: &[Color8], opacity: u8) {
+        unsafe { blend_row_sse2_impl::<M>(dst, src, opacity) }
+    }
+
+    #[target_feature(enable = "sse2")]
+    unsafe fn blend_row_sse2_impl<M: Mode>(dst: &mut [u8], src: &[Color8], opacity: u8) {
+        blend_row_impl::<Sse2, M>(dst, src, opacity)
+    }
+
+    // Only handed out by `kernel_for` after checking for AVX2 support.
+    pub(super) fn blend_row_avx2<M: Mode>(dst: &mut [u8], src: &[Color8], opacity: u8) {
+        unsafe { blend_row_avx2_impl::<M>(dst, src, opacity) }
+    }
+
+    #[target_feature(enable = "avx2")]
+    unsafe fn blend_row_avx2_impl<M: Mode>(dst: &mut [u8], src: &[Color8], opacity: u8) {
+        blend_row_impl::<Avx2, M>(dst, src, opacity)
+    }
+
+    // Only handed out by `hsl::kernel_for` after checking for SSE2 support.
+    pub(super) fn blend_row_hsl_sse2<M: HslMode>(dst: &mut [u8], src: &[Color8], opacity: u8) {
+        unsafe { blend_row_hsl_sse2_impl::<M>(dst, src, opacity) }
+    }
+
+    #[target_feature(enable = "sse2")]
+    unsafe fn blend_row_hsl_sse2_impl<M: HslMode>(dst: &mut [u8], src: &[Color8], opacity: u8) {
+        hsl::blend_row_impl::<Sse2, M>(dst, src, opacity)
+    }
+
+    // Only handed out by `hsl::kernel_for` after checking for AVX2 support.
+    pub(super) fn blend_row_hsl_avx2<M: HslMode>(dst: &mut [u8], src: &[Color8], opacity: u8) {
+        unsafe { blend_row_hsl_avx2_impl::<M>(dst, src, opacity) }
+    }
+
+    #[target_feature(enable = "avx2")]
+    unsafe fn blend_row_hsl_avx2_impl<M: HslMode>(dst: &mut [u8], src: &[Color8], opacity: u8) {
+        hsl::blend_row_impl::<Avx2, M>(dst, src, opacity)
+    }
+
+    pub(super) struct Sse2;
+
+    impl Simd for Sse2 {
+        type V = __m128i;
+        const LANES: usize = 4;
+
+        #[inline(always)]
+        unsafe fn splat(x: i32) -> __m128i {
+            _mm_set1_epi32(x)
+        }
+        #[inline(always)]
+        unsafe fn load(bytes: &[u8]) -> __m128i {
+            assert!(bytes.len() >= 16);
+            _mm_loadu_si128(bytes.as_ptr() as *const __m128i)
+        }
+        #[inline(always)]
+        unsafe fn store(v: __m128i, bytes: &mut [u8]) {
+            assert!(bytes.len() >= 16);
+            _mm_storeu_si128(bytes.as_mut_ptr() as *mut __m128i, v)
+        }
+        #[inline(always)]
+        unsafe fn add(a: __m128i, b: __m128i) -> __m128i {
+            _mm_add_epi32(a, b)
+        }
+        #[inline(always)]
+        unsafe fn sub(a: __m128i, b: __m128i) -> __m128i {
+            _mm_sub_epi32(a, b)
+        }
+        #[inline(always)]
+        unsafe fn mul(a: __m128i, b: __m128i) -> __m128i {
+            // SSE2 has no 32-bit `mullo`. Multiply even and odd lanes
+            // separately and shuffle the low halves back together.
+            let even = _mm_mul_epu32(a, b);
+            let odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+            _mm_unpacklo_epi32(
+                _mm_shuffle_epi32(even, 0b00_00_10_00),
+                _mm_shuffle_epi32(odd, 0b00_00_10_00),
+            )
+        }
+        #[inline(always)]
+        unsafe fn and(a: __m128i, b: __m128i) -> __m128i {
+            _mm_and_si128(a, b)
+        }
+        #[inline(always)]
+        unsafe fn or(a: __m128i, b: __m128i) -> __m128i {
+            _mm_or_si128(a, b)
+        }
+        #[inline(always)]
+        unsafe fn min(a: __m128i, b: __m128i) -> __m128i {
+            Self::select(_mm_cmpgt_epi32(a, b), b, a)
+        }
+        #[inline(always)]
+        unsafe fn max(a: __m128i, b: __m128i) -> __m128i {
+            Self::select(_mm_cmpgt_epi32(a, b), a, b)
+        }
+        #[inline(always)]
+        unsafe fn abs(a: __m128i) -> __m128i {
+            let sign = _mm_srai_epi32(a, 31);
+            _mm_sub_epi32(_mm_xor_si128(a, sign), sign)
+        }
+        #[inline(always)]
+        unsafe fn sra8(a: __m128i) -> __m128i {
+            _mm_srai_epi32(a, 8)
+        }
+        #[inline(always)]
+        unsafe fn srl8(a: __m128i) -> __m128i {
+            _mm_srli_epi32(a, 8)
+        }
+        #[inline(always)]
+        unsafe fn srl16(a: __m128i) -> __m128i {
+            _mm_srli_epi32(a, 16)
+        }
+        #[inline(always)]
+        unsafe fn srl24(a: __m128i) -> __m128i {
+            _mm_srli_epi32(a, 24)
+        }
+        #[inline(always)]
+        unsafe fn sll8(a: __m128i) -> __m128i {
+            _mm_slli_epi32(a, 8)
+        }
+        #[inline(always)]
+        unsafe fn sll16(a: __m128i) -> __m128i {
+            _mm_slli_epi32(a, 16)
+        }
+        #[inline(always)]
+        unsafe fn sll24(a: __m128i) -> __m128i {
+            _mm_slli_epi32(a, 24)
+        }
+        #[inline(always)]
+        unsafe fn eq(a: __m128i, b: __m128i) -> __m128i {
+            _mm_cmpeq_epi32(a, b)
+        }
+        #[inline(always)]
+        unsafe fn select(mask: __m128i, a: __m128i, b: __m128i) -> __m128i {
+            _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b))
+        }
+        #[inline(always)]
+        unsafe fn div(a: __m128i, b: __m128i) -> __m128i {
+            _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(a), _mm_cvtepi32_ps(b)))
+        }
+    }
+
+    impl SimdF64 for Sse2 {
+        // Two lanes each.
+        type F = [__m128d; 2];
+
+        #[inline(always)]
+        unsafe fn to_f64(a: __m128i) -> [__m128d; 2] {
+            [
+                _mm_cvtepi32_pd(a),
+                _mm_cvtepi32_pd(_mm_shuffle_epi32(a, 0b11_10_11_10)),
+            ]
+        }
+        #[inline(always)]
+        unsafe fn trunc(a: [__m128d; 2]) -> __m128i {
+            _mm_unpacklo_epi64(_mm_cvttpd_epi32(a[0]), _mm_cvttpd_epi32(a[1]))
+        }
+        #[inline(always)]
+        unsafe fn fsplat(x: f64) -> [__m128d; 2] {
+            [_mm_set1_pd(x); 2]
+        }
+        #[inline(always)]
+        unsafe fn fadd(a: [__m128d; 2], b: [__m128d; 2]) -> [__m128d; 2] {
+            [_mm_add_pd(a[0], b[0]), _mm_add_pd(a[1], b[1])]
+        }
+        #[inline(always)]
+        unsafe fn fsub(a: [__m128d; 2], b: [__m128d; 2]) -> [__m128d; 2] {
+            [_mm_sub_pd(a[0], b[0]), _mm_sub_pd(a[1], b[1])]
+        }
+        #[inline(always)]
+        unsafe fn fmul(a: [__m128d; 2], b: [__m128d; 2]) -> [__m128d; 2] {
+            [_mm_mul_pd(a[0], b[0]), _mm_mul_pd(a[1], b[1])]
+        }
+        #[inline(always)]
+        unsafe fn fdiv(a: [__m128d; 2], b: [__m128d; 2]) -> [__m128d; 2] {
+            [_mm_div_pd(a[0], b[0]), _mm_div_pd(a[1], b[1])]
+        }
+        #[inline(always)]
+        unsafe fn fmin(a: [__m128d; 2], b: [__m128d; 2]) -> [__m128d; 2] {
+            [_mm_min_pd(a[0], b[0]), _mm_min_pd(a[1], b[1])]
+        }
+        #[inline(always)]
+        unsafe fn fmax(a: [__m128d; 2], b: [__m128d; 2]) -> [__m128d; 2] {
+            [_mm_max_pd(a[0], b[0]), _mm_max_pd(a[1], b[1])]
+        }
+        #[inline(always)]
+        unsafe fn flt(a: [__m128d; 2], b: [__m128d; 2]) -> [__m128d; 2] {
+            [_mm_cmplt_pd(a[0], b[0]), _mm_cmplt_pd(a[1], b[1])]
+        }
+        #[inline(always)]
+        unsafe fn mask_and(a: [__m128d; 2], b: [__m128d; 2]) -> [__m128d; 2] {
+            [_mm_and_pd(a[0], b[0]), _mm_and_pd(a[1], b[1])]
+        }
+        #[inline(always)]
+        unsafe fn mask_or(a: [__m128d; 2], b: [__m128d; 2]) -> [__m128d; 2] {
+            [_mm_or_pd(a[0], b[0]), _mm_or_pd(a[1], b[1])]
+        }
+        #[inline(always)]
+        unsafe fn mask_andnot(a: [__m128d; 2], b: [__m128d; 2]) -> [__m128d; 2] {
+            [_mm_andnot_pd(a[0], b[0]), _mm_andnot_pd(a[1], b[1])]
+        }
+        #[inline(always)]
+        unsafe fn fselect(mask: [__m128d; 2], a: [__m128d; 2], b: [__m128d; 2]) -> [__m128d; 2] {
+            [
+                _mm_or_pd(_mm_and_pd(mask[0], a[0]), _mm_andnot_pd(mask[0], b[0])),
+                _mm_or_pd(_mm_and_pd(mask[1], a[1]), _mm_andnot_pd(mask[1], b[1])),
+            ]
+        }
+        #[inline(always)]
+        unsafe fn all_eq(a: __m128i, b: __m128i) -> bool {
+            _mm_movemask_epi8(_mm_cmpeq_epi32(a, b)) == 0xffff
+        }
+    }
+
+    pub(super) struct Avx2;
+
+    impl Simd for Avx2 {
+        type V = __m256i;
+        const LANES: usize = 8;
+
+        #[inline(always)]
+        unsafe fn splat(x: i32) -> __m256i {
+            _mm256_set1_epi32(x)
+        }
+        #[inline(always)]
+        unsafe fn load(bytes: &[u8]) -> __m256i {
+            assert!(bytes.len() >= 32);
+            _mm256_loadu_si256(bytes.as_ptr() as *const __m256i)
+        }
+        #[inline(always)]
+        unsafe fn store(v: __m256i, bytes: &mut [u8]) {
+            assert!(bytes.len() >= 32);
+            _mm256_storeu_si256(bytes.as_mut_ptr() as *mut __m256i, v)
+        }
+        #[inline(always)]
+        unsafe fn add(a: __m256i, b: __m256i) -> __m256i {
+            _mm256_add_epi32(a, b)
+        }
+        #[inline(always)]
+        unsafe fn sub(a: __m256i, b: __m256i) -> __m256i {
+            _mm256_sub_epi32(a, b)
+        }
+        #[inline(always)]
+        unsafe fn mul(a: __m256i, b: __m256i) -> __m256i {
+            _mm256_mullo_epi32(a, b)
+        }
+        #[inline(always)]
+        unsafe fn and(a: __m256i, b: __m256i) -> __m256i {
+            _mm256_and_si256(a, b)
+        }
+        #[inline(always)]
+        unsafe fn or(a: __m256i, b: __m256i) -> __m256i {
+            _mm256_or_si256(a, b)
+        }
+        #[inline(always)]
+        unsafe fn min(a: __m256i, b: __m256i) -> __m256i {
+            _mm256_min_epi32(a, b)
+        }
+        #[inline(always)]
+        unsafe fn max(a: __m256i, b: __m256i) -> __m256i {
+            _mm256_max_epi32(a, b)
+        }
+        #[inline(always)]
+        unsafe fn abs(a: __m256i) -> __m256i {
+            _mm256_abs_epi32(a)
+        }
+        #[inline(always)]
+        unsafe fn sra8(a: __m256i) -> __m256i {
+            _mm256_srai_epi32(a, 8)
+        }
+        #[inline(always)]
+        unsafe fn srl8(a: __m256i) -> __m256i {
+            _mm256_srli_epi32(a, 8)
+        }
+        #[inline(always)]
+        unsafe fn srl16(a: __m256i) -> __m256i {
+            _mm256_srli_epi32(a, 16)
+        }
+        #[inline(always)]
+        unsafe fn srl24(a: __m256i) -> __m256i {
+            _mm256_srli_epi32(a, 24)
+        }
+        #[inline(always)]
+        unsafe fn sll8(a: __m256i) -> __m256i {
+            _mm256_slli_epi32(a, 8)
+        }
+        #[inline(always)]
+        unsafe fn sll16(a: __m256i) -> __m256i {
+            _mm256_slli_epi32(a, 16)
+        }
+        #[inline(always)]
+        unsafe fn sll24(a: __m256i) -> __m256i {
+            _mm256_slli_epi32(a, 24)
+        }
+        #[inline(always)]
+        unsafe fn eq(a: __m256i, b: __m256i) -> __m256i {
+            _mm256_cmpeq_epi32(a, b)
+        }
+        #[inline(always)]
+        unsafe fn select(mask: __m256i, a: __m256i, b: __m256i) -> __m256i {
+            _mm256_blendv_epi8(b, a, mask)
+        }
+        #[inline(always)]
+        unsafe fn div(a: __m256i, b: __m256i) -> __m256i {
+            _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(a), _mm256_cvtepi32_ps(b)))
+        }
+    }
+
+    impl SimdF64 for Avx2 {
+        // Four lanes each.
+        type F = [__m256d; 2];
+
+        #[inline(always)]
+        unsafe fn to_f64(a: __m256i) -> [__m256d; 2] {
+            [
+                _mm256_cvtepi32_pd(_mm256_castsi256_si128(a)),
+                _mm256_cvtepi32_pd(_mm256_extracti128_si256(a, 1)),
+            ]
+        }
+        #[inline(always)]
+        unsafe fn trunc(a: [__m256d; 2]) -> __m256i {
+            _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm256_cvttpd_epi32(a[0])),
+                _mm256_cvttpd_epi32(a[1]),
+                1,
+            )
+        }
+        #[inline(always)]
+        unsafe fn fsplat(x: f64) -> [__m256d; 2] {
+            [_mm256_set1_pd(x); 2]
+        }
+        #[inline(always)]
+        unsafe fn fadd(a: [__m256d; 2], b: [__m256d; 2]) -> [__m256d; 2] {
+            [_mm256_add_pd(a[0], b[0]), _mm256_add_pd(a[1], b[1])]
+        }
+        #[inline(always)]
+        unsafe fn fsub(a: [__m256d; 2], b: [__m256d; 2]) -> [__m256d; 2] {
+            [_mm256_sub_pd(a[0], b[0]), _mm256_sub_pd(a[1], b[1])]
+        }
+        #[inline(always)]
+        unsafe fn fmul(a: [__m256d; 2], b: [__m256d; 2]) -> [__m256d; 2] {
+            [_mm256_mul_pd(a[0], b[0]), _mm256_mul_pd(a[1], b[1])]
+        }
+        #[inline(always)]
+        unsafe fn fdiv(a: [__m256d; 2], b: [__m256d; 2]) -> [__m256d; 2] {
+            [_mm256_div_pd(a[0], b[0]), _mm256_div_pd(a[1], b[1])]
+        }
+        #[inline(always)]
+        unsafe fn fmin(a: [__m256d; 2], b: [__m256d; 2]) -> [__m256d; 2] {
+            [_mm256_min_pd(a[0], b[0]), _mm256_min_pd(a[1], b[1])]
+        }
+        #[inline(always)]
+        unsafe fn fmax(a: [__m256d; 2], b: [__m256d; 2]) -> [__m256d; 2] {
+            [_mm256_max_pd(a[0], b[0]), _mm256_max_pd(a[1], b[1])]
+        }
+        #[inline(always)]
+        unsafe fn flt(a: [__m256d; 2], b: [__m256d; 2]) -> [__m256d; 2] {
+            [
+                _mm256_cmp_pd(a[0], b[0], _CMP_LT_OQ),
+                _mm256_cmp_pd(a[1], b[1], _CMP_LT_OQ),
+            ]
+        }
+        #[inline(always)]
+        unsafe fn mask_and(a: [__m256d; 2], b: [__m256d; 2]) -> [__m256d; 2] {
+            [_mm256_and_pd(a[0], b[0]), _mm256_and_pd(a[1], b[1])]
+        }
+        #[inline(always)]
+        unsafe fn mask_or(a: [__m256d; 2], b: [__m256d; 2]) -> [__m256d; 2] {
+            [_mm256_or_pd(a[0], b[0]), _mm256_or_pd(a[1], b[1])]
+        }
+        #[inline(always)]
+        unsafe fn mask_andnot(a: [__m256d; 2], b: [__m256d; 2]) -> [__m256d; 2] {
+            [_mm256_andnot_pd(a[0], b[0]), _mm256_andnot_pd(a[1], b[1])]
+        }
+        #[inline(always)]
+        unsafe fn fselect(mask: [__m256d; 2], a: [__m256d; 2], b: [__m256d; 2]) -> [__m256d; 2] {
+            [
+                _mm256_blendv_pd(b[0], a[0], mask[0]),
+                _mm256_blendv_pd(b[1], a[1], mask[1]),
+            ]
+        }
+        #[inline(always)]
+        unsafe fn all_eq(a: __m256i, b: __m256i) -> bool {
+            _mm256_movemask_epi8(_mm256_cmpeq_epi32(a, b)) == -1
+        }
+    }
+}
+
+// --- aarch64 -----------------------------------------------------------------
+
+#[cfg(target_arch = "aarch64")]
+mod neon {
+    use super::{blend_row_impl, Color8, Mode, Simd};
+    use std::arch::aarch64::*;
+
+    // NEON is always available on aarch64.
+    pub(super) fn blend_row_neon<M: Mode>(dst: &mut [u8], src: &[Color8], opacity: u8) {
+        unsafe { blend_row_neon_impl::<M>(dst, src, opacity) }
+    }
+
+    #[target_feature(enable = "neon")]
+    unsafe fn blend_row_neon_impl<M: Mode>(dst: &mut [u8], src: &[Color8], opacity: u8) {
+        blend_row_impl::<Neon, M>(dst, src, opacity)
+    }
+
+    pub(super) struct Neon;
+
+    impl Simd for Neon {
+        type V = int32x4_t;
+        const LANES: usize = 4;
+
+        #[inline(always)]
+        unsafe fn splat(x: i32) -> int32x4_t {
+            vdupq_n_s32(x)
+        }
+        #[inline(always)]
+        unsafe fn load(bytes: &[u8]) -> int32x4_t {
+            assert!(bytes.len() >= 16);
+            vreinterpretq_s32_u8(vld1q_u8(bytes.as_ptr()))
+        }
+        #[inline(always)]
+        unsafe fn store(v: int32x4_t, bytes: &mut [u8]) {
+            assert!(bytes.len() >= 16);
+            vst1q_u8(bytes.as_mut_ptr(), vreinterpretq_u8_s32(v))
+        }
+        #[inline(always)]
+        unsafe fn add(a: int32x4_t, b: int32x4_t) -> int32x4_t {
+            vaddq_s32(a, b)
+        }
+        #[inline(always)]
+        unsafe fn sub(a: int32x4_t, b: int32x4_t) -> int32x4_t {
+            vsubq_s32(a, b)
+        }
+        #[inline(always)]
+        unsafe fn mul(a: int32x4_t, b: int32x4_t) -> int32x4_t {
+            vmulq_s32(a, b)
+        }
+        #[inline(always)]
+        unsafe fn and(a: int32x4_t, b: int32x4_t) -> int32x4_t {
+            vandq_s32(a, b)
+        }
+        #[inline(always)]
+        unsafe fn or(a: int32x4_t, b: int32x4_t) -> int32x4_t {
+            vorrq_s32(a, b)
+        }
+        #[inline(always)]
+        unsafe fn min(a: int32x4_t, b: int32x4_t) -> int32x4_t {
+            vminq_s32(a, b)
+        }
+        #[inline(always)]
+        unsafe fn max(a: int32x4_t, b: int32x4_t) -> int32x4_t {
+            vmaxq_s32(a, b)
+        }
+        #[inline(always)]
+        unsafe fn abs(a: int32x4_t) -> int32x4_t {
+            vabsq_s32(a)
+        }
+        #[inline(always)]
+        unsafe fn sra8(a: int32x4_t) -> int32x4_t {
+            vshrq_n_s32::<8>(a)
+        }
+        #[inline(always)]
+        unsafe fn srl8(a: int32x4_t) -> int32x4_t {
+            vreinterpretq_s32_u32(vshrq_n_u32::<8>(vreinterpretq_u32_s32(a)))
+        }
+        #[inline(always)]
+        unsafe fn srl16(a: int32x4_t) -> int32x4_t {
+            vreinterpretq_s32_u32(vshrq_n_u32::<16>(vreinterpretq_u32_s32(a)))
+        }
+        #[inline(always)]
+        unsafe fn srl24(a: int32x4_t) -> int32x4_t {
+            vreinterpretq_s32_u32(vshrq_n_u32::<24>(vreinterpretq_u32_s32(a)))
+        }
+        #[inline(always)]
+        unsafe fn sll8(a: int32x4_t) -> int32x4_t {
+            vshlq_n_s32::<8>(a)
+        }
+        #[inline(always)]
+        unsafe fn sll16(a: int32x4_t) -> int32x4_t {
+            vshlq_n_s32::<16>(a)
+        }
+        #[inline(always)]
+        unsafe fn sll24(a: int32x4_t) -> int32x4_t {
+            vshlq_n_s32::<24>(a)
+        }
+        #[inline(always)]
+        unsafe fn eq(a: int32x4_t, b: int32x4_t) -> int32x4_t {
+            vreinterpretq_s32_u32(vceqq_s32(a, b))
+        }
+        #[inline(always)]
+        unsafe fn select(mask: int32x4_t, a: int32x4_t, b: int32x4_t) -> int32x4_t {
+            vbslq_s32(vreinterpretq_u32_s32(mask), a, b)
+        }
+        #[inline(always)]
+        unsafe fn div(a: int32x4_t, b: int32x4_t) -> int32x4_t {
+            vcvtq_s32_f32(vdivq_f32(vcvtq_f32_s32(a), vcvtq_f32_s32(b)))
+        }
+    }
+}
+
+// --- Tests -------------------------------------------------------------------
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::BlendMode;
+
+    const MODES: [BlendMode; 13] = [
+        BlendMode::Normal,
+        BlendMode::Multiply,
+        BlendMode::Screen,
+        BlendMode::Darken,
+        BlendMode::Lighten,
+        BlendMode::Difference,
+        BlendMode::Exclusion,
+        BlendMode::Addition,
+        BlendMode::Subtract,
+        BlendMode::Hue,
+        BlendMode::Saturation,
+        BlendMode::Color,
+        BlendMode::Luminosity,
+    ];
+
+    // Small deterministic PRNG (xorshift32) so failures are reproducible.
+    struct XorShift(u32);
+
+    impl XorShift {
+        fn next(&mut self) -> u32 {
+            let mut x = self.0;
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            self.0 = x;
+            x
+        }
+
+        fn byte(&mut self) -> u8 {
+            (self.next() >> 24) as u8
+        }
+
+        fn pixel(&mut self) -> Color8 {
+            // Bias towards the alpha values that trigger special cases.
+            let alpha = match self.next() % 4 {
+                0 => 0,
+                1 => 255,
+                _ => self.byte(),
+            };
+            Rgba([self.byte(), self.byte(), self.byte(), alpha])
+        }
+    }
+
+    fn check_kernel(name: &str, mode: BlendMode, kernel: RowKernel) {
+        let mut rng = XorShift(0x2545_f491);
+        for round in 0..200 {
+            // Odd lengths exercise the scalar remainder.
+            let len = (rng.next() % 70) as usize;
+            let opacity = match round % 3 {
+                0 => 255,
+                _ => rng.byte(),
+            };
+            let back: Vec<Color8> = (0..len).map(|_| rng.pixel()).collect();
+            let src: Vec<Color8> = (0..len).map(|_| rng.pixel()).collect();
+            let mut dst: Vec<u8> = back.iter().flat_map(|p| p.0).collect();
+            kernel(&mut dst, &src, opacity);
+            for i in 0..len {
+                let expected = crate::blend::dispatch_blend_fn!(mode, |blend_fn| blend_fn(
+                    back[i], src[i], opacity
+                ));
+                let actual = Rgba([dst[4 * i], dst[4 * i + 1], dst[4 * i + 2], dst[4 * i + 3]]);
+                assert_eq!(
+                    expected, actual,
+                    "{} {:?}: back={:?} src={:?} opacity={}",
+                    name, mode, back[i], src[i], opacity
+                );
+            }
+        }
+    }
+
+    #[test]
+    fn selected_kernels_match_scalar() {
+        for mode in MODES.iter() {
+            if let Some(kernel) = row_kernel(*mode) {
+                check_kernel("selected", *mode, kernel);
+            }
+        }
+    }
+
+    #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+    #[test]
+    fn x86_kernels_match_scalar() {
+        fn check<M: Mode>(mode: BlendMode) {
+            if is_x86_feature_detected!("sse2") {
+                check_kernel("sse2", mode, x86::blend_row_sse2::<M>);
+            }
+            if is_x86_feature_detected!("avx2") {
+                check_kernel("avx2", mode, x86::blend_row_avx2::<M>);
+            }
+        }
+        check::<Normal>(BlendMode::Normal);
+        check::<Multiply>(BlendMode::Multiply);
+        check::<Screen>(BlendMode::Screen);
+        check::<Darken>(BlendMode::Darken);
+        check::<Lighten>(BlendMode::Lighten);
+        check::<Difference>(BlendMode::Difference);
+        check::<Exclusion>(BlendMode::Exclusion);
+        check::<Addition>(BlendMode::Addition);
+        check::<Subtract>(BlendMode::Subtract);
+
+        fn check_hsl<M: hsl::HslMode>(mode: BlendMode) {
+            if is_x86_feature_detected!("sse2") {
+                check_kernel("sse2", mode, x86::blend_row_hsl_sse2::<M>);
+            }
+            if is_x86_feature_detected!("avx2") {
+                check_kernel("avx2", mode, x86::blend_row_hsl_avx2::<M>);
+            }
+        }
+        check_hsl::<hsl::Hue>(BlendMode::Hue);
+        check_hsl::<hsl::Saturation>(BlendMode::Saturation);
+        check_hsl::<hsl::Color>(BlendMode::Color);
+        check_hsl::<hsl::Luminosity>(BlendMode::Luminosity);
+    }
+
+    // A larger sample for the HSL kernels, whose `f64` math has many more
+    // corner cases than the integer modes. Pixels repeat in short runs now and
+    // then to exercise the reuse of the previous chunk.
+    #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+    #[test]
+    fn x86_hsl_kernels_match_scalar_sampled() {
+        fn check<M: hsl::HslMode>(name: &str, mode: BlendMode, kernel: RowKernel) {
+            let mut rng = XorShift(0x1234_5678);
+            let len = 1 << 16;
+            let mut back = Vec::with_capacity(len);
+            let mut src = Vec::with_capacity(len);
+            while back.len() < len {
+                let run = if rng.next() % 8 == 0 { 16 } else { 1 };
+                let (b, s) = (rng.pixel(), rng.pixel());
+                for _ in 0..run.min(len - back.len()) {
+                    back.push(b);
+                    src.push(s);
+                }
+            }
+            for &opacity in [255, 128].iter() {
+                let mut dst: Vec<u8> = back.iter().flat_map(|p| p.0).collect();
+                kernel(&mut dst, &src, opacity);
+                for i in 0..len {
+                    let expected = M::scalar(back[i], src[i], opacity);
+                    let actual = Rgba([dst[4 * i], dst[4 * i + 1], dst[4 * i + 2], dst[4 * i + 3]]);
+                    assert_eq!(
+                        expected, actual,
+                        "{} {:?}: back={:?} src={:?} opacity={}",
+                        name, mode, back[i], src[i], opacity
+                    );
+                }
+            }
+        }
+        fn check_isas<M: hsl::HslMode>(mode: BlendMode) {
+            if is_x86_feature_detected!("sse2") {
+                check::<M>("sse2", mode, x86::blend_row_hsl_sse2::<M>);
+            }
+            if is_x86_feature_detected!("avx2") {
+                check::<M>("avx2", mode, x86::blend_row_hsl_avx2::<M>);
+            }
+        }
+        check_isas::<hsl::Hue>(BlendMode::Hue);
+        check_isas::<hsl::Saturation>(BlendMode::Saturation);
+        check_isas::<hsl::Color>(BlendMode::Color);
+        check_isas::<hsl::Luminosity>(BlendMode::Luminosity);
+    }
+}
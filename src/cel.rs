@@ -1,16 +1,22 @@
+use crate::blend::simd::RowKernel;
 use crate::layer::LayerType;
-use crate::pixel::{Pixels, RawPixels};
-use crate::reader::AseReader;
+use crate::pixel::{PixelPool, Pixels, RawPixels};
+use crate::reader::{AseReader, SliceReader};
+use crate::render;
 use crate::tilemap::TilemapData;
+use crate::tileset::TilesetsById;
 use crate::user_data::UserData;
 use crate::{
-    layer::LayersData, AsepriteFile, AsepriteParseError, ColorPalette, PixelFormat, Result,
+    layer::LayersData, AsepriteFile, AsepriteParseError, BlendMode, ColorPalette, LoadOptions,
+    PixelFormat, Result,
 };
 
 use image::RgbaImage;
+use std::collections::hash_map::DefaultHasher;
 use std::fmt;
+use std::hash::{Hash, Hasher};
 use std::io::Read;
-use std::sync::Arc;
+use std::sync::{Arc, OnceLock};
 
 /// A reference to a single Cel. A cel contains the image data at a specific
 /// layer and frame. In the timeline view these are the dots.
@@ -76,6 +82,33 @@ impl<'a> Cel<'a> {
         false
     }
 
+    /// A hash of the cel's image, i.e., its size and its decoded pixels. Cels
+    /// with the same hash look the same, so this is a cheap way to find
+    /// duplicate cels that are not linked, within and across files. A linked
+    /// cel has the hash of the cel it links to.
+    ///
+    /// Computed on first use and then cached, even if the pixels of a lazily
+    /// loaded cel are released. Hashes are only comparable within the same
+    /// build of a program.
+    ///
+    /// Returns `None` for empty cels, tilemap cels, and lazily loaded cels
+    /// whose pixels could not be decoded.
+    pub fn content_hash(&self) -> Option<u64> {
+        let framedata = &self.file.framedata;
+        let source = framedata
+            .draw_cel(self.cel_id, &self.file.layers, &self.file.tilesets)?
+            .source;
+        match &framedata.cel(source)?.content {
+            CelContent::Raw(image) => {
+                let mut hasher = DefaultHasher::new();
+                (image.size.width, image.size.height).hash(&mut hasher);
+                image.pixels_hash()?.hash(&mut hasher);
+                Some(hasher.finish())
+            }
+            _ => None,
+        }
+    }
+
     pub(crate) fn raw_cel(&self) -> Option<&RawCel> {
         self.file.framedata.cel(self.cel_id)
     }
@@ -86,13 +119,33 @@ pub(crate) struct CelsData<P> {
     // Mapping: frame_id -> layer_id -> Option<RawCel>
     data: Vec<Vec<Option<RawCel<P>>>>,
     num_frames: u32,
+    // Mapping: frame_id -> cels to draw, in layer order. Only filled in for
+    // validated cels.
+    draw_lists: Vec<Vec<DrawCel>>,
 }
-#[derive(Debug, Clone, Copy)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
 pub(crate) struct CelId {
     pub frame: u16,
     pub layer: u16,
 }
 
+// A cel as it gets drawn when rendering a frame, with everything that
+// rendering needs resolved during validation.
+#[derive(Debug, Clone, Copy)]
+pub(crate) struct DrawCel {
+    pub layer: u16,
+    // The cel whose content gets drawn. For linked cels, that's the target.
+    pub source: CelId,
+    pub blend_mode: BlendMode,
+    // The opacity of the source cel.
+    pub opacity: u8,
+    // Blends rows of the cel onto the canvas.
+    pub kernel: RowKernel,
+    // The tileset of cels in tilemap layers, as an index for
+    // `TilesetsById::by_index`.
+    pub tileset: Option<usize>,
+}
+
 impl fmt::Display for CelId {
     fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
         write!(f, "CelId(F{},L{})", self.frame, self.layer)
@@ -127,7 +180,11 @@ impl<P> CelsData<P> {
         let mut data = Vec::with_capacity(num_frames as usize);
         // Initialize with one layer (outer Vec) and zero RawCel (inner Vec).
         data.resize_with(num_frames as usize, || vec![None]);
-        CelsData { data, num_frames }
+        CelsData {
+            data,
+            num_frames,
+            draw_lists: Vec::new(),
+        }
     }
 
     fn check_valid_frame_id(&self, frame_id: u16) -> Result<()> {
@@ -179,6 +236,11 @@ impl<P> CelsData<P> {
         }
     }
 
+    // Removes and returns the cels of one frame.
+    pub(crate) fn take_frame(&mut self, frame_id: u16) -> Vec<Option<RawCel<P>>> {
+        std::mem::replace(&mut self.data[frame_id as usize], vec![None])
+    }
+
     pub(crate) fn cel_mut(&mut self, cel_id: &CelId) -> Option<&mut RawCel<P>> {
         let frame = cel_id.frame;
         let layer = cel_id.layer;
@@ -242,6 +304,7 @@ impl CelsData<RawPixels> {
     pub(crate) fn validate(
         self,
         layers: &LayersData,
+        tilesets: &TilesetsById,
         pixel_format: &PixelFormat,
         palette: Option<Arc<ColorPalette>>,
     ) -> Result<CelsData<Pixels>> {
@@ -250,6 +313,7 @@ impl CelsData<RawPixels> {
         let mut result = CelsData {
             data: Vec::with_capacity(self.data.len()),
             num_frames,
+            draw_lists: vec![Vec::new(); num_frames as usize],
         };
         // Mapping from CelId -> bool. True if the cel can be used as a target
         // for a linked cel. That means it must exist, and it must be a raw cel.
@@ -299,11 +363,160 @@ impl CelsData<RawPixels> {
                 result.data[frame as usize].push(cel);
             }
         }
+        for frame in 0..num_frames {
+            result.update_draw_list(frame as u16, layers, tilesets);
+        }
 
         Ok(result)
     }
 }
 
+impl CelsData<Pixels> {
+    // Validates the cels of a frame that was parsed on its own (see
+    // `FrameStream`) and adds them. Linked cels may only refer to raw cels of
+    // frames that were added before.
+    pub(crate) fn add_frame(
+        &mut self,
+        frame_id: u16,
+        cels: Vec<Option<RawCel<RawPixels>>>,
+        layers: &LayersData,
+        tilesets: &TilesetsById,
+        pixel_format: &PixelFormat,
+        palette: Option<Arc<ColorPalette>>,
+    ) -> Result<()> {
+        self.check_valid_frame_id(frame_id)?;
+        let validate_ref = |id: CelId| {
+            let is_linkable =
+                id.frame < frame_id && matches!(self.cel(id), Some(c) if c.content.is_raw());
+            if is_linkable {
+                Ok(())
+            } else {
+                Err(AsepriteParseError::InvalidInput(format!(
+                    "Cel {} is not a valid target for a linked cel",
+                    id
+                )))
+            }
+        };
+        let mut validated = Vec::with_capacity(cels.len());
+        for (layer, opt_cel) in cels.into_iter().enumerate() {
+            let cel = if let Some(cel) = opt_cel {
+                let cel_id = CelId {
+                    frame: frame_id,
+                    layer: layer as u16,
+                };
+                Some(cel.validate(cel_id, layers, pixel_format, palette.clone(), &validate_ref)?)
+            } else {
+                None
+            };
+            validated.push(cel);
+        }
+        self.data[frame_id as usize] = validated;
+        self.update_draw_list(frame_id, layers, tilesets);
+        Ok(())
+    }
+
+    // The cels to draw for the given frame, bottom layer first.
+    pub(crate) fn draw_list(&self, frame_id: u16) -> &[DrawCel] {
+        &self.draw_lists[frame_id as usize]
+    }
+
+    // Rebuilds the draw list of a frame from its cels.
+    pub(crate) fn update_draw_list(
+        &mut self,
+        frame_id: u16,
+        layers: &LayersData,
+        tilesets: &TilesetsById,
+    ) {
+        let draw_list = self
+            .frame_cels(frame_id)
+            .filter_map(|(layer, _)| {
+                self.draw_cel(
+                    CelId {
+                        frame: frame_id,
+                        layer: layer as u16,
+                    },
+                    layers,
+                    tilesets,
+                )
+            })
+            .collect();
+        self.draw_lists[frame_id as usize] = draw_list;
+    }
+
+    // Resolves how to draw a single cel. Returns `None` if there is no cel.
+    pub(crate) fn draw_cel(
+        &self,
+        cel_id: CelId,
+        layers: &LayersData,
+        tilesets: &TilesetsById,
+    ) -> Option<DrawCel> {
+        let cel = self.cel(cel_id)?;
+        let source = match cel.content {
+            CelContent::Linked(frame) => CelId {
+                frame,
+                layer: cel_id.layer,
+            },
+            _ => cel_id,
+        };
+        let layer = &layers[cel_id.layer as u32];
+        let tileset = match layer.layer_type {
+            LayerType::Tilemap(tileset_id) => Some(tilesets.index_of(tileset_id)?),
+            _ => None,
+        };
+        Some(DrawCel {
+            layer: cel_id.layer,
+            source,
+            blend_mode: layer.blend_mode,
+            opacity: self.cel(source)?.data.opacity,
+            kernel: render::row_kernel(layer.blend_mode),
+            tileset,
+        })
+    }
+
+    // The cels whose pixels are drawn when rendering the given frame, i.e.,
+    // its raw cels and the targets of its linked cels.
+    pub(crate) fn frame_sources(&self, frame_id: u16) -> Vec<CelId> {
+        self.frame_cels(frame_id)
+            .map(|(layer, cel)| CelId {
+                frame: match cel.content {
+                    CelContent::Linked(other_frame) => other_frame,
+                    _ => frame_id,
+                },
+                layer: layer as u16,
+            })
+            .collect()
+    }
+
+    // Stores the pixels of identical cels only once.
+    pub(crate) fn share_pixels(&mut self, pool: &PixelPool) {
+        for cel in self.data.iter_mut().flatten().flatten() {
+            if let CelContent::Raw(image) = &mut cel.content {
+                image.share_pixels(pool);
+            }
+        }
+    }
+
+    // Frees the decoded pixels of all lazily loaded cels.
+    pub(crate) fn release_all_decoded(&mut self) {
+        for cel in self.data.iter_mut().flatten().flatten() {
+            if let CelContent::Raw(image) = &mut cel.content {
+                image.pixels.release_decoded();
+            }
+        }
+    }
+
+    // Frees the decoded pixels of a lazily loaded cel.
+    pub(crate) fn release_decoded(&mut self, cel_id: CelId) {
+        if let Some(RawCel {
+            content: CelContent::Raw(image),
+            ..
+        }) = self.cel_mut(&cel_id)
+        {
+            image.pixels.release_decoded();
+        }
+    }
+}
+
 #[derive(Debug, Clone, Copy)]
 pub(crate) struct ImageSize {
     pub width: u16,
@@ -350,6 +563,37 @@ impl CelCommon {
 pub(crate) struct ImageContent<P> {
     pub size: ImageSize,
     pub pixels: P,
+    // Hash of the decoded pixels, computed on first use. `None` if the pixels
+    // could not be decoded.
+    pixels_hash: OnceLock<Option<u64>>,
+}
+
+impl<P> ImageContent<P> {
+    fn new(size: ImageSize, pixels: P) -> Self {
+        Self {
+            size,
+            pixels,
+            pixels_hash: OnceLock::new(),
+        }
+    }
+}
+
+impl ImageContent<Pixels> {
+    pub(crate) fn pixels_hash(&self) -> Option<u64> {
+        *self.pixels_hash.get_or_init(|| self.pixels.content_hash())
+    }
+
+    // Replaces the pixels with a copy shared with identical images. Lazily
+    // loaded pixels are kept as they are.
+    fn share_pixels(&mut self, pool: &PixelPool) {
+        if matches!(self.pixels, Pixels::Lazy(_)) {
+            return;
+        }
+        if let Some(hash) = self.pixels_hash() {
+            let pixels = std::mem::replace(&mut self.pixels, Pixels::Rgba(Vec::new()));
+            self.pixels = pool.share(pixels, hash);
+        }
+    }
 }
 
 impl ImageContent<RawPixels> {
@@ -363,7 +607,7 @@ impl ImageContent<RawPixels> {
         let pixels = self
             .pixels
             .validate(palette, pixel_format, layer_is_background)?;
-        Ok(ImageContent { size, pixels })
+        Ok(ImageContent::new(size, pixels))
     }
 }
 
@@ -382,15 +626,16 @@ impl<P> CelContent<P> {
 }
 
 impl CelContent<RawPixels> {
-    fn parse<R: Read>(
-        mut reader: AseReader<R>,
+    fn parse(
+        mut reader: SliceReader,
         pixel_format: PixelFormat,
         cel_type: u16,
+        options: &LoadOptions,
     ) -> Result<Self> {
         match cel_type {
             0 => parse_raw_cel(reader, pixel_format).map(CelContent::Raw),
             1 => reader.word().map(CelContent::Linked),
-            2 => parse_compressed_cel(reader, pixel_format).map(CelContent::Raw),
+            2 => parse_compressed_cel(reader, pixel_format, options).map(CelContent::Raw),
             3 => TilemapData::parse_chunk(reader).map(CelContent::Tilemap),
             _ => Err(AsepriteParseError::InvalidInput(format!(
                 "Invalid/Unsupported Cel type: {}",
@@ -413,31 +658,36 @@ pub(crate) struct RawCel<P = Pixels> {
     pub user_data: Option<UserData>,
 }
 
-fn parse_raw_cel<R: Read>(
-    mut reader: AseReader<R>,
+fn parse_raw_cel(
+    mut reader: SliceReader,
     pixel_format: PixelFormat,
 ) -> Result<ImageContent<RawPixels>> {
     let size = ImageSize::parse(&mut reader)?;
     RawPixels::from_raw(reader, pixel_format, size.pixel_count())
-        .map(|pixels| ImageContent { size, pixels })
+        .map(|pixels| ImageContent::new(size, pixels))
 }
 
-fn parse_compressed_cel<R: Read>(
-    mut reader: AseReader<R>,
+fn parse_compressed_cel(
+    mut reader: SliceReader,
     pixel_format: PixelFormat,
+    options: &LoadOptions,
 ) -> Result<ImageContent<RawPixels>> {
     let size = ImageSize::parse(&mut reader)?;
-    RawPixels::from_compressed(reader, pixel_format, size.pixel_count())
-        .map(|pixels| ImageContent { size, pixels })
+    RawPixels::from_compressed(reader, pixel_format, size.pixel_count(), options)
+        .map(|pixels| ImageContent::new(size, pixels))
 }
 
-pub(crate) fn parse_chunk(data: &[u8], pixel_format: PixelFormat) -> Result<RawCel<RawPixels>> {
+pub(crate) fn parse_chunk(
+    data: &[u8],
+    pixel_format: PixelFormat,
+    options: &LoadOptions,
+) -> Result<RawCel<RawPixels>> {
     let mut reader = AseReader::new(data);
     let data = CelCommon::parse(&mut reader)?;
     let cel_type = reader.word()?;
     reader.skip_reserved(7)?;
 
-    let content = CelContent::parse(reader, pixel_format, cel_type)?;
+    let content = CelContent::parse(reader, pixel_format, cel_type, options)?;
     Ok(RawCel {
         data,
         content,
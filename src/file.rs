@@ -1,25 +1,27 @@
 use std::{
     fs::File,
-    io::{BufReader, Read},
+    io::{BufReader, Read, Seek},
+    ops::Range,
     path::Path,
     sync::Arc,
 };
 
+use crate::{cel::Cel, *};
 use crate::{
-    blend::{self, Color8},
-    cel::{CelCommon, CelId, CelsData, ImageContent, ImageSize},
+    cel::{CelId, CelsData, DrawCel, ImageContent},
     external_file::{ExternalFile, ExternalFileId, ExternalFilesById},
     layer::{Layer, LayerType, LayersData},
     pixel::Pixels,
+    reader::Seeking,
+    render::{write_raw_cel_to_image, write_tilemap_cel_to_image, Canvas, RenderContext},
     slice::Slice,
-    tile::TileId,
-    tilemap::{Tilemap, TilemapData},
-    tileset::{TileSize, Tileset, TilesetsById},
+    stats::{count, timed},
+    tilemap::Tilemap,
+    tileset::TilesetsById,
     user_data::UserData,
 };
-use crate::{cel::Cel, *};
 use cel::{CelContent, RawCel};
-use image::{Rgba, RgbaImage};
+use image::RgbaImage;
 
 /// A parsed Aseprite file.
 #[derive(Debug)]
@@ -85,16 +87,150 @@ impl PixelFormat {
 impl AsepriteFile {
     /// Load Aseprite file. Loads full file into memory.
     pub fn read_file(path: &Path) -> Result<Self> {
-        let file = File::open(&path)?;
-        let reader = BufReader::new(file);
-        parse::read_aseprite(reader)
+        Self::read_file_with_options(path, &LoadOptions::default())
     }
 
     /// Load Aseprite file from any input that implements `std::io::Read`.
     ///
     /// You can use this to read from an in-memory file.
     pub fn read<R: Read>(input: R) -> Result<AsepriteFile> {
-        parse::read_aseprite(input)
+        Self::read_with_options(input, &LoadOptions::default())
+    }
+
+    /// Like [AsepriteFile::read_file] but with custom [LoadOptions].
+    pub fn read_file_with_options(path: &Path, options: &LoadOptions) -> Result<Self> {
+        // Reading the whole file at once takes the fewest system calls, and
+        // chunks can then be parsed in place.
+        let data = std::fs::read(path)?;
+        parse::read_aseprite_slice(&data, options)
+    }
+
+    /// Load many Aseprite files at once. Files are read and decoded on all
+    /// available CPU cores, so reading one file overlaps with decompressing
+    /// others.
+    ///
+    /// Files that use equal palettes (e.g., a shared project palette) also
+    /// share a single [ColorPalette] in memory. With
+    /// [LoadOptions::share_identical_cels], identical cels of all files are
+    /// stored only once as well.
+    ///
+    /// Returns one result per path, in the same order as `paths`. A file
+    /// that fails to load does not affect the others.
+    ///
+    /// # Example
+    ///
+    /// ```
+    /// # use asefile::{AsepriteFile, LoadOptions};
+    /// let paths = [
+    ///     "./tests/data/basic-16x16.aseprite",
+    ///     "./tests/data/layers_and_tags.aseprite",
+    /// ];
+    /// let files = AsepriteFile::read_files(&paths, &LoadOptions::default());
+    /// for file in files {
+    ///     let ase = file.unwrap();
+    ///     println!("{}x{}", ase.width(), ase.height());
+    /// }
+    /// ```
+    pub fn read_files<P>(paths: &[P], options: &LoadOptions) -> Vec<Result<Self>>
+    where
+        P: AsRef<Path> + Sync,
+    {
+        // Files are already spread across all cores, so decompressing the
+        // cels of each file on all cores as well would only add overhead.
+        let options = LoadOptions {
+            parallel: options.parallel && paths.len() == 1,
+            ..options.clone()
+        };
+        let shared = parse::SharedData::default();
+        let mut results: Vec<Option<Result<Self>>> = paths.iter().map(|_| None).collect();
+        let jobs = paths.iter().zip(results.iter_mut()).collect();
+        // Each worker reads all of its files into the same buffer.
+        parallel::for_each_with(jobs, Vec::new, |data, (path, result)| {
+            let file = File::open(path.as_ref()).and_then(|mut file| {
+                data.clear();
+                file.read_to_end(data)
+            });
+            *result = Some(match file {
+                Ok(_) => parse::read_aseprite_slice_shared(data, &options, Some(&shared)),
+                Err(err) => Err(err.into()),
+            });
+        });
+        results
+            .into_iter()
+            .map(|result| result.expect("Every file is loaded"))
+            .collect()
+    }
+
+    /// Like [AsepriteFile::read] but with custom [LoadOptions].
+    pub fn read_with_options<R: Read>(input: R, options: &LoadOptions) -> Result<AsepriteFile> {
+        parse::read_aseprite(input, options)
+    }
+
+    /// Load Aseprite file from a byte slice, e.g., the contents of a file
+    /// that has already been read into memory or mapped with `mmap`.
+    ///
+    /// Faster than [AsepriteFile::read] because chunks are parsed directly
+    /// from the slice instead of being copied out first.
+    pub fn read_bytes(data: &[u8]) -> Result<AsepriteFile> {
+        Self::read_bytes_with_options(data, &LoadOptions::default())
+    }
+
+    /// Like [AsepriteFile::read_bytes] but with custom [LoadOptions].
+    pub fn read_bytes_with_options(data: &[u8], options: &LoadOptions) -> Result<AsepriteFile> {
+        parse::read_aseprite_slice(data, options)
+    }
+
+    /// Read only the metadata of an Aseprite file: header, layers, tags,
+    /// slices, user data, and frame durations. Image data is skipped without
+    /// being read.
+    ///
+    /// # Example
+    ///
+    /// ```
+    /// # use asefile::AsepriteFile;
+    /// # use std::path::Path;
+    /// # let path = Path::new("./tests/data/layers_and_tags.aseprite");
+    /// let meta = AsepriteFile::scan_file(&path).unwrap();
+    /// println!("Frames: {}", meta.num_frames());
+    /// for tag in meta.tags() {
+    ///     println!("Tag: {}", tag.name());
+    /// }
+    /// ```
+    pub fn scan_file(path: &Path) -> Result<AsepriteMetadata> {
+        let file = File::open(path)?;
+        let reader = BufReader::new(file);
+        parse::scan_aseprite(reader)
+    }
+
+    /// Like [AsepriteFile::scan_file] but reads from any input that can seek.
+    pub fn scan<R: Read + Seek>(input: R) -> Result<AsepriteMetadata> {
+        parse::scan_aseprite(Seeking(input))
+    }
+
+    /// Read an Aseprite file one frame at a time. See [FrameStream].
+    ///
+    /// Reads the header and the first frame immediately.
+    pub fn stream_file(path: &Path) -> Result<FrameStream<BufReader<File>>> {
+        let file = File::open(path)?;
+        Self::stream(BufReader::new(file))
+    }
+
+    /// Like [AsepriteFile::stream_file] but reads from any input that
+    /// implements `std::io::Read`.
+    pub fn stream<R: Read>(input: R) -> Result<FrameStream<R>> {
+        let (file, parser) = parse::stream_aseprite(input)?;
+        Ok(FrameStream::new(file, parser))
+    }
+
+    /// Frees the decompressed pixels of cels and tilesets that were loaded
+    /// with [LoadOptions::lazy_cels]. They stay in memory in compressed form
+    /// and are decompressed again the next time they are used.
+    ///
+    /// Useful when many files are kept in memory but only a few of them are in
+    /// use at any time. Pixels of files loaded without `lazy_cels` are kept.
+    pub fn release_decoded_pixels(&mut self) {
+        self.framedata.release_all_decoded();
+        self.tilesets.release_decoded();
     }
 
     /// Width in pixels.
@@ -301,6 +437,351 @@ impl AsepriteFile {
         &self.slices
     }
 
+    /// Construct the images of the given frames. Same as calling
+    /// [Frame::image] for each frame, but the frames are rendered in parallel
+    /// on all available cores.
+    ///
+    /// # Panics
+    ///
+    /// Panics if the range contains frames that don't exist.
+    pub fn render_frames(&self, frames: Range<u32>) -> Vec<RgbaImage> {
+        let mut images: Vec<_> = frames
+            .clone()
+            .map(|_| RgbaImage::new(self.width as u32, self.height as u32))
+            .collect();
+        self.render_frames_into(frames, &mut images);
+        images
+    }
+
+    /// Construct the images of all frames in parallel. See
+    /// [AsepriteFile::render_frames].
+    pub fn render_all_frames(&self) -> Vec<RgbaImage> {
+        self.render_frames(0..self.num_frames())
+    }
+
+    /// Like [AsepriteFile::render_frames] but renders into existing images,
+    /// one per frame. Previous contents of the images are overwritten.
+    ///
+    /// # Panics
+    ///
+    /// Panics if the range contains frames that don't exist, if the number of
+    /// images does not match the number of frames, or if an image does not
+    /// have the size of the sprite.
+    pub fn render_frames_into(&self, frames: Range<u32>, images: &mut [RgbaImage]) {
+        assert!(frames.end <= self.num_frames(), "Frame out of range");
+        assert_eq!(
+            frames.len(),
+            images.len(),
+            "Need exactly one image per frame"
+        );
+        // Check up front so a wrong size doesn't surface as a panic in one of
+        // the workers.
+        for image in images.iter() {
+            assert_eq!(
+                image.dimensions(),
+                (self.width as u32, self.height as u32),
+                "Image size does not match sprite size"
+            );
+        }
+        let jobs: Vec<_> = frames.zip(images.iter_mut()).collect();
+        parallel::for_each_with(jobs, RenderContext::new, |context, (frame, image)| {
+            self.render_frame_into(frame, image, context);
+        });
+    }
+
+    /// Like [Frame::image] but renders into an existing image, overwriting
+    /// its previous contents. Reusing the same image and [RenderContext] for
+    /// every call avoids all allocations after the first frame.
+    ///
+    /// # Panics
+    ///
+    /// Panics if the frame does not exist or if the image does not have the
+    /// size of the sprite.
+    pub fn render_frame_into(
+        &self,
+        frame: u32,
+        image: &mut RgbaImage,
+        context: &mut RenderContext,
+    ) {
+        self.render_frame_into_with_options(frame, image, &RenderOptions::default(), context);
+    }
+
+    /// Like [AsepriteFile::render_frame_into] but only renders the layers
+    /// selected by `options`.
+    pub fn render_frame_into_with_options(
+        &self,
+        frame: u32,
+        image: &mut RgbaImage,
+        options: &RenderOptions,
+        context: &mut RenderContext,
+    ) {
+        assert_eq!(
+            image.dimensions(),
+            (self.width as u32, self.height as u32),
+            "Image size does not match sprite size"
+        );
+        let mut canvas = Canvas::from_image(image);
+        self.render_frame_into_canvas(frame, &mut canvas, options, context);
+    }
+
+    /// Like [AsepriteFile::render_frame_into] but renders into a raw RGBA
+    /// buffer, e.g., a region of a larger texture. Row `y` of the frame
+    /// starts at byte `y * stride` of `buffer`. Bytes outside of the frame's
+    /// rows are left untouched.
+    ///
+    /// # Panics
+    ///
+    /// Panics if the frame does not exist, if `stride` is less than 4 bytes
+    /// per pixel of the sprite's width, or if `buffer` is too small to hold
+    /// all rows.
+    pub fn render_frame_into_buffer(
+        &self,
+        frame: u32,
+        buffer: &mut [u8],
+        stride: usize,
+        context: &mut RenderContext,
+    ) {
+        let mut canvas = Canvas::new(buffer, self.width as u32, self.height as u32, stride);
+        self.render_frame_into_canvas(frame, &mut canvas, &RenderOptions::default(), context);
+    }
+
+    fn render_frame_into_canvas(
+        &self,
+        frame: u32,
+        canvas: &mut Canvas,
+        options: &RenderOptions,
+        context: &mut RenderContext,
+    ) {
+        assert!(frame < self.num_frames(), "Frame out of range");
+        canvas.clear();
+        self.write_frame(canvas, frame as u16, options, context);
+    }
+
+    /// Like [Frame::image] but only renders the smallest rectangle that
+    /// contains all visible cels of the frame. Returns the image and the
+    /// position of its top left corner in the sprite.
+    ///
+    /// Everything outside of the rectangle is fully transparent. If the frame
+    /// has no visible cels, the image is empty (0x0 pixels).
+    ///
+    /// # Panics
+    ///
+    /// Panics if the frame does not exist.
+    pub fn render_frame_trimmed(&self, frame: u32) -> (RgbaImage, (u32, u32)) {
+        assert!(frame < self.num_frames(), "Frame out of range");
+        let options = RenderOptions::default();
+        let mut context = RenderContext::new();
+        let (x, y, width, height) = match self.frame_bounds(frame as u16, &options, &mut context) {
+            Some(bounds) => bounds,
+            None => return (RgbaImage::new(0, 0), (0, 0)),
+        };
+        let mut image = RgbaImage::new(width, height);
+        let mut canvas = Canvas::from_image(&mut image).with_origin(x as i32, y as i32);
+        self.write_frame(&mut canvas, frame as u16, &options, &mut context);
+        (image, (x, y))
+    }
+
+    /// Like [Frame::image] but `factor` times smaller in each direction, e.g.,
+    /// for thumbnails. The result has a size of `width / factor` x
+    /// `height / factor`, rounded up.
+    ///
+    /// Each pixel of the result shows the pixel at the top left of a `factor`
+    /// x `factor` block of the full size image (nearest neighbor
+    /// downscaling). Only those pixels are read and blended, so rendering at
+    /// half the size takes about a quarter of the time.
+    ///
+    /// # Panics
+    ///
+    /// Panics if the frame does not exist or if `factor` is 0.
+    pub fn render_frame_scaled(&self, frame: u32, factor: u32) -> RgbaImage {
+        assert!(frame < self.num_frames(), "Frame out of range");
+        assert!(factor > 0, "Scale factor must be positive");
+        // Rounds up, like `u32::div_ceil` (which needs Rust 1.73).
+        let scaled = |len: u16| len as u32 / factor + (len as u32 % factor != 0) as u32;
+        let (width, height) = (scaled(self.width), scaled(self.height));
+        let mut image = RgbaImage::new(width, height);
+        let mut canvas = Canvas::from_image(&mut image).with_scale(factor);
+        self.write_frame(
+            &mut canvas,
+            frame as u16,
+            &RenderOptions::default(),
+            &mut RenderContext::new(),
+        );
+        image
+    }
+
+    // Renders the part of a frame inside `bounds` (x, y, width, height in
+    // sprite coordinates) into a raw RGBA buffer that is fully transparent.
+    #[cfg(feature = "utils")]
+    pub(crate) fn render_region_into_buffer(
+        &self,
+        frame: u16,
+        bounds: (u32, u32, u32, u32),
+        buffer: &mut [u8],
+        stride: usize,
+        context: &mut RenderContext,
+    ) {
+        let (x, y, width, height) = bounds;
+        let mut canvas = Canvas::new(buffer, width, height, stride).with_origin(x as i32, y as i32);
+        self.write_frame(&mut canvas, frame, &RenderOptions::default(), context);
+    }
+
+    // Renders a frame of an indexed file as palette indices, without going
+    // through RGBA. Only possible if compositing never mixes two colors: all
+    // visible layers and cels use normal blending at full opacity, there are
+    // no tilemap cels, and all palette colors except the transparent one are
+    // opaque. Returns `None` otherwise.
+    //
+    // Each drawn index `i` is written as `remap[i]`. Pixels not covered by
+    // any cel get the index `empty`.
+    #[cfg(feature = "utils")]
+    pub(crate) fn frame_indices(
+        &self,
+        frame: u16,
+        remap: &[u8; 256],
+        empty: u8,
+    ) -> Option<Vec<u8>> {
+        let transparent_color_index = self.pixel_format.transparent_color_index()?;
+        if !self
+            .palette
+            .as_ref()?
+            .is_opaque_except(transparent_color_index)
+        {
+            return None;
+        }
+        let identity = remap
+            .iter()
+            .enumerate()
+            .all(|(i, &index)| i == index as usize);
+        let mut layers_shown = Vec::new();
+        RenderOptions::default().resolve_layers(self, &mut layers_shown);
+        let (width, height) = (self.width as usize, self.height as usize);
+        let mut indices = vec![empty; width * height];
+        for draw_cel in self.framedata.draw_list(frame) {
+            if !layers_shown[draw_cel.layer as usize] {
+                continue;
+            }
+            let layer = self.layer(draw_cel.layer as u32);
+            if draw_cel.blend_mode != BlendMode::Normal
+                || draw_cel.opacity != 255
+                || layer.opacity() != 255
+            {
+                return None;
+            }
+            let cel = self.framedata.cel(draw_cel.source)?;
+            let (size, pixels) = match &cel.content {
+                CelContent::Raw(ImageContent { size, pixels, .. }) => (size, pixels),
+                _ => return None,
+            };
+            let (data, skipped) = pixels.as_indices()?;
+            let clip = match render::ClipRect::new(
+                cel.data.x as i32,
+                cel.data.y as i32,
+                size.width as u32,
+                size.height as u32,
+                width as u32,
+                height as u32,
+            ) {
+                Some(clip) => clip,
+                None => continue,
+            };
+            for row in 0..clip.height {
+                let src_start = (clip.src_y + row) * size.width as usize + clip.src_x;
+                let src = &data[src_start..src_start + clip.width];
+                let dst_start = (clip.dst_y + row) * width + clip.dst_x;
+                let dst = &mut indices[dst_start..dst_start + clip.width];
+                match skipped {
+                    None if identity => dst.copy_from_slice(src),
+                    None => {
+                        for (dst, &src) in dst.iter_mut().zip(src) {
+                            *dst = remap[src as usize];
+                        }
+                    }
+                    Some(skipped) => {
+                        for (dst, &src) in dst.iter_mut().zip(src) {
+                            if src != skipped {
+                                *dst = remap[src as usize];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        Some(indices)
+    }
+
+    // The union of the rectangles of all cels that get rendered, clipped to
+    // the sprite. As (x, y, width, height).
+    pub(crate) fn frame_bounds(
+        &self,
+        frame: u16,
+        options: &RenderOptions,
+        context: &mut RenderContext,
+    ) -> Option<(u32, u32, u32, u32)> {
+        options.resolve_layers(self, &mut context.layers_shown);
+        let (mut left, mut top) = (self.width as i32, self.height as i32);
+        let (mut right, mut bottom) = (0, 0);
+        for (layer_id, cel) in self.framedata.frame_cels(frame) {
+            if !context.layers_shown[layer_id as usize] {
+                continue;
+            }
+            if let Some((x, y, width, height)) = self.cel_rect(cel) {
+                left = left.min(x);
+                top = top.min(y);
+                right = right.max(x + width as i32);
+                bottom = bottom.max(y + height as i32);
+            }
+        }
+        let left = left.max(0);
+        let top = top.max(0);
+        let right = right.min(self.width as i32);
+        let bottom = bottom.min(self.height as i32);
+        if left >= right || top >= bottom {
+            return None;
+        }
+        Some((
+            left as u32,
+            top as u32,
+            (right - left) as u32,
+            (bottom - top) as u32,
+        ))
+    }
+
+    // The area covered by a cel in sprite coordinates, as (x, y, width,
+    // height). May extend beyond the sprite.
+    fn cel_rect(&self, cel: &RawCel<Pixels>) -> Option<(i32, i32, u32, u32)> {
+        let RawCel { data, content, .. } = cel;
+        let (x, y) = (data.x as i32, data.y as i32);
+        match content {
+            CelContent::Raw(ImageContent { size, .. }) => {
+                Some((x, y, size.width as u32, size.height as u32))
+            }
+            CelContent::Tilemap(tilemap_data) => {
+                let tileset_id = match self.layer(data.layer_index as u32).layer_type() {
+                    LayerType::Tilemap(tileset_id) => tileset_id,
+                    _ => return None,
+                };
+                let (tile_width, tile_height) = self.tilesets().get(tileset_id)?.tile_size().into();
+                Some((
+                    x,
+                    y,
+                    tilemap_data.width() as u32 * tile_width,
+                    tilemap_data.height() as u32 * tile_height,
+                ))
+            }
+            CelContent::Linked(frame) => {
+                let source = self.framedata.cel(CelId {
+                    frame: *frame,
+                    layer: data.layer_index,
+                })?;
+                match source.content {
+                    CelContent::Linked(_) => None,
+                    _ => self.cel_rect(source),
+                }
+            }
+        }
+    }
+
     // pub fn color_profile(&self) -> Option<&ColorProfile> {
     //     self.color_profile.as_ref()
     // }
@@ -311,86 +792,118 @@ impl AsepriteFile {
     ///
     /// Can fail if the `frame` does not exist, an unsupported feature is
     /// used, or the file is malformed.
-    fn frame_image(&self, frame: u16) -> RgbaImage {
+    fn frame_image(&self, frame: u16, options: &RenderOptions) -> RgbaImage {
         let mut image = RgbaImage::new(self.width as u32, self.height as u32);
-
-        for (layer_id, cel) in self.framedata.frame_cels(frame) {
-            // TODO: Ensure this is always done in layer order (pre-sort Cels?)
-            if !self.layer(layer_id).is_visible() {
-                continue;
-            }
-            self.write_cel(&mut image, cel);
-        }
-
+        self.write_frame(
+            &mut Canvas::from_image(&mut image),
+            frame,
+            options,
+            &mut RenderContext::new(),
+        );
         image
     }
 
-    fn write_cel(&self, image: &mut RgbaImage, cel: &RawCel<Pixels>) {
-        let RawCel { data, content, .. } = cel;
-        let layer = self.layer(data.layer_index as u32);
-        let blend_mode = layer.blend_mode();
-        // let resolver_data = pixel::IndexResolverData {
-        //     palette: self.palette.as_ref(),
-        //     transparent_color_index: self.pixel_format.transparent_color_index(),
-        //     layer_is_background: self.layers[layer.id()].is_background(),
-        // };
-        match &content {
+    // Composites the frame onto `canvas`, which must have the sprite's size.
+    fn write_frame(
+        &self,
+        canvas: &mut Canvas,
+        frame: u16,
+        options: &RenderOptions,
+        context: &mut RenderContext,
+    ) {
+        // Resolved once per frame, so the loop below is a plain lookup. The
+        // buffer is moved out so `context` can be borrowed by `write_cel`.
+        let mut layers_shown = std::mem::take(&mut context.layers_shown);
+        options.resolve_layers(self, &mut layers_shown);
+        for draw_cel in self.framedata.draw_list(frame) {
+            if layers_shown[draw_cel.layer as usize] {
+                self.write_cel(canvas, draw_cel, context);
+            }
+        }
+        context.layers_shown = layers_shown;
+    }
+
+    // The cels that `write_frame` would draw, with linked cels replaced by
+    // their source. Frames with the same key produce the same image.
+    pub(crate) fn frame_content_key(&self, frame: u16) -> Vec<CelId> {
+        let mut layers_shown = Vec::new();
+        RenderOptions::default().resolve_layers(self, &mut layers_shown);
+        self.framedata
+            .draw_list(frame)
+            .iter()
+            .filter(|draw_cel| layers_shown[draw_cel.layer as usize])
+            .map(|draw_cel| draw_cel.source)
+            .collect()
+    }
+
+    pub(crate) fn write_cel(
+        &self,
+        canvas: &mut Canvas,
+        draw_cel: &DrawCel,
+        context: &mut RenderContext,
+    ) {
+        timed!(composite, self.blend_cel(canvas, draw_cel, context))
+    }
+
+    fn blend_cel(&self, canvas: &mut Canvas, draw_cel: &DrawCel, context: &mut RenderContext) {
+        let RenderContext { scratch, lut, .. } = context;
+        let DrawCel {
+            source,
+            blend_mode,
+            opacity,
+            kernel,
+            tileset,
+            ..
+        } = *draw_cel;
+        let RawCel { data, content, .. } = match self.framedata.cel(source) {
+            Some(cel) => cel,
+            None => return,
+        };
+        count!(cels_blended[blend_mode as usize], 1);
+        match content {
             CelContent::Raw(image_content) => {
-                let ImageContent { size, pixels } = image_content;
-                let image_pixels = pixels.clone_as_image_rgba();
-
-                write_raw_cel_to_image(image, data, size, image_pixels.as_ref(), &blend_mode);
+                let ImageContent { size, pixels, .. } = image_content;
+                if let Some(pixels) = pixels.as_rgba_pixels(lut) {
+                    write_raw_cel_to_image(canvas, data, size, &pixels, kernel, scratch);
+                }
             }
             CelContent::Tilemap(tilemap_data) => {
-                let layer_type = layer.layer_type();
-                let tileset_id = if let LayerType::Tilemap(tileset_id) = layer_type {
-                    tileset_id
-                } else {
-                    panic!(
-                        "Tilemap cel not in tilemap layer. Should have been caught by CelsData::validate"
-                    );
-                };
-                let tileset = self
-                    .tilesets()
-                    .get(tileset_id)
-                    .expect("Tilemap layer references a missing tileset. Should have been caught by LayersData::validate()");
-                let tileset_pixels = tileset
-                    .pixels
-                    .as_ref()
+                let tileset = tileset
+                    .map(|index| self.tilesets.by_index(index))
+                    .expect("Tilemap cel without a tileset. Should have been caught by CelsData::validate and LayersData::validate");
+                let tiles = tileset
+                    .tile_pixels()
                     .expect("Expected Tileset data to contain pixels. Should have been caught by TilesetsById::validate()");
-                let rgba_pixels = tileset_pixels.clone_as_image_rgba();
-
+                // Fully opaque tiles drawn at full opacity replace the canvas
+                // pixels.
+                let copy_opaque = blend_mode == BlendMode::Normal && opacity == 255;
                 write_tilemap_cel_to_image(
-                    image,
+                    canvas,
                     data,
                     tilemap_data,
-                    tileset,
-                    rgba_pixels.as_ref(),
-                    &blend_mode,
+                    &tiles,
+                    kernel,
+                    copy_opaque,
+                    scratch,
                 );
             }
-            CelContent::Linked(frame) => {
-                if let Some(cel) = self.framedata.cel(CelId {
-                    frame: *frame,
-                    layer: data.layer_index,
-                }) {
-                    if let CelContent::Linked(_) = cel.content {
-                        panic!(
-                            "Cel links to empty cel. Should have been caught by CelsData::validate"
-                        );
-                    } else {
-                        // Recurse once with the source non-Linked cel
-                        self.write_cel(image, cel);
-                    }
-                }
+            CelContent::Linked(_) => {
+                panic!("Cel links to empty cel. Should have been caught by CelsData::validate")
             }
         }
     }
 
     pub(crate) fn layer_image(&self, cel_id: CelId) -> RgbaImage {
         let mut image = RgbaImage::new(self.width as u32, self.height as u32);
-        if let Some(cel) = self.framedata.cel(cel_id) {
-            self.write_cel(&mut image, cel);
+        if let Some(draw_cel) = self
+            .framedata
+            .draw_cel(cel_id, &self.layers, &self.tilesets)
+        {
+            self.write_cel(
+                &mut Canvas::from_image(&mut image),
+                &draw_cel,
+                &mut RenderContext::new(),
+            );
         }
         image
     }
@@ -430,7 +943,13 @@ impl<'a> Frame<'a> {
     /// layers with a deactivated eye icon).
     ///
     pub fn image(&self) -> RgbaImage {
-        self.file.frame_image(self.index as u16)
+        self.file
+            .frame_image(self.index as u16, &RenderOptions::default())
+    }
+
+    /// Like [Frame::image] but only renders the layers selected by `options`.
+    pub fn image_with_options(&self, options: &RenderOptions) -> RgbaImage {
+        self.file.frame_image(self.index as u16, options)
     }
 
     /// Frame ID, i.e., the frame number.
@@ -456,122 +975,3 @@ impl<'a> Frame<'a> {
         self.file.frame_times[self.index as usize] as u32
     }
 }
-
-type BlendFn = Box<dyn Fn(Color8, Color8, u8) -> Color8>;
-
-fn blend_mode_to_blend_fn(mode: BlendMode) -> BlendFn {
-    // TODO: Make these statically allocated
-    match mode {
-        BlendMode::Normal => Box::new(blend::normal),
-        BlendMode::Multiply => Box::new(blend::multiply),
-        BlendMode::Screen => Box::new(blend::screen),
-        BlendMode::Overlay => Box::new(blend::overlay),
-        BlendMode::Darken => Box::new(blend::darken),
-        BlendMode::Lighten => Box::new(blend::lighten),
-        BlendMode::ColorDodge => Box::new(blend::color_dodge),
-        BlendMode::ColorBurn => Box::new(blend::color_burn),
-        BlendMode::HardLight => Box::new(blend::hard_light),
-        BlendMode::SoftLight => Box::new(blend::soft_light),
-        BlendMode::Difference => Box::new(blend::difference),
-        BlendMode::Exclusion => Box::new(blend::exclusion),
-        BlendMode::Hue => Box::new(blend::hsl_hue),
-        BlendMode::Saturation => Box::new(blend::hsl_saturation),
-        BlendMode::Color => Box::new(blend::hsl_color),
-        BlendMode::Luminosity => Box::new(blend::hsl_luminosity),
-        BlendMode::Addition => Box::new(blend::addition),
-        BlendMode::Subtract => Box::new(blend::subtract),
-        BlendMode::Divide => Box::new(blend::divide),
-    }
-}
-
-fn tile_slice<'a, T>(pixels: &'a [T], tile_size: &TileSize, tile_id: &TileId) -> &'a [T] {
-    let pixels_per_tile = tile_size.pixels_per_tile() as usize;
-    let start = pixels_per_tile * (tile_id.0 as usize);
-    let end = start + pixels_per_tile;
-    &pixels[start..end]
-}
-
-fn write_tilemap_cel_to_image(
-    image: &mut RgbaImage,
-    cel_data: &CelCommon,
-    tilemap_data: &TilemapData,
-    tileset: &Tileset,
-    pixels: &[Rgba<u8>],
-    blend_mode: &BlendMode,
-) {
-    let CelCommon { x, y, opacity, .. } = cel_data;
-    let cel_x = *x as i32;
-    let cel_y = *y as i32;
-    // tilemap dimensions
-    let tilemap_width = tilemap_data.width() as i32;
-    let tilemap_height = tilemap_data.height() as i32;
-    //let tiles = &tilemap_data.tiles;
-    // tile dimensions
-    let tile_size = tileset.tile_size();
-    let tile_width = tile_size.width() as i32;
-    let tile_height = tile_size.height() as i32;
-    // pixels
-    let blend_fn = blend_mode_to_blend_fn(*blend_mode);
-
-    for tile_y in 0..tilemap_height {
-        for tile_x in 0..tilemap_width {
-            // TODO: support tile transform flags
-            let tile = tilemap_data
-                .tile(tile_x as u16, tile_y as u16)
-                .expect("Invalid tile index");
-            let tile_id = &tile.id;
-            let tile_pixels = tile_slice(pixels, &tile_size, tile_id);
-            for pixel_y in 0..tile_height {
-                for pixel_x in 0..tile_width {
-                    let pixel_idx = ((pixel_y * tile_width) + pixel_x) as usize;
-                    let image_pixel = tile_pixels[pixel_idx];
-                    let image_x = (tile_x * tile_width) + pixel_x + cel_x;
-                    let image_y = (tile_y * tile_height) + pixel_y + cel_y;
-                    // Skip pixels off of the canvas.
-                    let x_in_bounds = (0..(image.width() as i32)).contains(&image_x);
-                    let y_in_bounds = (0..(image.height() as i32)).contains(&image_y);
-                    if x_in_bounds && y_in_bounds {
-                        let image_x = image_x as u32;
-                        let image_y = image_y as u32;
-                        let src = *image.get_pixel(image_x, image_y);
-                        let new = blend_fn(src, image_pixel, *opacity);
-                        image.put_pixel(image_x, image_y, new);
-                    }
-                }
-            }
-        }
-    }
-}
-
-fn write_raw_cel_to_image(
-    image: &mut RgbaImage,
-    cel_data: &CelCommon,
-    image_size: &ImageSize,
-    pixels: &[Rgba<u8>],
-    blend_mode: &BlendMode,
-) {
-    let ImageSize { width, height } = image_size;
-    let CelCommon { x, y, opacity, .. } = cel_data;
-    let blend_fn = blend_mode_to_blend_fn(*blend_mode);
-    let x0 = *x as i32;
-    let y0 = *y as i32;
-    let x_end = x0 + (*width as i32);
-    let y_end = y0 + (*height as i32);
-    let (img_width, img_height) = image.dimensions();
-
-    for y in y0..y_end {
-        if y < 0 || y >= img_height as i32 {
-            continue;
-        }
-        for x in x0..x_end {
-            if x < 0 || x >= img_width as i32 {
-                continue;
-            }
-            let idx = (y - y0) as usize * *width as usize + (x - x0) as usize;
-            let image_pixel = pixels[idx];
-            let src = *image.get_pixel(x as u32, y as u32);
-            let new = blend_fn(src, image_pixel, *opacity);
-            image.put_pixel(x as u32, y as u32, new);
-        }
-    }
-}
@@ -0,0 +1,117 @@
+use std::{collections::HashMap, sync::Arc};
+
+use image::RgbaImage;
+
+use crate::{cel::CelId, AsepriteFile, RenderContext};
+
+/// Renders frames of a file and shares the result between frames that look
+/// the same.
+///
+/// Two frames look the same if they show the same cels after resolving
+/// linked cels. This is common in animations where most layers are linked
+/// across frames. Each distinct combination of cels is only composited once,
+/// and all frames showing it get the same [Arc].
+///
+/// # Example
+///
+/// ```
+/// # use asefile::{AsepriteFile, FrameCache};
+/// # use std::path::Path;
+/// # let path = Path::new("./tests/data/linked_cels.aseprite");
+/// let ase = AsepriteFile::read_file(&path).unwrap();
+/// let mut cache = FrameCache::new(&ase);
+/// for frame in 0..ase.num_frames() {
+///     let image = cache.frame(frame);
+///     // ...
+/// }
+/// ```
+#[derive(Debug)]
+pub struct FrameCache<'a> {
+    file: &'a AsepriteFile,
+    // Source cels of each visible layer, in layer order. Position and opacity
+    // are properties of the source cel, so they don't need to be part of the
+    // key.
+    images: HashMap<Vec<CelId>, Arc<RgbaImage>>,
+    context: RenderContext,
+}
+
+impl<'a> FrameCache<'a> {
+    /// Create an empty cache for the given file.
+    pub fn new(file: &'a AsepriteFile) -> Self {
+        Self {
+            file,
+            images: HashMap::new(),
+            context: RenderContext::new(),
+        }
+    }
+
+    /// The image of the given frame. Same as [Frame::image](crate::Frame::image),
+    /// but only renders the frame if no frame with the same content has been
+    /// rendered before.
+    ///
+    /// # Panics
+    ///
+    /// Panics if the frame does not exist.
+    pub fn frame(&mut self, frame: u32) -> Arc<RgbaImage> {
+        assert!(frame < self.file.num_frames(), "Frame out of range");
+        let key = self.file.frame_content_key(frame as u16);
+        let Self {
+            file,
+            images,
+            context,
+        } = self;
+        images
+            .entry(key)
+            .or_insert_with(|| {
+                let mut image = RgbaImage::new(file.width() as u32, file.height() as u32);
+                file.render_frame_into(frame, &mut image, context);
+                Arc::new(image)
+            })
+            .clone()
+    }
+
+    /// Number of distinct images rendered so far.
+    pub fn len(&self) -> usize {
+        self.images.len()
+    }
+
+    /// Returns `true` if no frame has been rendered yet.
+    pub fn is_empty(&self) -> bool {
+        self.images.is_empty()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::cel::CelContent;
+    use std::path::Path;
+
+    #[test]
+    fn test_identical_frames_share_image() {
+        let path = Path::new("tests/data/linked_cels.aseprite");
+        let mut f = AsepriteFile::read_file(path).unwrap();
+        // Link every cel of frame 1 to frame 0, so both frames look the same.
+        for layer in 0..f.num_layers() as u16 {
+            let source = f.framedata.cel(CelId { frame: 0, layer });
+            let source_frame = match source.map(|cel| &cel.content) {
+                Some(CelContent::Linked(source_frame)) => *source_frame,
+                _ => 0,
+            };
+            if let Some(cel) = f.framedata.cel_mut(&CelId { frame: 1, layer }) {
+                cel.content = CelContent::Linked(source_frame);
+            }
+        }
+        f.framedata.update_draw_list(1, &f.layers, &f.tilesets);
+        assert_eq!(f.frame_content_key(0), f.frame_content_key(1));
+
+        let mut cache = FrameCache::new(&f);
+        let first = cache.frame(0);
+        let second = cache.frame(1);
+        let third = cache.frame(2);
+        assert!(Arc::ptr_eq(&first, &second));
+        assert!(!Arc::ptr_eq(&first, &third));
+        assert_eq!(cache.len(), 2);
+        assert_eq!(*second, f.frame(1).image());
+    }
+}
@@ -176,6 +176,28 @@ impl LayersData {
         Ok(())
     }
 
+    pub(crate) fn parent(&self, layer_id: u32) -> Option<u32> {
+        self.parents[layer_id as usize]
+    }
+
+    // Fills `out` with one flag per layer that is set if `is_shown` holds for
+    // the layer and all of its parents. Avoids walking the parent chain for
+    // every cel.
+    pub(crate) fn resolve_visibility<F>(&self, is_shown: F, out: &mut Vec<bool>)
+    where
+        F: Fn(u32) -> bool,
+    {
+        out.clear();
+        for layer_id in 0..self.layers.len() as u32 {
+            // Parents always come before their children.
+            let parent_visible = self
+                .parent(layer_id)
+                .map(|parent| out[parent as usize])
+                .unwrap_or(true);
+            out.push(parent_visible && is_shown(layer_id));
+        }
+    }
+
     pub(crate) fn from_vec(layers: Vec<LayerData>) -> Result<Self> {
         // TODO: Validate some properties
         let parents = compute_parents(&layers);
@@ -268,7 +290,7 @@ fn parse_layer_type<R: Read>(id: u16, reader: &mut AseReader<R>) -> Result<Layer
     }
 }
 
-fn parse_blend_mode(id: u16) -> Result<BlendMode> {
+pub(crate) fn parse_blend_mode(id: u16) -> Result<BlendMode> {
     match id {
         0 => Ok(BlendMode::Normal),
         1 => Ok(BlendMode::Multiply),
@@ -167,15 +167,23 @@ Usually, that's a color and a text field. Each of those entities has a
 pub(crate) mod blend;
 pub(crate) mod cel;
 pub(crate) mod color_profile;
+mod compositor;
 pub(crate) mod error;
 pub(crate) mod external_file;
 pub(crate) mod file;
+mod frame_cache;
 pub(crate) mod layer;
+mod metadata;
+pub(crate) mod options;
 pub(crate) mod palette;
+mod parallel;
 pub(crate) mod parse;
 mod pixel;
 mod reader;
+mod render;
 pub(crate) mod slice;
+mod stats;
+mod stream;
 pub(crate) mod tags;
 #[cfg(test)]
 mod tests;
@@ -190,13 +198,21 @@ pub mod util;
 pub type Result<T> = std::result::Result<T, AsepriteParseError>;
 
 pub use cel::Cel;
+pub use compositor::LayerCompositor;
 // pub use color_profile::ColorProfile;
 pub use error::AsepriteParseError;
 pub use external_file::{ExternalFile, ExternalFileId, ExternalFilesById};
 pub use file::{AsepriteFile, Frame, LayersIter, PixelFormat};
+pub use frame_cache::FrameCache;
 pub use layer::{BlendMode, Layer, LayerFlags};
+pub use metadata::{AsepriteMetadata, LayerMetadata};
+pub use options::{LoadOptions, RenderOptions};
 pub use palette::{ColorPalette, ColorPaletteEntry};
+pub use render::RenderContext;
 pub use slice::{Slice, Slice9, SliceKey};
+#[cfg(feature = "stats")]
+pub use stats::Stats;
+pub use stream::FrameStream;
 pub use tags::{AnimationDirection, Tag};
 pub use tile::Tile;
 pub use tilemap::Tilemap;
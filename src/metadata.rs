@@ -0,0 +1,181 @@
+use crate::{
+    layer::{LayerData, LayerType, LayersData},
+    slice::Slice,
+    user_data::UserData,
+    BlendMode, LayerFlags, PixelFormat, Tag,
+};
+
+/// The metadata of an Aseprite file, without any image data.
+///
+/// Created with [AsepriteFile::scan](crate::AsepriteFile::scan) or
+/// [AsepriteFile::scan_file](crate::AsepriteFile::scan_file). This is much
+/// faster than loading the full file, because the image data is skipped
+/// entirely instead of being read and decompressed.
+#[derive(Debug)]
+pub struct AsepriteMetadata {
+    pub(crate) width: u16,
+    pub(crate) height: u16,
+    pub(crate) num_frames: u16,
+    pub(crate) pixel_format: PixelFormat,
+    pub(crate) layers: LayersData,
+    pub(crate) frame_times: Vec<u16>,
+    pub(crate) tags: Vec<Tag>,
+    pub(crate) sprite_user_data: Option<UserData>,
+    pub(crate) slices: Vec<Slice>,
+}
+
+impl AsepriteMetadata {
+    /// Width in pixels.
+    pub fn width(&self) -> usize {
+        self.width as usize
+    }
+
+    /// Height in pixels.
+    pub fn height(&self) -> usize {
+        self.height as usize
+    }
+
+    /// Width and height in pixels.
+    pub fn size(&self) -> (usize, usize) {
+        (self.width(), self.height())
+    }
+
+    /// Number of animation frames.
+    pub fn num_frames(&self) -> u32 {
+        self.num_frames as u32
+    }
+
+    /// The pixel format used by the original file.
+    pub fn pixel_format(&self) -> PixelFormat {
+        self.pixel_format
+    }
+
+    /// Duration of the given frame in milliseconds.
+    ///
+    /// # Panics
+    ///
+    /// Panics if `frame` is not less than `num_frames`.
+    pub fn frame_duration(&self, frame: u32) -> u32 {
+        self.frame_times[frame as usize] as u32
+    }
+
+    /// Number of layers.
+    pub fn num_layers(&self) -> u32 {
+        self.layers.layers.len() as u32
+    }
+
+    /// Access a layer by ID.
+    ///
+    /// # Panics
+    ///
+    /// Panics if the ID is not valid. ID must be less than number of layers.
+    pub fn layer(&self, id: u32) -> LayerMetadata<'_> {
+        assert!(id < self.num_layers());
+        LayerMetadata {
+            layers: &self.layers,
+            layer_id: id,
+        }
+    }
+
+    /// Access a layer by name.
+    ///
+    /// If multiple layers with the same name exist returns the layer with
+    /// the lower ID.
+    pub fn layer_by_name(&self, name: &str) -> Option<LayerMetadata<'_>> {
+        self.layers().find(|l| l.name() == name)
+    }
+
+    /// An iterator over all layers.
+    pub fn layers(&self) -> impl Iterator<Item = LayerMetadata<'_>> {
+        (0..self.num_layers()).map(move |id| self.layer(id))
+    }
+
+    /// All tags.
+    pub fn tags(&self) -> &[Tag] {
+        &self.tags
+    }
+
+    /// Lookup tag by name.
+    ///
+    /// If multiple tags with the same name exist, returns the one with the
+    /// lower ID.
+    pub fn tag_by_name(&self, name: &str) -> Option<&Tag> {
+        self.tags.iter().find(|tag| tag.name() == name)
+    }
+
+    /// All [Slice]s in the file.
+    pub fn slices(&self) -> &[Slice] {
+        &self.slices
+    }
+
+    /// The user data for the entire sprite, if any exists.
+    pub fn sprite_user_data(&self) -> Option<&UserData> {
+        self.sprite_user_data.as_ref()
+    }
+}
+
+/// The metadata of a single layer. See [AsepriteMetadata::layer].
+///
+/// Same as [Layer](crate::Layer) but without access to image data.
+#[derive(Debug)]
+pub struct LayerMetadata<'a> {
+    layers: &'a LayersData,
+    layer_id: u32,
+}
+
+impl<'a> LayerMetadata<'a> {
+    fn data(&self) -> &LayerData {
+        &self.layers[self.layer_id]
+    }
+
+    /// This layer's ID.
+    pub fn id(&self) -> u32 {
+        self.layer_id
+    }
+
+    /// Layer's flags
+    pub fn flags(&self) -> LayerFlags {
+        self.data().flags
+    }
+
+    /// Name of the layer
+    pub fn name(&self) -> &str {
+        &self.data().name
+    }
+
+    /// Blend mode of the layer.
+    pub fn blend_mode(&self) -> BlendMode {
+        self.data().blend_mode
+    }
+
+    /// Layer opacity.
+    pub fn opacity(&self) -> u8 {
+        self.data().opacity
+    }
+
+    /// Describes whether this is a regular, group, or tilemap layer.
+    pub fn layer_type(&self) -> LayerType {
+        self.data().layer_type
+    }
+
+    /// The parent of this layer, if any.
+    pub fn parent(&self) -> Option<LayerMetadata<'a>> {
+        self.layers.parent(self.layer_id).map(|id| LayerMetadata {
+            layers: self.layers,
+            layer_id: id,
+        })
+    }
+
+    /// Returns if this layer is visible. This requires that this layer and all
+    /// of its parent layers are visible.
+    pub fn is_visible(&self) -> bool {
+        let layer_is_visible = self.data().flags.contains(LayerFlags::VISIBLE);
+        let parent_is_visible = self.parent().map(|p| p.is_visible()).unwrap_or(true);
+        layer_is_visible && parent_is_visible
+    }
+
+    /// Returns a reference to the layer's [UserData], if any exists.
+    pub fn user_data(&self) -> Option<&'a UserData> {
+        self.layers[self.layer_id].user_data.as_ref()
+    }
+}
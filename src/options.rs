@@ -0,0 +1,173 @@
+use crate::{AsepriteFile, Layer, LayerFlags};
+
+/// Options that control how an Aseprite file is loaded.
+///
+/// Use with [AsepriteFile::read_with_options](crate::AsepriteFile::read_with_options)
+/// or [AsepriteFile::read_file_with_options](crate::AsepriteFile::read_file_with_options).
+/// The defaults match [AsepriteFile::read](crate::AsepriteFile::read).
+///
+/// # Example
+///
+/// ```
+/// # use asefile::{AsepriteFile, LoadOptions};
+/// # use std::path::Path;
+/// # let path = Path::new("./tests/data/basic-16x16.aseprite");
+/// let options = LoadOptions {
+///     lazy_cels: true,
+///     ..Default::default()
+/// };
+/// let ase = AsepriteFile::read_file_with_options(&path, &options).unwrap();
+/// // Only the cels of frame 0 get decompressed.
+/// let image = ase.frame(0).image();
+/// ```
+#[derive(Debug, Clone, Default)]
+pub struct LoadOptions {
+    /// Keep compressed cel and tileset images compressed until they are first
+    /// used (e.g., via [Frame::image](crate::Frame::image),
+    /// [Cel::image](crate::Cel::image) or a [Tilemap](crate::Tilemap)). The
+    /// decompressed pixels are then cached until
+    /// [AsepriteFile::release_decoded_pixels](crate::AsepriteFile::release_decoded_pixels)
+    /// is called.
+    ///
+    /// This makes loading much faster if you only need a few frames or only
+    /// the metadata (tags, slices, layers, etc.).
+    ///
+    /// The downside is that corrupted pixel data is no longer detected while
+    /// loading the file. If a compressed image turns out to be invalid later,
+    /// a warning is logged and the image is treated as fully transparent.
+    pub lazy_cels: bool,
+
+    /// Decompress cel and tileset images on all available CPU cores instead
+    /// of only on the calling thread. The resulting file is the same.
+    ///
+    /// Has no effect if `lazy_cels` is set.
+    pub parallel: bool,
+
+    /// Store the decompressed pixels of identical cels only once, even if
+    /// the cels are not linked. With
+    /// [AsepriteFile::read_files](crate::AsepriteFile::read_files) this
+    /// includes identical cels in different files.
+    ///
+    /// Saves memory for files with many copy-pasted cels, at the cost of
+    /// hashing every cel while loading (see
+    /// [Cel::content_hash](crate::Cel::content_hash)). Has no effect if
+    /// `lazy_cels` is set.
+    pub share_identical_cels: bool,
+}
+
+/// Options that control which layers are rendered, without modifying the
+/// file.
+///
+/// Use with [Frame::image_with_options](crate::Frame::image_with_options) or
+/// [AsepriteFile::render_frame_into_with_options](crate::AsepriteFile::render_frame_into_with_options).
+/// The defaults render the same image as [Frame::image](crate::Frame::image).
+///
+/// # Example
+///
+/// ```
+/// # use asefile::{AsepriteFile, RenderOptions};
+/// # use std::path::Path;
+/// # let path = Path::new("./tests/data/layers_and_tags.aseprite");
+/// let ase = AsepriteFile::read_file(&path).unwrap();
+/// let options = RenderOptions::new().only_layers_where(&ase, |layer| layer.name() != "Layer 1");
+/// let image = ase.frame(0).image_with_options(&options);
+/// ```
+#[derive(Debug, Clone, Default)]
+pub struct RenderOptions {
+    // One bit per layer id. `None` selects all layers.
+    selected_layers: Option<Vec<u64>>,
+    include_hidden_layers: bool,
+}
+
+impl RenderOptions {
+    /// Options that render all visible layers.
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Only render the given layers. Cels are rendered if the layer they
+    /// belong to is selected; selecting a group layer does not select the
+    /// layers inside it. Ids that no layer can have (above `u16::MAX`) are
+    /// ignored.
+    pub fn only_layers<I: IntoIterator<Item = u32>>(mut self, layer_ids: I) -> Self {
+        let mut bits = Vec::new();
+        // Layer ids are 16 bits in the file format.
+        for id in layer_ids.into_iter().filter(|&id| id <= u16::MAX as u32) {
+            let word = id as usize / 64;
+            if bits.len() <= word {
+                bits.resize(word + 1, 0);
+            }
+            bits[word] |= 1 << (id % 64);
+        }
+        self.selected_layers = Some(bits);
+        self
+    }
+
+    /// Only render the layers of `file` for which `predicate` returns `true`.
+    /// See [RenderOptions::only_layers].
+    pub fn only_layers_where<F>(self, file: &AsepriteFile, mut predicate: F) -> Self
+    where
+        F: FnMut(&Layer) -> bool,
+    {
+        let ids: Vec<u32> = file
+            .layers()
+            .filter(|layer| predicate(layer))
+            .map(|layer| layer.id())
+            .collect();
+        self.only_layers(ids)
+    }
+
+    /// Also render layers that are hidden in the file (i.e., layers with a
+    /// deactivated eye icon, or inside a hidden group).
+    pub fn include_hidden_layers(mut self, include: bool) -> Self {
+        self.include_hidden_layers = include;
+        self
+    }
+
+    /// Returns `true` if the layer is selected. Ignores visibility.
+    pub fn is_layer_selected(&self, layer_id: u32) -> bool {
+        match &self.selected_layers {
+            None => true,
+            Some(bits) => bits
+                .get(layer_id as usize / 64)
+                .map(|word| word & (1 << (layer_id % 64)) != 0)
+                .unwrap_or(false),
+        }
+    }
+
+    // Fills `out` with a flag for each layer of `file` that is set if the
+    // layer's cels should be rendered.
+    pub(crate) fn resolve_layers(&self, file: &AsepriteFile, out: &mut Vec<bool>) {
+        let layers = &file.layers;
+        if self.include_hidden_layers {
+            out.clear();
+            out.extend((0..layers.layers.len() as u32).map(|id| self.is_layer_selected(id)));
+        } else {
+            layers.resolve_visibility(|id| layers[id].flags.contains(LayerFlags::VISIBLE), out);
+            for (id, shown) in out.iter_mut().enumerate() {
+                *shown = *shown && self.is_layer_selected(id as u32);
+            }
+        }
+    }
+}
+
+#[test]
+fn test_layer_selection() {
+    let options = RenderOptions::new();
+    assert!(options.is_layer_selected(0) && options.is_layer_selected(1000));
+    let options = options.only_layers(vec![1, 64, 130]);
+    assert!(!options.is_layer_selected(0));
+    assert!(options.is_layer_selected(1));
+    assert!(options.is_layer_selected(64));
+    assert!(!options.is_layer_selected(65));
+    assert!(options.is_layer_selected(130));
+    assert!(!options.is_layer_selected(1000));
+
+    // Ids beyond the 16-bit range don't grow the bit set.
+    let options = RenderOptions::new().only_layers(vec![3, u16::MAX as u32 + 1, u32::MAX]);
+    assert_eq!(options.selected_layers.as_ref().map(Vec::len), Some(1));
+    assert!(options.is_layer_selected(3));
+    assert!(!options.is_layer_selected(u32::MAX));
+    let options = RenderOptions::new().only_layers(vec![u16::MAX as u32]);
+    assert!(options.is_layer_selected(u16::MAX as u32));
+}
@@ -1,15 +1,29 @@
 use crate::{reader::AseReader, AsepriteParseError, Result};
+use image::Rgba;
 use nohash::IntMap;
+use std::{
+    collections::{hash_map::DefaultHasher, HashMap},
+    hash::{Hash, Hasher},
+    sync::{Arc, Mutex},
+};
 
 /// The color palette embedded in the file.
-#[derive(Debug)]
+#[derive(Debug, PartialEq, Eq)]
 pub struct ColorPalette {
     //entries: Vec<ColorPaletteEntry>,
     pub(crate) entries: IntMap<u32, ColorPaletteEntry>,
+    // The colors of entries `0..256` for resolving indexed pixels. Missing
+    // entries are fully transparent.
+    rgba_table: [Rgba<u8>; 256],
+    // Whether there is an entry for a given index in `0..256`.
+    has_index: [bool; 256],
+    // True if the entries' ids are exactly `0..num_colors()`, which is
+    // always the case for palettes created by Aseprite.
+    is_dense: bool,
 }
 
 /// A single entry in a [ColorPalette].
-#[derive(Debug)]
+#[derive(Debug, PartialEq, Eq)]
 pub struct ColorPaletteEntry {
     id: u32,
     rgba8: [u8; 4],
@@ -17,6 +31,27 @@ pub struct ColorPaletteEntry {
 }
 
 impl ColorPalette {
+    fn new(entries: IntMap<u32, ColorPaletteEntry>) -> Self {
+        let mut rgba_table = [Rgba([0, 0, 0, 0]); 256];
+        let mut has_index = [false; 256];
+        for index in 0..256 {
+            if let Some(entry) = entries.get(&(index as u32)) {
+                rgba_table[index] = Rgba(entry.rgba8);
+                has_index[index] = true;
+            }
+        }
+        // Ids are unique, so they cover `0..len` iff all of them are
+        // below `len`.
+        let num_colors = entries.len() as u32;
+        let is_dense = entries.keys().all(|&id| id < num_colors);
+        Self {
+            entries,
+            rgba_table,
+            has_index,
+            is_dense,
+        }
+    }
+
     /// Total number of colors in the palette.
     pub fn num_colors(&self) -> u32 {
         self.entries.len() as u32
@@ -31,18 +66,53 @@ impl ColorPalette {
         self.entries.get(&index)
     }
 
-    pub(crate) fn validate_indexed_pixels(&self, indexed_pixels: &[u8]) -> Result<()> {
-        // TODO: Make way more efficient at least for the common case where
-        // the palette goes from `0..num_colors`. Just search for a value >=
-        // num_colors. Maybe make palette an enum and discover dense format
-        // after parsing.
-        for pixel in indexed_pixels {
-            let color = self.color(*pixel as u32);
-            color.ok_or_else(|| {
-                AsepriteParseError::InvalidInput(format!("Palette index invalid: {}", pixel,))
-            })?;
+    pub(crate) fn rgba_table(&self) -> &[Rgba<u8>; 256] {
+        &self.rgba_table
+    }
+
+    /// The color at `index` as an RGBA pixel. Same as [ColorPalette::color]
+    /// but a plain table lookup.
+    pub(crate) fn rgba(&self, index: u8) -> Option<Rgba<u8>> {
+        if self.has_index[index as usize] {
+            Some(self.rgba_table[index as usize])
+        } else {
+            None
         }
-        Ok(())
+    }
+
+    // True if all colors except the one at `index` are fully opaque.
+    #[cfg(feature = "utils")]
+    pub(crate) fn is_opaque_except(&self, index: u8) -> bool {
+        self.entries
+            .values()
+            .all(|entry| entry.id == index as u32 || entry.alpha() == 255)
+    }
+
+    pub(crate) fn validate_indexed_pixels(&self, indexed_pixels: &[u8]) -> Result<()> {
+        let invalid_index = if self.is_dense {
+            // Every index below `num_colors` is valid, so it's enough to look
+            // at the largest one. This loop gets vectorized.
+            if self.num_colors() >= 256 {
+                return Ok(());
+            }
+            let max_index = indexed_pixels.iter().fold(0, |max, &px| max.max(px));
+            if (max_index as u32) < self.num_colors() {
+                return Ok(());
+            }
+            max_index
+        } else {
+            match indexed_pixels
+                .iter()
+                .find(|&&px| !self.has_index[px as usize])
+            {
+                Some(&px) => px,
+                None => return Ok(()),
+            }
+        };
+        Err(AsepriteParseError::InvalidInput(format!(
+            "Palette index invalid: {}",
+            invalid_index
+        )))
     }
 }
 
@@ -84,6 +154,37 @@ impl ColorPaletteEntry {
     }
 }
 
+// Hands out one shared `Arc` for all equal palettes, so files loaded together
+// that use the same palette (e.g., a project palette) don't each keep a copy.
+#[derive(Default)]
+pub(crate) struct PalettePool {
+    // Palettes by a hash of their colors. Palettes that only differ in names
+    // share a bucket.
+    palettes: Mutex<HashMap<u64, Vec<Arc<ColorPalette>>>>,
+}
+
+impl PalettePool {
+    pub(crate) fn intern(&self, palette: Arc<ColorPalette>) -> Arc<ColorPalette> {
+        let mut hasher = DefaultHasher::new();
+        palette.num_colors().hash(&mut hasher);
+        palette
+            .rgba_table
+            .iter()
+            .for_each(|c| c.0.hash(&mut hasher));
+        let key = hasher.finish();
+
+        let mut palettes = self.palettes.lock().expect("Palette pool poisoned");
+        let bucket = palettes.entry(key).or_default();
+        match bucket.iter().find(|p| **p == palette) {
+            Some(shared) => shared.clone(),
+            None => {
+                bucket.push(palette.clone());
+                palette
+            }
+        }
+    }
+}
+
 pub(crate) fn parse_chunk(data: &[u8]) -> Result<ColorPalette> {
     let mut reader = AseReader::new(data);
 
@@ -126,5 +227,48 @@ pub(crate) fn parse_chunk(data: &[u8]) -> Result<ColorPalette> {
         );
     }
 
-    Ok(ColorPalette { entries })
+    Ok(ColorPalette::new(entries))
+}
+
+#[cfg(test)]
+fn test_palette(ids: &[u32]) -> ColorPalette {
+    let entries = ids
+        .iter()
+        .map(|&id| {
+            let entry = ColorPaletteEntry {
+                id,
+                rgba8: [id as u8, 0, 0, 255],
+                name: None,
+            };
+            (id, entry)
+        })
+        .collect();
+    ColorPalette::new(entries)
+}
+
+#[test]
+fn test_validate_indexed_pixels() {
+    let dense = test_palette(&[0, 1, 2, 3]);
+    assert!(dense.is_dense);
+    assert!(dense.validate_indexed_pixels(&[0, 3, 2, 1, 0]).is_ok());
+    assert!(dense.validate_indexed_pixels(&[]).is_ok());
+    assert!(dense.validate_indexed_pixels(&[0, 4, 1]).is_err());
+
+    let sparse = test_palette(&[0, 1, 5]);
+    assert!(!sparse.is_dense);
+    assert!(sparse.validate_indexed_pixels(&[5, 0, 1]).is_ok());
+    assert!(sparse.validate_indexed_pixels(&[0, 2]).is_err());
+    assert!(sparse.validate_indexed_pixels(&[6]).is_err());
+    assert_eq!(sparse.rgba(5), Some(Rgba([5, 0, 0, 255])));
+    assert_eq!(sparse.rgba(2), None);
+}
+
+#[test]
+fn test_palette_pool() {
+    let pool = PalettePool::default();
+    let a = pool.intern(Arc::new(test_palette(&[0, 1, 2])));
+    let b = pool.intern(Arc::new(test_palette(&[0, 1, 2])));
+    let c = pool.intern(Arc::new(test_palette(&[0, 1])));
+    assert!(Arc::ptr_eq(&a, &b));
+    assert!(!Arc::ptr_eq(&a, &c));
 }
@@ -0,0 +1,160 @@
+// Minimal work queue on top of scoped std threads.
+
+use std::{
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Mutex,
+    },
+    thread,
+};
+
+/// Calls `f` on every item, spread across all available cores. Returns the
+/// first error encountered (in no particular order); once an item fails, no
+/// worker starts on another one.
+///
+/// Workers pull the next item from a shared queue, so a few expensive items
+/// don't leave the other threads idle.
+pub(crate) fn try_for_each<T, E, F>(items: Vec<T>, f: F) -> Result<(), E>
+where
+    T: Send,
+    E: Send,
+    F: Fn(T) -> Result<(), E> + Sync,
+{
+    try_for_each_with(items, || (), |_, item| f(item))
+}
+
+/// Like [try_for_each] but every worker thread first creates a state with
+/// `init`, which it then passes to `f` for each of its items. Useful for
+/// reusing buffers.
+pub(crate) fn try_for_each_with<S, T, E, I, F>(items: Vec<T>, init: I, f: F) -> Result<(), E>
+where
+    T: Send,
+    E: Send,
+    I: Fn() -> S + Sync,
+    F: Fn(&mut S, T) -> Result<(), E> + Sync,
+{
+    let num_threads = thread::available_parallelism()
+        .map(|n| n.get())
+        .unwrap_or(1)
+        .min(items.len());
+    if num_threads <= 1 {
+        let mut state = init();
+        return items.into_iter().try_for_each(|item| f(&mut state, item));
+    }
+
+    let queue = Mutex::new(items.into_iter());
+    // Set by the first failing worker so the others stop taking items.
+    let failed = AtomicBool::new(false);
+    let next = || {
+        if failed.load(Ordering::Relaxed) {
+            return None;
+        }
+        queue.lock().expect("Worker thread panicked").next()
+    };
+    thread::scope(|scope| {
+        let workers: Vec<_> = (0..num_threads)
+            .map(|_| {
+                scope.spawn(|| {
+                    let mut state = init();
+                    while let Some(item) = next() {
+                        if let Err(err) = f(&mut state, item) {
+                            failed.store(true, Ordering::Relaxed);
+                            return Err(err);
+                        }
+                    }
+                    Ok(())
+                })
+            })
+            .collect();
+        workers
+            .into_iter()
+            .try_for_each(|worker| worker.join().expect("Worker thread panicked"))
+    })
+}
+
+/// Like [try_for_each] for operations that cannot fail.
+pub(crate) fn for_each<T, F>(items: Vec<T>, f: F)
+where
+    T: Send,
+    F: Fn(T) + Sync,
+{
+    let result: Result<(), std::convert::Infallible> = try_for_each(items, |item| {
+        f(item);
+        Ok(())
+    });
+    if let Err(never) = result {
+        match never {}
+    }
+}
+
+/// Like [try_for_each_with] for operations that cannot fail.
+pub(crate) fn for_each_with<S, T, I, F>(items: Vec<T>, init: I, f: F)
+where
+    T: Send,
+    I: Fn() -> S + Sync,
+    F: Fn(&mut S, T) + Sync,
+{
+    let result: Result<(), std::convert::Infallible> =
+        try_for_each_with(items, init, |state, item| {
+            f(state, item);
+            Ok(())
+        });
+    if let Err(never) = result {
+        match never {}
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::{sync::atomic::AtomicUsize, time::Duration};
+
+    #[test]
+    fn test_try_for_each() {
+        let sum = AtomicUsize::new(0);
+        for_each((1..=100).collect(), |n| {
+            sum.fetch_add(n, Ordering::Relaxed);
+        });
+        assert_eq!(sum.into_inner(), 5050);
+
+        let result = try_for_each(
+            (0..100).collect(),
+            |n| if n == 42 { Err(n) } else { Ok(()) },
+        );
+        assert_eq!(result, Err(42));
+    }
+
+    #[test]
+    fn test_try_for_each_stops_all_workers() {
+        let processed = AtomicUsize::new(0);
+        let result = try_for_each((0..1000).collect(), |n| {
+            processed.fetch_add(1, Ordering::Relaxed);
+            if n == 0 {
+                return Err(n);
+            }
+            thread::sleep(Duration::from_millis(1));
+            Ok(())
+        });
+        assert_eq!(result, Err(0));
+        assert!(processed.into_inner() < 1000);
+    }
+
+    #[test]
+    fn test_for_each_with() {
+        let initialized = AtomicUsize::new(0);
+        let sum = AtomicUsize::new(0);
+        for_each_with(
+            (1..=100).collect(),
+            || initialized.fetch_add(1, Ordering::Relaxed),
+            |_, n| {
+                sum.fetch_add(n, Ordering::Relaxed);
+            },
+        );
+        assert_eq!(sum.into_inner(), 5050);
+        // One state per worker thread, not per item.
+        let num_threads = thread::available_parallelism()
+            .map(|n| n.get())
+            .unwrap_or(1);
+        assert!(initialized.into_inner() <= num_threads);
+    }
+}
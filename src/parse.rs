@@ -1,13 +1,18 @@
 use crate::cel::CelId;
 use crate::external_file::{ExternalFile, ExternalFilesById};
 use crate::layer::{LayerData, LayersData};
-use crate::pixel::{Pixels, RawPixels};
-use crate::reader::AseReader;
+use crate::palette::PalettePool;
+use crate::pixel::{PixelPool, Pixels, RawPixels};
+use crate::reader::{AseReader, Skip, SliceReader};
 use crate::slice::Slice;
+use crate::stats::{count, timed};
 use crate::tileset::{Tileset, TilesetsById};
 use crate::user_data::UserData;
-use crate::{error::AsepriteParseError, AsepriteFile, PixelFormat};
+use crate::{
+    error::AsepriteParseError, parallel, AsepriteFile, AsepriteMetadata, LoadOptions, PixelFormat,
+};
 use log::debug;
+use std::borrow::Cow;
 use std::io::Read;
 use std::sync::Arc;
 
@@ -118,6 +123,7 @@ impl ParseInfo {
             UserDataContext::OldPalette => {
                 self.sprite_user_data = Some(user_data);
             }
+            UserDataContext::Ignored => {}
             UserDataContext::TagIndex(tag_index) => {
                 self.set_tag_user_data(user_data, tag_index)?;
             }
@@ -140,9 +146,21 @@ impl ParseInfo {
         self.user_data_context = Some(UserDataContext::SliceIndex(context_idx as u32));
     }
 
+    fn add_pixel_chunk(&mut self, frame_id: u16, chunk: PixelChunk) -> Result<()> {
+        match chunk {
+            PixelChunk::Cel(cel) => self.add_cel(frame_id, cel)?,
+            PixelChunk::Tileset(tileset) => self.tilesets.add(*tileset),
+        }
+        Ok(())
+    }
+
     // Validate moves the ParseInfo data into an intermediate ValidatedParseInfo struct,
     // which is then used to create the AsepriteFile.
     fn validate(self, pixel_format: &PixelFormat) -> Result<ValidatedParseInfo> {
+        timed!(validate, self.validate_chunks(pixel_format))
+    }
+
+    fn validate_chunks(self, pixel_format: &PixelFormat) -> Result<ValidatedParseInfo> {
         let layers = LayersData::from_vec(self.layers)?;
 
         let tilesets = self.tilesets;
@@ -151,9 +169,9 @@ impl ParseInfo {
         layers.validate(&tilesets)?;
 
         //let framedata = self.framedata;
-        let framedata = self
-            .framedata
-            .validate(&layers, pixel_format, palette.clone())?;
+        let framedata =
+            self.framedata
+                .validate(&layers, &tilesets, pixel_format, palette.clone())?;
 
         Ok(ValidatedParseInfo {
             layers,
@@ -181,10 +199,262 @@ struct ValidatedParseInfo {
     slices: Vec<Slice>,
 }
 
+impl ValidatedParseInfo {
+    fn into_file(self, header: &FileHeader) -> AsepriteFile {
+        AsepriteFile {
+            width: header.width,
+            height: header.height,
+            num_frames: header.num_frames,
+            pixel_format: header.pixel_format,
+            palette: self.palette,
+            layers: self.layers,
+            frame_times: self.frame_times,
+            tags: self.tags,
+            framedata: self.framedata,
+            external_files: self.external_files,
+            tilesets: self.tilesets,
+            sprite_user_data: self.sprite_user_data,
+            slices: self.slices,
+        }
+    }
+}
+
+struct FileHeader {
+    num_frames: u16,
+    width: u16,
+    height: u16,
+    pixel_format: PixelFormat,
+    default_frame_time: u16,
+}
+
 // file format docs: https://github.com/aseprite/aseprite/blob/master/docs/ase-file-specs.md
 // v1.3 spec diff doc: https://gist.github.com/dacap/35f3b54fbcd021d099e0166a4f295bab
-pub fn read_aseprite<R: Read>(input: R) -> Result<AsepriteFile> {
+pub fn read_aseprite<R: Read>(input: R, options: &LoadOptions) -> Result<AsepriteFile> {
+    let mut reader = AseReader::with(input);
+    read_frames(&mut reader, options, None, read_frame_chunks)
+}
+
+// Like `read_aseprite` but parses chunks in place instead of copying each of
+// them into a separate buffer first.
+pub fn read_aseprite_slice(data: &[u8], options: &LoadOptions) -> Result<AsepriteFile> {
+    read_aseprite_slice_shared(data, options, None)
+}
+
+// Data shared by all files that are loaded together, see
+// `AsepriteFile::read_files`.
+#[derive(Default)]
+pub(crate) struct SharedData {
+    pub(crate) palettes: PalettePool,
+    // Only used with `LoadOptions::share_identical_cels`.
+    pub(crate) pixels: PixelPool,
+}
+
+// Like `read_aseprite_slice` but shares palettes and pixels with files
+// loaded before with the same `shared`.
+pub(crate) fn read_aseprite_slice_shared(
+    data: &[u8],
+    options: &LoadOptions,
+    shared: Option<&SharedData>,
+) -> Result<AsepriteFile> {
+    let mut reader = AseReader::new(data);
+    read_frames(&mut reader, options, shared, read_frame_chunks_slice)
+}
+
+fn read_frames<'a, R, F>(
+    reader: &mut AseReader<R>,
+    options: &LoadOptions,
+    shared: Option<&SharedData>,
+    read_chunks: F,
+) -> Result<AsepriteFile>
+where
+    R: Read,
+    F: Fn(&mut AseReader<R>, u16, &mut ParseInfo) -> Result<Vec<Chunk<'a>>>,
+{
+    let header = parse_header(reader)?;
+    let pixel_format = header.pixel_format;
+    let mut parse_info = ParseInfo::new(header.num_frames, header.default_frame_time);
+
+    if options.parallel && !options.lazy_cels {
+        // All chunks are read first, so that their pixels can be decompressed
+        // in parallel.
+        let mut frames = Vec::with_capacity(header.num_frames as usize);
+        for frame_id in 0..header.num_frames {
+            frames.push(read_chunks(reader, frame_id, &mut parse_info)?);
+        }
+        parse_frames_parallel(&frames, pixel_format, options, &mut parse_info)?;
+    } else {
+        for frame_id in 0..header.num_frames {
+            // println!("--- Frame {} -------", frame_id);
+            let chunks = read_chunks(reader, frame_id, &mut parse_info)?;
+            parse_chunks(&chunks, frame_id, pixel_format, options, &mut parse_info)?;
+        }
+    }
+    // Before validation hands out copies of the palette to the pixels.
+    if let Some(shared) = shared {
+        parse_info.palette = parse_info.palette.map(|p| shared.palettes.intern(p));
+    }
+
+    let validated = parse_info.validate(&header.pixel_format)?;
+    let mut file = validated.into_file(&header);
+    if options.share_identical_cels && !options.lazy_cels {
+        let own_pixels;
+        let pixels = match shared {
+            Some(shared) => &shared.pixels,
+            None => {
+                own_pixels = PixelPool::default();
+                &own_pixels
+            }
+        };
+        file.framedata.share_pixels(pixels);
+    }
+    Ok(file)
+}
+
+// Parses a file one frame at a time for `FrameStream`. The header and the
+// first frame, which holds the layers, palette, and tilesets, are parsed into
+// an `AsepriteFile` up front. The cels of each later frame are then added to
+// that file as the frame is read.
+pub(crate) struct StreamParser<R: Read> {
+    reader: AseReader<R>,
+    pixel_format: PixelFormat,
+    // Collects the chunks of the current frame.
+    parse_info: ParseInfo,
+    next_frame: u16,
+}
+
+// Cels are kept compressed until they are drawn, so that the file's frames
+// can be released again after rendering.
+const STREAM_OPTIONS: LoadOptions = LoadOptions {
+    lazy_cels: true,
+    parallel: false,
+    share_identical_cels: false,
+};
+
+pub(crate) fn stream_aseprite<R: Read>(input: R) -> Result<(AsepriteFile, StreamParser<R>)> {
     let mut reader = AseReader::with(input);
+    let header = parse_header(&mut reader)?;
+    let mut parse_info = ParseInfo::new(header.num_frames, header.default_frame_time);
+    if header.num_frames > 0 {
+        parse_frame(&mut reader, 0, header.pixel_format, &mut parse_info)?;
+    }
+    let file = parse_info
+        .validate(&header.pixel_format)?
+        .into_file(&header);
+    let parser = StreamParser {
+        reader,
+        pixel_format: header.pixel_format,
+        parse_info: ParseInfo::new(header.num_frames, header.default_frame_time),
+        next_frame: 1,
+    };
+    Ok((file, parser))
+}
+
+impl<R: Read> StreamParser<R> {
+    // Reads the next frame and adds its cels to `file`. Returns the frame's
+    // index, or `None` after the last frame.
+    pub(crate) fn parse_next_frame(&mut self, file: &mut AsepriteFile) -> Result<Option<u16>> {
+        let frame_id = self.next_frame;
+        if frame_id >= file.num_frames {
+            return Ok(None);
+        }
+        self.next_frame += 1;
+        let parse_info = &mut self.parse_info;
+        parse_frame(&mut self.reader, frame_id, self.pixel_format, parse_info)?;
+
+        if !parse_info.layers.is_empty() || parse_info.tilesets.len() > 0 {
+            return Err(AsepriteParseError::UnsupportedFeature(format!(
+                "Layers or tilesets in frame {}. Only the first frame may define them when streaming",
+                frame_id
+            )));
+        }
+        if let Some(palette) = parse_info.palette.take() {
+            file.palette = Some(palette);
+        }
+        file.slices.append(&mut parse_info.slices);
+        file.frame_times[frame_id as usize] = parse_info.frame_times[frame_id as usize];
+        let cels = parse_info.framedata.take_frame(frame_id);
+        file.framedata.add_frame(
+            frame_id,
+            cels,
+            &file.layers,
+            &file.tilesets,
+            &self.pixel_format,
+            file.palette.clone(),
+        )?;
+        Ok(Some(frame_id))
+    }
+}
+
+// Like `read_aseprite` but seeks over all chunks that hold image data (and
+// the palette). Cel user data is dropped.
+pub fn scan_aseprite<R: Skip>(input: R) -> Result<AsepriteMetadata> {
+    let mut reader = AseReader::with(input);
+    let FileHeader {
+        num_frames,
+        width,
+        height,
+        pixel_format,
+        default_frame_time,
+    } = parse_header(&mut reader)?;
+
+    let mut parse_info = ParseInfo::new(num_frames, default_frame_time);
+
+    for frame_id in 0..num_frames {
+        let FrameHeader {
+            num_chunks,
+            mut bytes_available,
+        } = parse_frame_header(&mut reader, frame_id, &mut parse_info)?;
+        for _idx in 0..num_chunks {
+            let (chunk_type, data_size) = Chunk::read_header(&mut bytes_available, &mut reader)?;
+            match chunk_type {
+                ChunkType::Cel
+                | ChunkType::CelExtra
+                | ChunkType::Tileset
+                | ChunkType::Palette
+                | ChunkType::ColorProfile
+                | ChunkType::ExternalFiles
+                | ChunkType::Mask
+                | ChunkType::Path => {
+                    reader.seek_forward(data_size)?;
+                    if chunk_type == ChunkType::Cel {
+                        parse_info.user_data_context = Some(UserDataContext::Ignored);
+                    }
+                }
+                _ => {
+                    let mut data = vec![0_u8; data_size];
+                    timed!(read, reader.read_exact(&mut data))?;
+                    parse_chunk(
+                        chunk_type,
+                        &data,
+                        frame_id,
+                        pixel_format,
+                        &LoadOptions::default(),
+                        &mut parse_info,
+                    )?;
+                }
+            }
+        }
+    }
+
+    Ok(AsepriteMetadata {
+        width,
+        height,
+        num_frames,
+        pixel_format,
+        layers: LayersData::from_vec(parse_info.layers)?,
+        frame_times: parse_info.frame_times,
+        tags: parse_info.tags.unwrap_or_default(),
+        sprite_user_data: parse_info.sprite_user_data,
+        slices: parse_info.slices,
+    })
+}
+
+fn parse_header<R: Read>(input: &mut AseReader<R>) -> Result<FileHeader> {
+    // Read the fixed-size header at once and decode it from memory.
+    let mut header = [0_u8; FILE_HEADER_SIZE];
+    input.read_exact(&mut header)?;
+    let mut reader = AseReader::new(&header);
+
     let _size = reader.dword()?;
     let magic_number = reader.word()?;
     if magic_number != 0xA5E0 {
@@ -220,50 +490,31 @@ pub fn read_aseprite<R: Read>(input: R) -> Result<AsepriteFile> {
         ));
     }
 
-    let mut parse_info = ParseInfo::new(num_frames, default_frame_time);
-
     let pixel_format = parse_pixel_format(color_depth, transparent_color_index)?;
 
-    for frame_id in 0..num_frames {
-        // println!("--- Frame {} -------", frame_id);
-        parse_frame(&mut reader, frame_id, pixel_format, &mut parse_info)?;
-    }
-
-    let ValidatedParseInfo {
-        layers,
-        tilesets,
-        framedata,
-        external_files,
-        palette,
-        tags,
-        frame_times,
-        sprite_user_data,
-        slices,
-    } = parse_info.validate(&pixel_format)?;
-
-    Ok(AsepriteFile {
+    Ok(FileHeader {
+        num_frames,
         width,
         height,
-        num_frames,
         pixel_format,
-        palette,
-        layers,
-        frame_times,
-        tags,
-        framedata,
-        external_files,
-        tilesets,
-        sprite_user_data,
-        slices,
+        default_frame_time,
     })
 }
 
-fn parse_frame<R: Read>(
-    reader: &mut AseReader<R>,
+struct FrameHeader {
+    num_chunks: u32,
+    bytes_available: i64,
+}
+
+fn parse_frame_header<R: Read>(
+    input: &mut AseReader<R>,
     frame_id: u16,
-    pixel_format: PixelFormat,
     parse_info: &mut ParseInfo,
-) -> Result<()> {
+) -> Result<FrameHeader> {
+    let mut header = [0_u8; FRAME_HEADER_SIZE as usize];
+    input.read_exact(&mut header)?;
+    let mut reader = AseReader::new(&header);
+
     let num_bytes = reader.dword()?;
     let magic_number = reader.word()?;
     if magic_number != 0xF1FA {
@@ -285,66 +536,204 @@ fn parse_frame<R: Read>(
         new_num_chunks
     };
 
-    let bytes_available = num_bytes as i64 - FRAME_HEADER_SIZE;
+    Ok(FrameHeader {
+        num_chunks,
+        bytes_available: num_bytes as i64 - FRAME_HEADER_SIZE,
+    })
+}
 
-    let chunks = Chunk::read_all(num_chunks, bytes_available, reader)?;
+// Reads and parses the chunks of a frame of a stream.
+fn parse_frame<R: Read>(
+    reader: &mut AseReader<R>,
+    frame_id: u16,
+    pixel_format: PixelFormat,
+    parse_info: &mut ParseInfo,
+) -> Result<()> {
+    let chunks = read_frame_chunks(reader, frame_id, parse_info)?;
+    parse_chunks(&chunks, frame_id, pixel_format, &STREAM_OPTIONS, parse_info)
+}
 
-    for chunk in chunks {
-        let Chunk { chunk_type, data } = chunk;
-        match chunk_type {
-            ChunkType::ColorProfile => {
-                let profile = color_profile::parse_chunk(&data)?;
-                parse_info.color_profile = Some(profile);
-            }
-            ChunkType::Palette => {
-                let palette = palette::parse_chunk(&data)?;
-                parse_info.palette = Some(Arc::new(palette));
-            }
-            ChunkType::Layer => {
-                let layer_data = layer::parse_chunk(&data)?;
-                parse_info.add_layer(layer_data);
-            }
-            ChunkType::Cel => {
-                let cel = cel::parse_chunk(&data, pixel_format)?;
-                parse_info.add_cel(frame_id, cel)?;
-            }
-            ChunkType::ExternalFiles => {
-                let files = ExternalFile::parse_chunk(&data)?;
-                parse_info.add_external_files(files);
-            }
-            ChunkType::Tags => {
-                let tags = tags::parse_chunk(&data)?;
-                if frame_id == 0 {
-                    parse_info.add_tags(tags);
-                } else {
-                    debug!("Ignoring tags outside of frame 0");
-                }
-            }
-            ChunkType::Slice => {
-                let slice = slice::parse_chunk(&data)?;
-                parse_info.add_slice(slice);
-                //println!("Slice: {:#?}", slice);
-            }
-            ChunkType::UserData => {
-                let user_data = user_data::parse_userdata_chunk(&data)?;
-                parse_info.add_user_data(user_data)?;
-                //println!("Userdata: {:#?}", ud);
-            }
-            ChunkType::OldPalette04 | ChunkType::OldPalette11 => {
-                // An old palette chunk precedes the sprite UserData chunk.
-                // Update the chunk context to reflect the OldPalette chunk.
-                parse_info.user_data_context = Some(UserDataContext::OldPalette);
+fn read_frame_chunks<R: Read>(
+    reader: &mut AseReader<R>,
+    frame_id: u16,
+    parse_info: &mut ParseInfo,
+) -> Result<Vec<Chunk<'static>>> {
+    let FrameHeader {
+        num_chunks,
+        bytes_available,
+    } = parse_frame_header(reader, frame_id, parse_info)?;
+
+    timed!(read, Chunk::read_all(num_chunks, bytes_available, reader))
+}
+
+// Like `read_frame_chunks` but borrows the chunk data from the input.
+fn read_frame_chunks_slice<'a>(
+    reader: &mut SliceReader<'a>,
+    frame_id: u16,
+    parse_info: &mut ParseInfo,
+) -> Result<Vec<Chunk<'a>>> {
+    let FrameHeader {
+        num_chunks,
+        mut bytes_available,
+    } = parse_frame_header(reader, frame_id, parse_info)?;
+
+    let mut chunks = Vec::with_capacity(num_chunks as usize);
+    for _idx in 0..num_chunks {
+        let (chunk_type, data_size) = Chunk::read_header(&mut bytes_available, reader)?;
+        let data = reader.slice(data_size)?;
+        chunks.push(Chunk {
+            chunk_type,
+            data: Cow::Borrowed(data),
+        });
+    }
+    Ok(chunks)
+}
 
-                // parse_info.sprite_user_data = &data.user_data;
+fn parse_chunks(
+    chunks: &[Chunk],
+    frame_id: u16,
+    pixel_format: PixelFormat,
+    options: &LoadOptions,
+    parse_info: &mut ParseInfo,
+) -> Result<()> {
+    for Chunk { chunk_type, data } in chunks {
+        parse_chunk(
+            *chunk_type,
+            data,
+            frame_id,
+            pixel_format,
+            options,
+            parse_info,
+        )?;
+    }
+    Ok(())
+}
+
+// Parses the chunks of all frames, with the cels and tilesets parsed (and
+// thus decompressed) on all available cores first. The results are then
+// added in file order, so errors are reported as in `parse_chunks`.
+fn parse_frames_parallel(
+    frames: &[Vec<Chunk>],
+    pixel_format: PixelFormat,
+    options: &LoadOptions,
+    parse_info: &mut ParseInfo,
+) -> Result<()> {
+    let pixel_chunks = frames.iter().flatten().filter(|chunk| chunk.has_pixels());
+    let mut parsed: Vec<Option<Result<PixelChunk>>> = pixel_chunks.clone().map(|_| None).collect();
+    let jobs = pixel_chunks.zip(parsed.iter_mut()).collect();
+    parallel::for_each(jobs, |(chunk, result)| {
+        *result = Some(PixelChunk::parse(chunk, pixel_format, options));
+    });
+
+    let mut parsed = parsed
+        .into_iter()
+        .map(|result| result.expect("Every chunk is parsed"));
+    for (frame_id, chunks) in frames.iter().enumerate() {
+        let frame_id = frame_id as u16;
+        for chunk in chunks {
+            if chunk.has_pixels() {
+                let pixel_chunk = parsed.next().expect("Every chunk is parsed")?;
+                parse_info.add_pixel_chunk(frame_id, pixel_chunk)?;
+            } else {
+                let Chunk { chunk_type, data } = chunk;
+                parse_chunk(
+                    *chunk_type,
+                    data,
+                    frame_id,
+                    pixel_format,
+                    options,
+                    parse_info,
+                )?;
             }
+        }
+    }
+    Ok(())
+}
+
+// A parsed chunk that holds pixels. These are parsed independently of all
+// other chunks, see `parse_frames_parallel`.
+enum PixelChunk {
+    Cel(cel::RawCel<RawPixels>),
+    Tileset(Box<Tileset<RawPixels>>),
+}
+
+impl PixelChunk {
+    fn parse(chunk: &Chunk, pixel_format: PixelFormat, options: &LoadOptions) -> Result<Self> {
+        match chunk.chunk_type {
+            ChunkType::Cel => cel::parse_chunk(&chunk.data, pixel_format, options).map(Self::Cel),
             ChunkType::Tileset => {
-                let tileset = Tileset::<RawPixels>::parse_chunk(&data, pixel_format)?;
-                parse_info.tilesets.add(tileset);
+                Tileset::<RawPixels>::parse_chunk(&chunk.data, pixel_format, options)
+                    .map(|tileset| Self::Tileset(Box::new(tileset)))
             }
-            ChunkType::CelExtra | ChunkType::Mask | ChunkType::Path => {
-                debug!("Ignoring unsupported chunk type: {:?}", chunk_type);
+            _ => Err(AsepriteParseError::InternalError(format!(
+                "Chunk type {:?} holds no pixels",
+                chunk.chunk_type
+            ))),
+        }
+    }
+}
+
+fn parse_chunk(
+    chunk_type: ChunkType,
+    data: &[u8],
+    frame_id: u16,
+    pixel_format: PixelFormat,
+    options: &LoadOptions,
+    parse_info: &mut ParseInfo,
+) -> Result<()> {
+    match chunk_type {
+        ChunkType::ColorProfile => {
+            let profile = color_profile::parse_chunk(data)?;
+            parse_info.color_profile = Some(profile);
+        }
+        ChunkType::Palette => {
+            let palette = palette::parse_chunk(data)?;
+            parse_info.palette = Some(Arc::new(palette));
+        }
+        ChunkType::Layer => {
+            let layer_data = layer::parse_chunk(data)?;
+            parse_info.add_layer(layer_data);
+        }
+        ChunkType::Cel => {
+            let cel = cel::parse_chunk(data, pixel_format, options)?;
+            parse_info.add_cel(frame_id, cel)?;
+        }
+        ChunkType::ExternalFiles => {
+            let files = ExternalFile::parse_chunk(data)?;
+            parse_info.add_external_files(files);
+        }
+        ChunkType::Tags => {
+            let tags = tags::parse_chunk(data)?;
+            if frame_id == 0 {
+                parse_info.add_tags(tags);
+            } else {
+                debug!("Ignoring tags outside of frame 0");
             }
         }
+        ChunkType::Slice => {
+            let slice = slice::parse_chunk(data)?;
+            parse_info.add_slice(slice);
+            //println!("Slice: {:#?}", slice);
+        }
+        ChunkType::UserData => {
+            let user_data = user_data::parse_userdata_chunk(data)?;
+            parse_info.add_user_data(user_data)?;
+            //println!("Userdata: {:#?}", ud);
+        }
+        ChunkType::OldPalette04 | ChunkType::OldPalette11 => {
+            // An old palette chunk precedes the sprite UserData chunk.
+            // Update the chunk context to reflect the OldPalette chunk.
+            parse_info.user_data_context = Some(UserDataContext::OldPalette);
+
+            // parse_info.sprite_user_data = &data.user_data;
+        }
+        ChunkType::Tileset => {
+            let tileset = Tileset::<RawPixels>::parse_chunk(data, pixel_format, options)?;
+            parse_info.tilesets.add(tileset);
+        }
+        ChunkType::CelExtra | ChunkType::Mask | ChunkType::Path => {
+            debug!("Ignoring unsupported chunk type: {:?}", chunk_type);
+        }
     }
 
     Ok(())
@@ -353,13 +742,15 @@ fn parse_frame<R: Read>(
 #[derive(Clone, Copy)]
 enum UserDataContext {
     CelId(CelId),
+    // User data for something we don't keep (e.g., a skipped cel).
+    Ignored,
     LayerIndex(u32),
     OldPalette,
     TagIndex(u16),
     SliceIndex(u32),
 }
 
-#[derive(Debug, Clone, PartialEq)]
+#[derive(Debug, Clone, Copy, PartialEq)]
 enum ChunkType {
     OldPalette04, // deprecated
     OldPalette11, // deprecated
@@ -377,6 +768,25 @@ enum ChunkType {
     Tileset,
 }
 
+// Names of the chunk types, in the order they are declared in `ChunkType`.
+#[cfg(feature = "stats")]
+pub(crate) const CHUNK_TYPE_NAMES: [&str; 14] = [
+    "OldPalette04",
+    "OldPalette11",
+    "Palette",
+    "Layer",
+    "Cel",
+    "CelExtra",
+    "ColorProfile",
+    "Mask",
+    "Path",
+    "Tags",
+    "UserData",
+    "Slice",
+    "ExternalFiles",
+    "Tileset",
+];
+
 fn parse_chunk_type(chunk_type: u16) -> Result<ChunkType> {
     match chunk_type {
         0x0004 => Ok(ChunkType::OldPalette04),
@@ -400,27 +810,52 @@ fn parse_chunk_type(chunk_type: u16) -> Result<ChunkType> {
     }
 }
 
+const FILE_HEADER_SIZE: usize = 128;
 const CHUNK_HEADER_SIZE: usize = 6;
 const FRAME_HEADER_SIZE: i64 = 16;
 
-struct Chunk {
+// The data of chunks read from a slice is borrowed from it.
+struct Chunk<'a> {
     chunk_type: ChunkType,
-    data: Vec<u8>,
+    data: Cow<'a, [u8]>,
 }
 
-impl Chunk {
-    fn read<R: Read>(bytes_available: &mut i64, reader: &mut AseReader<R>) -> Result<Self> {
+impl Chunk<'_> {
+    fn has_pixels(&self) -> bool {
+        matches!(self.chunk_type, ChunkType::Cel | ChunkType::Tileset)
+    }
+}
+
+impl Chunk<'static> {
+    // Reads the chunk header. Returns the chunk type and the size of the
+    // chunk data following the header.
+    fn read_header<R: Read>(
+        bytes_available: &mut i64,
+        input: &mut AseReader<R>,
+    ) -> Result<(ChunkType, usize)> {
+        let mut header = [0_u8; CHUNK_HEADER_SIZE];
+        input.read_exact(&mut header)?;
+        let mut reader = AseReader::new(&header);
+
         let chunk_size = reader.dword()?;
         let chunk_type_code = reader.word()?;
         let chunk_type = parse_chunk_type(chunk_type_code)?;
+        count!(chunks[chunk_type as usize], 1);
 
         check_chunk_bytes(chunk_size, *bytes_available)?;
 
-        let chunk_data_bytes = chunk_size as usize - CHUNK_HEADER_SIZE;
+        *bytes_available -= chunk_size as i64;
+        Ok((chunk_type, chunk_size as usize - CHUNK_HEADER_SIZE))
+    }
+
+    fn read<R: Read>(bytes_available: &mut i64, reader: &mut AseReader<R>) -> Result<Self> {
+        let (chunk_type, chunk_data_bytes) = Self::read_header(bytes_available, reader)?;
         let mut data = vec![0_u8; chunk_data_bytes];
         reader.read_exact(&mut data)?;
-        *bytes_available -= chunk_size as i64;
-        Ok(Chunk { chunk_type, data })
+        Ok(Chunk {
+            chunk_type,
+            data: Cow::Owned(data),
+        })
     }
     fn read_all<R: Read>(
         count: u32,
@@ -1,7 +1,17 @@
 use image::{Pixel, Rgba};
 
-use crate::{reader::AseReader, AsepriteParseError, ColorPalette, PixelFormat, Result};
-use std::{borrow::Cow, io::Read, sync::Arc};
+use crate::{
+    reader::{AseReader, SliceReader},
+    stats::timed,
+    AsepriteParseError, ColorPalette, LoadOptions, PixelFormat, Result,
+};
+use log::warn;
+use std::{
+    borrow::Cow,
+    collections::{hash_map::DefaultHasher, HashMap},
+    hash::{Hash, Hasher},
+    sync::{Arc, Mutex, OnceLock},
+};
 
 // From Aseprite file spec:
 // PIXEL: One pixel, depending on the image pixel format:
@@ -9,29 +19,72 @@ use std::{borrow::Cow, io::Read, sync::Arc};
 // Indexed: BYTE, Each pixel uses 1 byte (the index).
 // RGBA: BYTE[4], each pixel have 4 bytes in this order Red, Green, Blue, Alpha.
 
-fn read_rgba(chunk: &[u8]) -> Result<Rgba<u8>> {
-    let mut reader = AseReader::new(chunk);
-    let red = reader.byte()?;
-    let green = reader.byte()?;
-    let blue = reader.byte()?;
-    let alpha = reader.byte()?;
-    Ok(Rgba::from_channels(red, green, blue, alpha))
+/// Pixel types that consist of nothing but `u8` channels in file order, so
+/// any byte sequence of the right length is a valid sequence of them.
+///
+/// # Safety
+///
+/// Implementors must have an alignment of 1 and no padding.
+unsafe trait BytePixel: Copy {}
+
+// `Rgba<u8>` is a `#[repr(C)]` wrapper around `[u8; 4]`.
+unsafe impl BytePixel for Rgba<u8> {}
+unsafe impl BytePixel for Grayscale {}
+
+// The bytes of a slice of pixels.
+fn pixel_bytes<T: BytePixel>(pixels: &[T]) -> &[u8] {
+    // SAFETY: `T` consists of `size_of::<T>()` initialized `u8`s without
+    // padding, and `u8` has no alignment requirement.
+    unsafe {
+        std::slice::from_raw_parts(pixels.as_ptr() as *const u8, std::mem::size_of_val(pixels))
+    }
 }
 
+// Reinterprets decoded bytes as pixels. Reuses the buffer if the input is
+// owned and its capacity is a whole number of pixels, otherwise copies it
+// once. `bytes.len()` must be a multiple of the pixel size.
+fn cast_pixels<T: BytePixel>(bytes: Cow<[u8]>) -> Vec<T> {
+    let size = std::mem::size_of::<T>();
+    debug_assert_eq!(std::mem::align_of::<T>(), 1);
+    debug_assert_eq!(bytes.len() % size, 0);
+    let len = bytes.len() / size;
+    match bytes {
+        Cow::Owned(bytes) if bytes.capacity() % size == 0 => {
+            let mut bytes = std::mem::ManuallyDrop::new(bytes);
+            // SAFETY: `T` is `size` bytes with alignment 1 and any bit pattern
+            // is valid. Length and capacity are whole multiples of `size`, so
+            // the allocation has exactly the layout of a `Vec<T>` with
+            // capacity `capacity / size`.
+            unsafe {
+                Vec::from_raw_parts(bytes.as_mut_ptr() as *mut T, len, bytes.capacity() / size)
+            }
+        }
+        bytes => {
+            let mut pixels = Vec::<T>::with_capacity(len);
+            // SAFETY: As above, copying `len * size` bytes initializes
+            // exactly `len` pixels.
+            unsafe {
+                std::ptr::copy_nonoverlapping(
+                    bytes.as_ptr(),
+                    pixels.as_mut_ptr() as *mut u8,
+                    len * size,
+                );
+                pixels.set_len(len);
+            }
+            pixels
+        }
+    }
+}
+
+// Same layout as the two bytes that store a grayscale pixel in the file.
 #[derive(Debug, Clone, Copy)]
+#[repr(C)]
 pub struct Grayscale {
     value: u8,
     alpha: u8,
 }
 
 impl Grayscale {
-    fn new(chunk: &[u8]) -> Result<Self> {
-        let mut reader = AseReader::new(chunk);
-        let value = reader.byte()?;
-        let alpha = reader.byte()?;
-        Ok(Self { value, alpha })
-    }
-
     pub(crate) fn into_rgba(self) -> Rgba<u8> {
         let Self { value, alpha } = self;
         Rgba::from_channels(value, value, value, alpha)
@@ -53,13 +106,11 @@ impl Indexed {
         layer_is_background: bool,
     ) -> Option<Rgba<u8>> {
         let index = self.0;
-        palette.color(index as u32).map(|c| {
-            let alpha = if transparent_color_index == index && !layer_is_background {
-                0
-            } else {
-                c.alpha()
-            };
-            Rgba::from_channels(c.red(), c.green(), c.blue(), alpha)
+        palette.rgba(index).map(|mut c| {
+            if transparent_color_index == index && !layer_is_background {
+                c[3] = 0;
+            }
+            c
         })
     }
 }
@@ -78,6 +129,12 @@ pub enum Pixels {
         layer_is_background: bool,
         data: Vec<u8>,
     },
+    // Compressed pixels that are only decoded when first needed. See
+    // `LoadOptions::lazy_cels`.
+    Lazy(Box<LazyPixels>),
+    // Decoded pixels that are stored only once for all identical cels. See
+    // `LoadOptions::share_identical_cels`.
+    Shared(Arc<Pixels>),
 }
 
 #[derive(Debug)]
@@ -85,16 +142,25 @@ pub(crate) enum RawPixels {
     Rgba(Vec<Rgba<u8>>),
     Grayscale(Vec<Grayscale>),
     Indexed(Vec<u8>),
+    // Zlib-compressed pixel data of a lazily loaded image. Eagerly loaded
+    // images are decompressed straight from the chunk data instead.
+    Compressed { data: Vec<u8>, pixel_count: usize },
 }
 
 impl RawPixels {}
 
 impl RawPixels {
-    fn from_bytes(bytes: Vec<u8>, pixel_format: PixelFormat) -> Result<Self> {
+    // Takes a `Cow` so that borrowed input is only copied where the result
+    // needs its own buffer anyway. Owned input is reused as is.
+    fn from_bytes(bytes: Cow<[u8]>, pixel_format: PixelFormat) -> Result<Self> {
+        timed!(convert, Self::convert_bytes(bytes, pixel_format))
+    }
+
+    fn convert_bytes(bytes: Cow<[u8]>, pixel_format: PixelFormat) -> Result<Self> {
         match pixel_format {
             PixelFormat::Indexed { .. } => {
                 //let pixels = bytes.iter().map(|byte| Indexed(*byte)).collect();
-                Ok(Self::Indexed(bytes))
+                Ok(Self::Indexed(bytes.into_owned()))
             }
             PixelFormat::Grayscale => {
                 if bytes.len() % 2 != 0 {
@@ -102,8 +168,7 @@ impl RawPixels {
                         "Incorrect length of bytes for Grayscale image data".to_string(),
                     ));
                 }
-                let pixels: Result<Vec<_>> = bytes.chunks_exact(2).map(Grayscale::new).collect();
-                pixels.map(Self::Grayscale)
+                Ok(Self::Grayscale(cast_pixels(bytes)))
             }
             PixelFormat::Rgba => {
                 if bytes.len() % 4 != 0 {
@@ -111,32 +176,45 @@ impl RawPixels {
                         "Incorrect length of bytes for RGBA image data".to_string(),
                     ));
                 }
-                let pixels: Result<Vec<_>> = bytes.chunks_exact(4).map(read_rgba).collect();
-                pixels.map(Self::Rgba)
+                Ok(Self::Rgba(cast_pixels(bytes)))
             }
         }
     }
 
-    pub(crate) fn from_raw<T: Read>(
-        reader: AseReader<T>,
+    pub(crate) fn from_raw(
+        mut reader: SliceReader,
         pixel_format: PixelFormat,
         expected_pixel_count: usize,
     ) -> Result<Self> {
         let expected_output_size = output_size(pixel_format, expected_pixel_count);
         reader
-            .take_bytes(expected_output_size)
-            .and_then(|bytes| Self::from_bytes(bytes, pixel_format))
+            .slice(expected_output_size)
+            .and_then(|bytes| Self::from_bytes(Cow::Borrowed(bytes), pixel_format))
     }
 
-    pub(crate) fn from_compressed<T: Read>(
-        reader: AseReader<T>,
+    // Only lazily loaded pixels outlive the chunk they were read from, so only
+    // they are copied. All others are decompressed from the chunk right away.
+    pub(crate) fn from_compressed(
+        reader: SliceReader,
         pixel_format: PixelFormat,
         expected_pixel_count: usize,
+        options: &LoadOptions,
     ) -> Result<Self> {
-        let expected_output_size = output_size(pixel_format, expected_pixel_count);
-        reader
+        if options.lazy_cels {
+            Ok(Self::Compressed {
+                data: reader.rest().to_vec(),
+                pixel_count: expected_pixel_count,
+            })
+        } else {
+            Self::decompress(reader.rest(), pixel_format, expected_pixel_count)
+        }
+    }
+
+    fn decompress(data: &[u8], pixel_format: PixelFormat, pixel_count: usize) -> Result<Self> {
+        let expected_output_size = output_size(pixel_format, pixel_count);
+        AseReader::new(data)
             .unzip(expected_output_size)
-            .and_then(|bytes| Self::from_bytes(bytes, pixel_format))
+            .and_then(|bytes| Self::from_bytes(Cow::Owned(bytes), pixel_format))
     }
 
     // pub(crate) fn byte_count(&self) -> usize {
@@ -154,6 +232,14 @@ impl RawPixels {
         layer_is_background: bool,
     ) -> Result<Pixels> {
         match self {
+            RawPixels::Compressed { data, pixel_count } => Ok(Pixels::Lazy(Box::new(LazyPixels {
+                compressed: data,
+                pixel_count,
+                pixel_format: *pixel_format,
+                palette,
+                layer_is_background,
+                decoded: OnceLock::new(),
+            }))),
             RawPixels::Rgba(data) => Ok(Pixels::Rgba(data)),
             RawPixels::Grayscale(data) => Ok(Pixels::Grayscale(data)),
             RawPixels::Indexed(data) => {
@@ -185,7 +271,222 @@ impl RawPixels {
     }
 }
 
+#[derive(Debug)]
+pub struct LazyPixels {
+    compressed: Vec<u8>,
+    pixel_count: usize,
+    pixel_format: PixelFormat,
+    palette: Option<Arc<ColorPalette>>,
+    layer_is_background: bool,
+    // `None` if the compressed data turned out to be invalid.
+    decoded: OnceLock<Option<Pixels>>,
+}
+
+impl LazyPixels {
+    // Decodes and validates the pixels on first use.
+    fn get(&self) -> Option<&Pixels> {
+        self.decoded
+            .get_or_init(|| {
+                RawPixels::decompress(&self.compressed, self.pixel_format, self.pixel_count)
+                    .and_then(|raw| {
+                        raw.validate(
+                            self.palette.clone(),
+                            &self.pixel_format,
+                            self.layer_is_background,
+                        )
+                    })
+                    .map_err(|err| warn!("Could not decode lazily loaded pixels: {}", err))
+                    .ok()
+            })
+            .as_ref()
+    }
+}
+
+/// The RGBA lookup table of the most recently rendered indexed image. Most
+/// files use a single palette and transparent color, so the table rarely
+/// needs to be rebuilt.
+#[derive(Debug)]
+pub(crate) struct PaletteLut {
+    // Holding on to the palette guarantees that `Arc::ptr_eq` cannot match a
+    // different palette that happens to reuse the same allocation.
+    key: Option<(Arc<ColorPalette>, u8, bool)>,
+    table: [Rgba<u8>; 256],
+}
+
+impl Default for PaletteLut {
+    fn default() -> Self {
+        Self {
+            key: None,
+            table: [Rgba([0, 0, 0, 0]); 256],
+        }
+    }
+}
+
+impl PaletteLut {
+    // Colors for every index, with the transparent color already applied.
+    fn get(
+        &mut self,
+        palette: &Arc<ColorPalette>,
+        transparent_color_index: u8,
+        layer_is_background: bool,
+    ) -> &[Rgba<u8>; 256] {
+        let is_cached = matches!(&self.key, Some((cached, index, background))
+            if Arc::ptr_eq(cached, palette)
+                && *index == transparent_color_index
+                && *background == layer_is_background);
+        if !is_cached {
+            self.table = *palette.rgba_table();
+            if !layer_is_background {
+                self.table[transparent_color_index as usize][3] = 0;
+            }
+            self.key = Some((
+                palette.clone(),
+                transparent_color_index,
+                layer_is_background,
+            ));
+        }
+        &self.table
+    }
+}
+
+/// A borrowed view of [Pixels] that resolves them to RGBA on the fly.
+///
+/// Unlike [Pixels::clone_as_image_rgba] this never converts the whole image.
+/// Callers ask for one row at a time and pass a scratch buffer that can be
+/// reused across rows.
+pub(crate) enum RgbaPixels<'a> {
+    Rgba(&'a [Rgba<u8>]),
+    Grayscale(&'a [Grayscale]),
+    Indexed {
+        lut: &'a [Rgba<u8>; 256],
+        data: &'a [u8],
+    },
+}
+
+impl<'a> RgbaPixels<'a> {
+    /// Returns the `len` pixels starting at pixel index `start`. RGBA pixels
+    /// are borrowed directly, all other formats are converted into `scratch`.
+    pub(crate) fn row<'s>(
+        &'s self,
+        start: usize,
+        len: usize,
+        scratch: &'s mut Vec<Rgba<u8>>,
+    ) -> &'s [Rgba<u8>] {
+        match self {
+            RgbaPixels::Rgba(pixels) => &pixels[start..start + len],
+            RgbaPixels::Grayscale(pixels) => {
+                scratch.clear();
+                scratch.extend(pixels[start..start + len].iter().map(|gs| gs.into_rgba()));
+                scratch
+            }
+            RgbaPixels::Indexed { lut, data } => {
+                scratch.clear();
+                scratch.extend(data[start..start + len].iter().map(|&i| lut[i as usize]));
+                scratch
+            }
+        }
+    }
+
+    /// Like `row`, but returns `count` pixels that are `step` pixels apart,
+    /// starting at pixel index `start`. Always copies them into `scratch`.
+    pub(crate) fn sampled_row<'s>(
+        &self,
+        start: usize,
+        count: usize,
+        step: usize,
+        scratch: &'s mut Vec<Rgba<u8>>,
+    ) -> &'s [Rgba<u8>] {
+        let end = start + (count - 1) * step + 1;
+        scratch.clear();
+        match self {
+            RgbaPixels::Rgba(pixels) => {
+                scratch.extend(pixels[start..end].iter().step_by(step));
+            }
+            RgbaPixels::Grayscale(pixels) => {
+                scratch.extend(
+                    pixels[start..end]
+                        .iter()
+                        .step_by(step)
+                        .map(|gs| gs.into_rgba()),
+                );
+            }
+            RgbaPixels::Indexed { lut, data } => {
+                scratch.extend(
+                    data[start..end]
+                        .iter()
+                        .step_by(step)
+                        .map(|&i| lut[i as usize]),
+                );
+            }
+        }
+        scratch
+    }
+}
+
 impl Pixels {
+    // Frees the decoded copy of lazily loaded pixels. They are decoded again
+    // the next time they are needed.
+    pub(crate) fn release_decoded(&mut self) {
+        if let Pixels::Lazy(lazy) = self {
+            lazy.decoded.take();
+        }
+    }
+
+    /// Borrows the pixels for compositing. For indexed pixels this resolves
+    /// the palette lookup table via `lut`, so it should be called once per
+    /// image, not per row.
+    ///
+    /// Returns `None` if lazily loaded pixels could not be decoded.
+    pub(crate) fn as_rgba_pixels<'a>(&'a self, lut: &'a mut PaletteLut) -> Option<RgbaPixels<'a>> {
+        let pixels = match self {
+            Pixels::Rgba(rgba) => RgbaPixels::Rgba(rgba),
+            Pixels::Grayscale(grayscale) => RgbaPixels::Grayscale(grayscale),
+            Pixels::Indexed {
+                palette,
+                transparent_color_index,
+                layer_is_background,
+                data,
+            } => RgbaPixels::Indexed {
+                lut: lut.get(palette, *transparent_color_index, *layer_is_background),
+                data,
+            },
+            Pixels::Lazy(lazy) => return lazy.get()?.as_rgba_pixels(lut),
+            Pixels::Shared(shared) => return shared.as_rgba_pixels(lut),
+        };
+        Some(pixels)
+    }
+
+    // The palette indices of indexed pixels, along with the index that does
+    // not cover what is below it (if any). That is the transparent color,
+    // unless this is a background layer where the transparent color is drawn
+    // like any other, provided its palette entry is opaque.
+    //
+    // Returns `None` for other pixel formats or if lazily loaded pixels could
+    // not be decoded.
+    #[cfg(feature = "utils")]
+    pub(crate) fn as_indices(&self) -> Option<(&[u8], Option<u8>)> {
+        match self {
+            Pixels::Indexed {
+                palette,
+                transparent_color_index,
+                layer_is_background,
+                data,
+            } => {
+                let index = *transparent_color_index;
+                let is_opaque = palette.rgba(index).is_some_and(|c| c[3] == 255);
+                let skipped = if *layer_is_background && is_opaque {
+                    None
+                } else {
+                    Some(index)
+                };
+                Some((data, skipped))
+            }
+            Pixels::Lazy(lazy) => lazy.get()?.as_indices(),
+            Pixels::Shared(shared) => shared.as_indices(),
+            _ => None,
+        }
+    }
+
     // Returns a Borrowed Cow if the Pixels struct already contains Rgba pixels.
     // Otherwise clones them to create an Owned Cow.
     pub(crate) fn clone_as_image_rgba(&self) -> Cow<Vec<image::Rgba<u8>>> {
@@ -210,6 +511,123 @@ impl Pixels {
                 };
                 Cow::Owned(data.iter().map(|p| resolver(&Indexed(*p))).collect())
             }
+            Pixels::Lazy(lazy) => match lazy.get() {
+                Some(pixels) => pixels.clone_as_image_rgba(),
+                None => Cow::Owned(vec![Rgba([0, 0, 0, 0]); lazy.pixel_count]),
+            },
+            Pixels::Shared(shared) => shared.clone_as_image_rgba(),
+        }
+    }
+
+    // The decoded pixels, looking through lazily loaded and shared pixels.
+    // `None` if lazily loaded pixels could not be decoded.
+    fn decoded(&self) -> Option<&Pixels> {
+        match self {
+            Pixels::Lazy(lazy) => lazy.get()?.decoded(),
+            Pixels::Shared(shared) => shared.decoded(),
+            pixels => Some(pixels),
+        }
+    }
+
+    // A hash of the decoded pixels. For indexed pixels this includes
+    // everything that affects their colors. `None` if lazily loaded pixels
+    // could not be decoded.
+    pub(crate) fn content_hash(&self) -> Option<u64> {
+        let mut hasher = DefaultHasher::new();
+        match self.decoded()? {
+            Pixels::Rgba(rgba) => {
+                0_u8.hash(&mut hasher);
+                hasher.write(pixel_bytes(rgba));
+            }
+            Pixels::Grayscale(grayscale) => {
+                1_u8.hash(&mut hasher);
+                hasher.write(pixel_bytes(grayscale));
+            }
+            Pixels::Indexed {
+                palette,
+                transparent_color_index,
+                layer_is_background,
+                data,
+            } => {
+                2_u8.hash(&mut hasher);
+                hasher.write(pixel_bytes(&palette.rgba_table()[..]));
+                (transparent_color_index, layer_is_background).hash(&mut hasher);
+                hasher.write(data);
+            }
+            Pixels::Lazy(_) | Pixels::Shared(_) => unreachable!("Pixels are decoded"),
+        }
+        Some(hasher.finish())
+    }
+
+    // True if both decode to the same pixels with the same colors.
+    fn is_identical(&self, other: &Pixels) -> bool {
+        match (self.decoded(), other.decoded()) {
+            (Some(Pixels::Rgba(a)), Some(Pixels::Rgba(b))) => a == b,
+            (Some(Pixels::Grayscale(a)), Some(Pixels::Grayscale(b))) => {
+                pixel_bytes(a) == pixel_bytes(b)
+            }
+            (
+                Some(Pixels::Indexed {
+                    palette,
+                    transparent_color_index,
+                    layer_is_background,
+                    data,
+                }),
+                Some(Pixels::Indexed {
+                    palette: other_palette,
+                    transparent_color_index: other_transparent_color_index,
+                    layer_is_background: other_layer_is_background,
+                    data: other_data,
+                }),
+            ) => {
+                data == other_data
+                    && transparent_color_index == other_transparent_color_index
+                    && layer_is_background == other_layer_is_background
+                    && (Arc::ptr_eq(palette, other_palette) || palette == other_palette)
+            }
+            _ => false,
         }
     }
 }
+
+// Hands out one shared copy of identical decoded pixels. See
+// `LoadOptions::share_identical_cels`.
+#[derive(Default)]
+pub(crate) struct PixelPool {
+    // Pixels by their content hash.
+    pixels: Mutex<HashMap<u64, Vec<Arc<Pixels>>>>,
+}
+
+impl PixelPool {
+    // Returns pixels that share their buffer with all identical pixels passed
+    // to this pool before. Lazily loaded pixels are returned unchanged.
+    pub(crate) fn share(&self, pixels: Pixels, content_hash: u64) -> Pixels {
+        if matches!(pixels, Pixels::Lazy(_) | Pixels::Shared(_)) {
+            return pixels;
+        }
+        let mut pool = self.pixels.lock().expect("Pixel pool poisoned");
+        let bucket = pool.entry(content_hash).or_default();
+        match bucket.iter().find(|shared| shared.is_identical(&pixels)) {
+            Some(shared) => Pixels::Shared(shared.clone()),
+            None => {
+                let shared = Arc::new(pixels);
+                bucket.push(shared.clone());
+                Pixels::Shared(shared)
+            }
+        }
+    }
+}
+
+#[test]
+fn test_cast_pixels() {
+    let bytes = vec![1_u8, 2, 3, 4, 5, 6, 7, 8];
+    let ptr = bytes.as_ptr();
+    let pixels: Vec<Rgba<u8>> = cast_pixels(Cow::Owned(bytes));
+    assert_eq!(pixels, [Rgba([1, 2, 3, 4]), Rgba([5, 6, 7, 8])]);
+    // The buffer was reused.
+    assert_eq!(pixels.as_ptr() as *const u8, ptr);
+
+    let bytes = [10_u8, 20, 30, 40];
+    let pixels: Vec<Grayscale> = cast_pixels(Cow::Borrowed(&bytes));
+    assert_eq!(pixels[1].into_rgba(), Rgba([30, 30, 30, 40]));
+}
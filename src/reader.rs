@@ -1,7 +1,10 @@
-use crate::{AsepriteParseError, Result};
+use crate::{
+    stats::{count, timed},
+    AsepriteParseError, Result,
+};
 use byteorder::{LittleEndian, ReadBytesExt};
-use flate2::read::ZlibDecoder;
-use std::io::{Cursor, Read};
+use flate2::{Decompress, FlushDecompress, Status};
+use std::io::{self, BufReader, Cursor, Read, Seek, SeekFrom};
 
 fn to_ase(e: std::io::Error) -> AsepriteParseError {
     e.into()
@@ -11,13 +14,92 @@ pub(crate) struct AseReader<T: Read> {
     input: T,
 }
 
-impl AseReader<Cursor<&[u8]>> {
-    pub(crate) fn new(data: &[u8]) -> AseReader<Cursor<&[u8]>> {
+// A reader over data that is already in memory. Can hand out borrowed
+// sub-slices instead of copying.
+pub(crate) type SliceReader<'a> = AseReader<Cursor<&'a [u8]>>;
+
+impl<'a> SliceReader<'a> {
+    pub(crate) fn new(data: &'a [u8]) -> SliceReader<'a> {
         let input = Cursor::new(data);
         AseReader { input }
     }
+
+    fn remaining(&self) -> &'a [u8] {
+        let data: &'a [u8] = self.input.get_ref();
+        let pos = (self.input.position() as usize).min(data.len());
+        &data[pos..]
+    }
+
+    // Returns the next `len` bytes without copying them.
+    pub(crate) fn slice(&mut self, len: usize) -> Result<&'a [u8]> {
+        let remaining = self.remaining();
+        if remaining.len() < len {
+            return Err(AsepriteParseError::InvalidInput(format!(
+                "Invalid data size. Expected: {}, Actual: {}",
+                len,
+                remaining.len()
+            )));
+        }
+        self.input.set_position(self.input.position() + len as u64);
+        Ok(&remaining[..len])
+    }
+
+    // Returns all remaining bytes without copying them.
+    pub(crate) fn rest(self) -> &'a [u8] {
+        self.remaining()
+    }
+
+    // Decompresses the remaining (zlib) bytes into a buffer of exactly
+    // `expected_output_size` bytes. Both sizes are known up front, so the data
+    // is decoded in a single call instead of growing the output as it goes.
+    // Fails if the data does not decompress to exactly the expected size.
+    pub(crate) fn unzip(self, expected_output_size: usize) -> Result<Vec<u8>> {
+        let input = self.rest();
+        // Don't let a few bytes of input allocate an arbitrarily large buffer.
+        if expected_output_size > input.len().saturating_mul(MAX_DEFLATE_RATIO) {
+            return Err(AsepriteParseError::InvalidInput(format!(
+                "{} bytes of compressed data cannot decompress to {} bytes",
+                input.len(),
+                expected_output_size
+            )));
+        }
+        timed!(inflate, {
+            let mut output = vec![0_u8; expected_output_size];
+            let mut decoder = Decompress::new(true);
+            let status = decoder
+                .decompress(input, &mut output, FlushDecompress::Finish)
+                .map_err(|err| {
+                    AsepriteParseError::InvalidInput(format!("Invalid compressed data: {}", err))
+                })?;
+            count!(compressed_bytes, decoder.total_in());
+            count!(decompressed_bytes, decoder.total_out());
+            let total_out = decoder.total_out() as usize;
+            if status == Status::StreamEnd && total_out == expected_output_size {
+                Ok(output)
+            } else if status == Status::StreamEnd {
+                Err(AsepriteParseError::InvalidInput(format!(
+                    "Decompressed data is too short. Expected: {} bytes, Actual: {} bytes",
+                    expected_output_size, total_out
+                )))
+            } else if total_out == expected_output_size {
+                Err(AsepriteParseError::InvalidInput(format!(
+                    "Decompressed data is longer than the expected {} bytes",
+                    expected_output_size
+                )))
+            } else {
+                Err(AsepriteParseError::InvalidInput(format!(
+                    "Compressed data is truncated. Expected: {} bytes, Decompressed: {} bytes",
+                    expected_output_size, total_out
+                )))
+            }
+        })
+    }
 }
 
+// Deflate encodes a run of at most 258 repeated bytes in no less than two
+// bits, which limits its compression ratio to 1032:1.
+const MAX_DEFLATE_RATIO: usize = 1032;
+
 impl<T: Read> AseReader<T>
 where
     T: Read,
@@ -59,28 +141,99 @@ where
     }
 
     pub(crate) fn skip_reserved(&mut self, count: usize) -> Result<()> {
-        let mut ignored = vec![0_u8; count];
-        self.input.read_exact(&mut ignored).map_err(to_ase)
+        let skipped = io::copy(&mut (&mut self.input).take(count as u64), &mut io::sink())?;
+        if skipped != count as u64 {
+            return Err(io::Error::from(io::ErrorKind::UnexpectedEof).into());
+        }
+        Ok(())
     }
+}
 
-    pub(crate) fn take_bytes(self, limit: usize) -> Result<Vec<u8>> {
-        let mut output = Vec::with_capacity(limit);
-        self.input.take(limit as u64).read_to_end(&mut output)?;
-        if output.len() != limit {
-            Err(AsepriteParseError::InvalidInput(format!(
-                "Invalid data size. Expected: {}, Actual: {}",
-                limit,
-                output.len()
-            )))
-        } else {
-            Ok(output)
-        }
+impl<T: Skip> AseReader<T> {
+    pub(crate) fn seek_forward(&mut self, count: usize) -> Result<()> {
+        self.input.skip(count as i64).map_err(to_ase)
     }
+}
 
-    pub(crate) fn unzip(self, expected_output_size: usize) -> Result<Vec<u8>> {
-        let mut decoder = ZlibDecoder::new(self.input);
-        let mut buffer = Vec::with_capacity(expected_output_size);
-        decoder.read_to_end(&mut buffer)?;
-        Ok(buffer)
+// Input that can move forward without reading the bytes in between.
+pub(crate) trait Skip: Read {
+    fn skip(&mut self, count: i64) -> io::Result<()>;
+}
+
+// `Seek::seek` on a `BufReader` always throws away the buffer, even if the
+// target is still in it. `seek_relative` only seeks the underlying reader if
+// it has to, which matters when skipping many small chunks.
+impl<R: Read + Seek> Skip for BufReader<R> {
+    fn skip(&mut self, count: i64) -> io::Result<()> {
+        self.seek_relative(count)
+    }
+}
+
+// Skips by seeking. For inputs we know nothing else about.
+pub(crate) struct Seeking<R>(pub(crate) R);
+
+impl<R: Read> Read for Seeking<R> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        self.0.read(buf)
+    }
+
+    fn read_exact(&mut self, buf: &mut [u8]) -> io::Result<()> {
+        self.0.read_exact(buf)
+    }
+}
+
+impl<R: Read + Seek> Skip for Seeking<R> {
+    fn skip(&mut self, count: i64) -> io::Result<()> {
+        self.0.seek(SeekFrom::Current(count)).map(|_| ())
     }
 }
+
+#[test]
+fn test_skip() {
+    let data: Vec<u8> = (0..32).collect();
+    let check = |reader: &mut dyn Skip| {
+        let mut byte = [0_u8];
+        // Within the buffer, past its end, and back to the start of the input.
+        for &(count, expected) in [(2, 2), (10, 13), (-14, 0)].iter() {
+            reader.skip(count).unwrap();
+            reader.read_exact(&mut byte).unwrap();
+            assert_eq!(byte[0], expected);
+        }
+    };
+    check(&mut BufReader::with_capacity(4, Cursor::new(&data)));
+    check(&mut Seeking(Cursor::new(&data)));
+}
+
+#[test]
+fn test_unzip_checks_size() {
+    use flate2::{write::ZlibEncoder, Compression};
+    use std::io::Write;
+
+    let data: Vec<u8> = (0..100_u32).map(|i| (i * 7) as u8).collect();
+    let mut encoder = ZlibEncoder::new(Vec::new(), Compression::default());
+    encoder.write_all(&data).unwrap();
+    let compressed = encoder.finish().unwrap();
+
+    let error = |input: &[u8], size| SliceReader::new(input).unzip(size).unwrap_err().to_string();
+    assert_eq!(SliceReader::new(&compressed).unzip(100).unwrap(), data);
+    assert!(error(&compressed, 99).contains("longer"));
+    assert!(error(&compressed, 101).contains("too short"));
+    assert!(error(&compressed[..20], 100).contains("truncated"));
+    assert!(error(&compressed, usize::MAX).contains("cannot decompress"));
+}
+
+#[test]
+fn test_unzip_highly_compressed() {
+    use flate2::{write::ZlibEncoder, Compression};
+    use std::io::Write;
+
+    // Close to the best ratio deflate can achieve.
+    let data = vec![0_u8; 1 << 20];
+    let mut encoder = ZlibEncoder::new(Vec::new(), Compression::best());
+    encoder.write_all(&data).unwrap();
+    let compressed = encoder.finish().unwrap();
+    assert_eq!(
+        SliceReader::new(&compressed).unzip(data.len()).unwrap(),
+        data
+    );
+}
@@ -0,0 +1,634 @@
+use image::{Rgba, RgbaImage};
+
+use crate::{
+    blend::{self, simd::RowKernel, Color8},
+    cel::{CelCommon, ImageSize},
+    pixel::{PaletteLut, RgbaPixels},
+    tilemap::TilemapData,
+    tileset::TilePixels,
+    BlendMode,
+};
+use std::ops::Range;
+
+// Compositing of cels onto an RGBA canvas.
+//
+// Cel images are blended one row at a time. The visible part of a cel is
+// computed once up front so that the inner loop only walks matching slices of
+// the source and destination rows without any per-pixel bounds checks.
+
+/// Buffers that are reused across render calls, so that rendering frame after
+/// frame does not allocate once the buffers have grown to their final size.
+///
+/// Pass the same context to repeated calls of
+/// [AsepriteFile::render_frame_into](crate::AsepriteFile::render_frame_into)
+/// or [AsepriteFile::render_frame_into_buffer](crate::AsepriteFile::render_frame_into_buffer).
+/// A context is not tied to a specific file.
+#[derive(Debug, Default)]
+pub struct RenderContext {
+    // Cel rows converted to RGBA.
+    pub(crate) scratch: Vec<Rgba<u8>>,
+    pub(crate) lut: PaletteLut,
+    // Whether to render each layer, see `RenderOptions::resolve_layers`.
+    pub(crate) layers_shown: Vec<bool>,
+}
+
+impl RenderContext {
+    /// Create a new context with empty buffers.
+    pub fn new() -> Self {
+        Self::default()
+    }
+}
+
+/// A mutable view of RGBA pixels, either a whole [RgbaImage] or a region of
+/// a larger buffer with an arbitrary row stride.
+pub(crate) struct Canvas<'a> {
+    data: &'a mut [u8],
+    width: u32,
+    height: u32,
+    // Distance between the starts of two rows in bytes.
+    stride: usize,
+    // Sprite coordinates of the canvas' top left pixel. Non-zero if only a
+    // part of the sprite is rendered.
+    origin: (i32, i32),
+    // Each canvas pixel shows the sprite pixel at the top left of a
+    // `scale` x `scale` block. 1 for rendering at full size.
+    scale: u32,
+}
+
+impl<'a> Canvas<'a> {
+    /// # Panics
+    ///
+    /// Panics if rows are shorter than `width` pixels or if `data` cannot hold
+    /// `height` rows.
+    pub(crate) fn new(data: &'a mut [u8], width: u32, height: u32, stride: usize) -> Self {
+        let row_bytes = width as usize * 4;
+        assert!(stride >= row_bytes, "Stride is smaller than a row");
+        if height > 0 {
+            let required = (height as usize - 1) * stride + row_bytes;
+            assert!(data.len() >= required, "Buffer too small for canvas");
+        }
+        Self {
+            data,
+            width,
+            height,
+            stride,
+            origin: (0, 0),
+            scale: 1,
+        }
+    }
+
+    pub(crate) fn with_scale(mut self, scale: u32) -> Self {
+        assert!(scale > 0, "Scale factor must be positive");
+        self.scale = scale;
+        self
+    }
+
+    /// Places the canvas at (`x`, `y`) in sprite coordinates.
+    pub(crate) fn with_origin(mut self, x: i32, y: i32) -> Self {
+        self.origin = (x, y);
+        self
+    }
+
+    pub(crate) fn from_image(image: &'a mut RgbaImage) -> Self {
+        let (width, height) = image.dimensions();
+        Self::new(image, width, height, width as usize * 4)
+    }
+
+    pub(crate) fn dimensions(&self) -> (u32, u32) {
+        (self.width, self.height)
+    }
+
+    // The raw bytes of `len` pixels starting at (`x`, `y`).
+    fn span_mut(&mut self, x: usize, y: usize, len: usize) -> &mut [u8] {
+        let start = y * self.stride + x * 4;
+        &mut self.data[start..start + len * 4]
+    }
+
+    /// Makes all pixels transparent black.
+    pub(crate) fn clear(&mut self) {
+        let width = self.width as usize;
+        for y in 0..self.height as usize {
+            self.span_mut(0, y, width).fill(0);
+        }
+    }
+}
+
+/// The part of a cel rectangle that lies inside the canvas.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct ClipRect {
+    /// Offset of the visible area inside the source image.
+    pub src_x: usize,
+    pub src_y: usize,
+    /// Offset of the visible area on the canvas.
+    pub dst_x: usize,
+    pub dst_y: usize,
+    /// Size of the visible area.
+    pub width: usize,
+    pub height: usize,
+}
+
+impl ClipRect {
+    /// Intersects a `width` x `height` rectangle placed at (`x`, `y`) with a
+    /// canvas of size `canvas_width` x `canvas_height`. Returns `None` if
+    /// no pixel of the rectangle is visible.
+    pub(crate) fn new(
+        x: i32,
+        y: i32,
+        width: u32,
+        height: u32,
+        canvas_width: u32,
+        canvas_height: u32,
+    ) -> Option<Self> {
+        let (src_x, dst_x, width) = clip_span(x, width, canvas_width)?;
+        let (src_y, dst_y, height) = clip_span(y, height, canvas_height)?;
+        Some(Self {
+            src_x,
+            src_y,
+            dst_x,
+            dst_y,
+            width,
+            height,
+        })
+    }
+}
+
+// Clips the 1-d span `start..start + len` to `0..limit`. Returns the offset
+// into the span, the clipped start, and the clipped length.
+fn clip_span(start: i32, len: u32, limit: u32) -> Option<(usize, usize, usize)> {
+    let start = start as i64;
+    let end = start + len as i64;
+    let clipped_start = start.max(0);
+    let clipped_end = end.min(limit as i64);
+    if clipped_start >= clipped_end {
+        return None;
+    }
+    Some((
+        (clipped_start - start) as usize,
+        clipped_start as usize,
+        (clipped_end - clipped_start) as usize,
+    ))
+}
+
+// Like `clip_span` for a canvas where pixel `i` samples position `i * scale`
+// of the span's coordinate system. Returns the offset of the first sample
+// into the span, the first canvas pixel, and the number of samples.
+fn sample_span(start: i32, len: u32, scale: u32, limit: u32) -> Option<(usize, usize, usize)> {
+    let (start, len, scale) = (start as i64, len as i64, scale as i64);
+    // Canvas pixels `i` with `0 <= i * scale - start < len`.
+    let first = (start + scale - 1).div_euclid(scale).max(0);
+    let end = (start + len - 1).div_euclid(scale).min(limit as i64 - 1) + 1;
+    if first >= end {
+        return None;
+    }
+    Some((
+        (first * scale - start) as usize,
+        first as usize,
+        (end - first) as usize,
+    ))
+}
+
+#[test]
+fn test_sample_span() {
+    for start in -20..20 {
+        for len in 0..12 {
+            assert_eq!(sample_span(start, len, 1, 10), clip_span(start, len, 10));
+        }
+    }
+    // Samples at 0, 4, 8, ... hit offsets 3 and 7 of `-3..7`.
+    assert_eq!(sample_span(-3, 10, 4, 10), Some((3, 0, 2)));
+    assert_eq!(sample_span(5, 4, 4, 10), Some((3, 2, 1)));
+    assert_eq!(sample_span(5, 3, 4, 10), None);
+    assert_eq!(sample_span(0, 100, 8, 3), Some((0, 0, 3)));
+}
+
+/// Blends `src` onto `dst`, where `dst` holds the raw RGBA bytes of exactly
+/// `src.len()` canvas pixels.
+#[inline]
+fn blend_row<F>(dst: &mut [u8], src: &[Rgba<u8>], opacity: u8, blend_fn: &F)
+where
+    F: Fn(Color8, Color8, u8) -> Color8,
+{
+    debug_assert_eq!(dst.len(), src.len() * 4);
+    for (dst, src) in dst.chunks_exact_mut(4).zip(src) {
+        let backdrop = Rgba([dst[0], dst[1], dst[2], dst[3]]);
+        let new = blend_fn(backdrop, *src, opacity);
+        dst.copy_from_slice(&new.0);
+    }
+}
+
+/// Like `blend_row`, but reuses the previous result as long as both the
+/// backdrop and the source pixel repeat.
+///
+/// Used for the HSL blend modes, which are much more expensive than the
+/// comparison. Pixel art tends to have long runs of identical pixels, so this
+/// skips most of the work for typical sprites.
+#[inline]
+fn blend_row_memoized<F>(dst: &mut [u8], src: &[Rgba<u8>], opacity: u8, blend_fn: &F)
+where
+    F: Fn(Color8, Color8, u8) -> Color8,
+{
+    debug_assert_eq!(dst.len(), src.len() * 4);
+    let mut last: Option<(Color8, Color8, Color8)> = None;
+    for (dst, src) in dst.chunks_exact_mut(4).zip(src) {
+        let backdrop = Rgba([dst[0], dst[1], dst[2], dst[3]]);
+        let new = match last {
+            Some((last_backdrop, last_src, last_new))
+                if last_backdrop == backdrop && last_src == *src =>
+            {
+                last_new
+            }
+            _ => {
+                let new = blend_fn(backdrop, *src, opacity);
+                last = Some((backdrop, *src, new));
+                new
+            }
+        };
+        dst.copy_from_slice(&new.0);
+    }
+}
+
+/// The fastest row blending function for `blend_mode`: a vectorized kernel if
+/// there is one for this blend mode and CPU, otherwise the scalar blend
+/// function applied pixel by pixel. Resolved once per cel when the file is
+/// loaded, see `DrawCel`.
+pub(crate) fn row_kernel(blend_mode: BlendMode) -> RowKernel {
+    if let Some(kernel) = blend::simd::row_kernel(blend_mode) {
+        return kernel;
+    }
+    macro_rules! kernel {
+        ($row_fn:ident, $blend_fn:path) => {
+            |dst: &mut [u8], src: &[Color8], opacity| $row_fn(dst, src, opacity, &$blend_fn)
+        };
+    }
+    match blend_mode {
+        BlendMode::Normal => kernel!(blend_row, blend::normal),
+        BlendMode::Multiply => kernel!(blend_row, blend::multiply),
+        BlendMode::Screen => kernel!(blend_row, blend::screen),
+        BlendMode::Overlay => kernel!(blend_row, blend::overlay),
+        BlendMode::Darken => kernel!(blend_row, blend::darken),
+        BlendMode::Lighten => kernel!(blend_row, blend::lighten),
+        BlendMode::ColorDodge => kernel!(blend_row, blend::color_dodge),
+        BlendMode::ColorBurn => kernel!(blend_row, blend::color_burn),
+        BlendMode::HardLight => kernel!(blend_row, blend::hard_light),
+        BlendMode::SoftLight => kernel!(blend_row, blend::soft_light),
+        BlendMode::Difference => kernel!(blend_row, blend::difference),
+        BlendMode::Exclusion => kernel!(blend_row, blend::exclusion),
+        BlendMode::Hue => kernel!(blend_row_memoized, blend::hsl_hue),
+        BlendMode::Saturation => kernel!(blend_row_memoized, blend::hsl_saturation),
+        BlendMode::Color => kernel!(blend_row_memoized, blend::hsl_color),
+        BlendMode::Luminosity => kernel!(blend_row_memoized, blend::hsl_luminosity),
+        BlendMode::Addition => kernel!(blend_row, blend::addition),
+        BlendMode::Subtract => kernel!(blend_row, blend::subtract),
+        BlendMode::Divide => kernel!(blend_row, blend::divide),
+    }
+}
+
+pub(crate) fn write_tilemap_cel_to_image(
+    canvas: &mut Canvas,
+    cel_data: &CelCommon,
+    tilemap_data: &TilemapData,
+    tiles: &TilePixels,
+    kernel: RowKernel,
+    copy_opaque: bool,
+    scratch: &mut Vec<Rgba<u8>>,
+) {
+    if canvas.scale > 1 {
+        return blend_tilemap_cel_sampled(canvas, cel_data, tilemap_data, tiles, kernel, scratch);
+    }
+    blend_tilemap_cel(canvas, cel_data, tilemap_data, tiles, copy_opaque, kernel)
+}
+
+// The range of tiles along one axis that overlap `0..limit`, for a row or
+// column of `count` tiles of size `tile_len` starting at `start`.
+fn visible_tiles(start: i32, tile_len: i32, count: i32, limit: u32) -> Range<i32> {
+    let first = (-start).div_euclid(tile_len).max(0);
+    let end = (limit as i32 - start + tile_len - 1)
+        .div_euclid(tile_len)
+        .min(count);
+    first..end.max(first)
+}
+
+fn blend_tilemap_cel<R>(
+    canvas: &mut Canvas,
+    cel_data: &CelCommon,
+    tilemap_data: &TilemapData,
+    tiles: &TilePixels,
+    copy_opaque: bool,
+    blend_row: R,
+) where
+    R: Fn(&mut [u8], &[Color8], u8),
+{
+    let CelCommon { x, y, opacity, .. } = *cel_data;
+    let cel_x = x as i32 - canvas.origin.0;
+    let cel_y = y as i32 - canvas.origin.1;
+    let tile_width = tiles.tile_size.width() as i32;
+    let tile_height = tiles.tile_size.height() as i32;
+    let (canvas_width, canvas_height) = canvas.dimensions();
+    let tiles_x = visible_tiles(cel_x, tile_width, tilemap_data.width() as i32, canvas_width);
+    let tiles_y = visible_tiles(
+        cel_y,
+        tile_height,
+        tilemap_data.height() as i32,
+        canvas_height,
+    );
+
+    for tile_y in tiles_y {
+        for tile_x in tiles_x.clone() {
+            let tile = tilemap_data
+                .tile(tile_x as u16, tile_y as u16)
+                .expect("Invalid tile index");
+            let (pixels, is_opaque) = match tiles.tile(tile) {
+                Some(tile) => tile,
+                None => continue,
+            };
+            let clip = match ClipRect::new(
+                cel_x + tile_x * tile_width,
+                cel_y + tile_y * tile_height,
+                tile_width as u32,
+                tile_height as u32,
+                canvas_width,
+                canvas_height,
+            ) {
+                Some(clip) => clip,
+                None => continue,
+            };
+            for row in 0..clip.height {
+                let src_start = (clip.src_y + row) * tile_width as usize + clip.src_x;
+                let src = &pixels[src_start..src_start + clip.width];
+                let dst = canvas.span_mut(clip.dst_x, clip.dst_y + row, clip.width);
+                if copy_opaque && is_opaque {
+                    dst.copy_from_slice(blend::simd::rgba_as_bytes(src));
+                } else {
+                    blend_row(dst, src, opacity);
+                }
+            }
+        }
+    }
+}
+
+// Like `blend_tilemap_cel` for a scaled canvas. Only the sampled pixels of
+// each row are gathered, tile by tile, and then blended at once. Pixels of
+// missing tiles are transparent, which leaves the canvas unchanged.
+fn blend_tilemap_cel_sampled<R>(
+    canvas: &mut Canvas,
+    cel_data: &CelCommon,
+    tilemap_data: &TilemapData,
+    tiles: &TilePixels,
+    blend_row: R,
+    scratch: &mut Vec<Rgba<u8>>,
+) where
+    R: Fn(&mut [u8], &[Color8], u8),
+{
+    let CelCommon { x, y, opacity, .. } = *cel_data;
+    let scale = canvas.scale as usize;
+    let tile_width = tiles.tile_size.width() as usize;
+    let tile_height = tiles.tile_size.height() as usize;
+    let (canvas_width, canvas_height) = canvas.dimensions();
+    let sample = |start: i32, tile_len: usize, count: u16, limit: u32| {
+        let len = tile_len as u32 * count as u32;
+        sample_span(start, len, scale as u32, limit)
+    };
+    let (src_x, dst_x, width) = match sample(
+        x as i32 - canvas.origin.0,
+        tile_width,
+        tilemap_data.width(),
+        canvas_width,
+    ) {
+        Some(span) => span,
+        None => return,
+    };
+    let (src_y, dst_y, height) = match sample(
+        y as i32 - canvas.origin.1,
+        tile_height,
+        tilemap_data.height(),
+        canvas_height,
+    ) {
+        Some(span) => span,
+        None => return,
+    };
+
+    for row in 0..height {
+        let cel_y = src_y + row * scale;
+        let (tile_y, pixel_y) = (cel_y / tile_height, cel_y % tile_height);
+        scratch.clear();
+        scratch.extend((0..width).map(|col| {
+            let cel_x = src_x + col * scale;
+            let (tile_x, pixel_x) = (cel_x / tile_width, cel_x % tile_width);
+            let tile = tilemap_data
+                .tile(tile_x as u16, tile_y as u16)
+                .expect("Invalid tile index");
+            match tiles.tile(tile) {
+                Some((pixels, _)) => pixels[pixel_y * tile_width + pixel_x],
+                None => Rgba([0, 0, 0, 0]),
+            }
+        }));
+        let dst = canvas.span_mut(dst_x, dst_y + row, width);
+        blend_row(dst, scratch, opacity);
+    }
+}
+
+pub(crate) fn write_raw_cel_to_image(
+    canvas: &mut Canvas,
+    cel_data: &CelCommon,
+    image_size: &ImageSize,
+    pixels: &RgbaPixels,
+    kernel: RowKernel,
+    scratch: &mut Vec<Rgba<u8>>,
+) {
+    if canvas.scale > 1 {
+        return blend_raw_cel_sampled(canvas, cel_data, image_size, pixels, kernel, scratch);
+    }
+    blend_raw_cel(canvas, cel_data, image_size, pixels, kernel, scratch)
+}
+
+// Like `blend_raw_cel` for a scaled canvas. Only the sampled rows are read,
+// and only the sampled pixels of each row are converted.
+fn blend_raw_cel_sampled<R>(
+    canvas: &mut Canvas,
+    cel_data: &CelCommon,
+    image_size: &ImageSize,
+    pixels: &RgbaPixels,
+    blend_row: R,
+    scratch: &mut Vec<Rgba<u8>>,
+) where
+    R: Fn(&mut [u8], &[Color8], u8),
+{
+    let ImageSize { width, height } = *image_size;
+    let CelCommon { x, y, opacity, .. } = *cel_data;
+    let scale = canvas.scale;
+    let (canvas_width, canvas_height) = canvas.dimensions();
+    let sample = |start, len, limit| sample_span(start, len as u32, scale, limit);
+    let (src_x, dst_x, samples_x) = match sample(x as i32 - canvas.origin.0, width, canvas_width) {
+        Some(span) => span,
+        None => return,
+    };
+    let (src_y, dst_y, samples_y) = match sample(y as i32 - canvas.origin.1, height, canvas_height)
+    {
+        Some(span) => span,
+        None => return,
+    };
+    let src_stride = width as usize;
+    let scale = scale as usize;
+
+    for row in 0..samples_y {
+        let src_start = (src_y + row * scale) * src_stride + src_x;
+        let src = pixels.sampled_row(src_start, samples_x, scale, scratch);
+        let dst = canvas.span_mut(dst_x, dst_y + row, samples_x);
+        blend_row(dst, src, opacity);
+    }
+}
+
+fn blend_raw_cel<R>(
+    canvas: &mut Canvas,
+    cel_data: &CelCommon,
+    image_size: &ImageSize,
+    pixels: &RgbaPixels,
+    blend_row: R,
+    scratch: &mut Vec<Rgba<u8>>,
+) where
+    R: Fn(&mut [u8], &[Color8], u8),
+{
+    let ImageSize { width, height } = *image_size;
+    let CelCommon { x, y, opacity, .. } = *cel_data;
+    let (canvas_width, canvas_height) = canvas.dimensions();
+    let clip = match ClipRect::new(
+        x as i32 - canvas.origin.0,
+        y as i32 - canvas.origin.1,
+        width as u32,
+        height as u32,
+        canvas_width,
+        canvas_height,
+    ) {
+        Some(clip) => clip,
+        None => return,
+    };
+    let src_stride = width as usize;
+
+    for row in 0..clip.height {
+        let src_start = (clip.src_y + row) * src_stride + clip.src_x;
+        let src = pixels.row(src_start, clip.width, scratch);
+        let dst = canvas.span_mut(clip.dst_x, clip.dst_y + row, clip.width);
+        blend_row(dst, src, opacity);
+    }
+}
+
+#[test]
+fn test_blend_row_memoized() {
+    // Rows with runs of repeated pixels, compared against the plain version.
+    let colors = [
+        Rgba([255, 0, 0, 255]),
+        Rgba([10, 200, 30, 128]),
+        Rgba([0, 0, 0, 0]),
+        Rgba([90, 90, 250, 40]),
+    ];
+    let src: Vec<Color8> = (0..64).map(|i| colors[(i / 5) % 4]).collect();
+    let back: Vec<u8> = (0..64).flat_map(|i| colors[(i / 3) % 4].0).collect();
+    for opacity in [0, 100, 255].iter() {
+        let mut expected = back.clone();
+        let mut actual = back.clone();
+        blend_row(&mut expected, &src, *opacity, &blend::hsl_hue);
+        blend_row_memoized(&mut actual, &src, *opacity, &blend::hsl_hue);
+        assert_eq!(expected, actual);
+    }
+}
+
+#[test]
+fn test_row_kernel() {
+    let modes = [
+        BlendMode::Normal,
+        BlendMode::Multiply,
+        BlendMode::Screen,
+        BlendMode::Overlay,
+        BlendMode::Darken,
+        BlendMode::Lighten,
+        BlendMode::ColorDodge,
+        BlendMode::ColorBurn,
+        BlendMode::HardLight,
+        BlendMode::SoftLight,
+        BlendMode::Difference,
+        BlendMode::Exclusion,
+        BlendMode::Hue,
+        BlendMode::Saturation,
+        BlendMode::Color,
+        BlendMode::Luminosity,
+        BlendMode::Addition,
+        BlendMode::Subtract,
+        BlendMode::Divide,
+    ];
+    let pixel = |i: u32| {
+        let v = i.wrapping_mul(0x9e37_79b9);
+        Rgba([v as u8, (v >> 8) as u8, (v >> 16) as u8, (v >> 24) as u8])
+    };
+    let back: Vec<u8> = (0..37).flat_map(|i| pixel(i).0).collect();
+    let src: Vec<Color8> = (100..137).map(pixel).collect();
+    for mode in modes.iter() {
+        for opacity in [0, 100, 255].iter() {
+            let mut expected = back.clone();
+            blend::dispatch_blend_fn!(mode, |blend_fn| blend_row(
+                &mut expected,
+                &src,
+                *opacity,
+                &blend_fn
+            ));
+            let mut actual = back.clone();
+            row_kernel(*mode)(&mut actual, &src, *opacity);
+            assert_eq!(expected, actual, "{:?}", mode);
+        }
+    }
+}
+
+#[test]
+fn test_visible_tiles() {
+    // 4 tiles of 8 pixels on a 20 pixel canvas.
+    assert_eq!(visible_tiles(0, 8, 4, 20), 0..3);
+    assert_eq!(visible_tiles(4, 8, 4, 20), 0..2);
+    assert_eq!(visible_tiles(-8, 8, 4, 20), 1..4);
+    assert_eq!(visible_tiles(-9, 8, 4, 20), 1..4);
+    assert_eq!(visible_tiles(-7, 8, 4, 20), 0..4);
+    assert_eq!(visible_tiles(-32, 8, 4, 20), 4..4);
+    assert_eq!(visible_tiles(20, 8, 4, 20), 0..0);
+    assert_eq!(visible_tiles(19, 8, 4, 20), 0..1);
+}
+
+#[test]
+fn test_clip_rect() {
+    // Fully inside.
+    assert_eq!(
+        ClipRect::new(2, 3, 4, 5, 16, 16),
+        Some(ClipRect {
+            src_x: 0,
+            src_y: 0,
+            dst_x: 2,
+            dst_y: 3,
+            width: 4,
+            height: 5,
+        })
+    );
+    // Overlapping the top-left and bottom-right corners.
+    assert_eq!(
+        ClipRect::new(-2, -3, 4, 5, 16, 16),
+        Some(ClipRect {
+            src_x: 2,
+            src_y: 3,
+            dst_x: 0,
+            dst_y: 0,
+            width: 2,
+            height: 2,
+        })
+    );
+    assert_eq!(
+        ClipRect::new(14, 15, 4, 5, 16, 16),
+        Some(ClipRect {
+            src_x: 0,
+            src_y: 0,
+            dst_x: 14,
+            dst_y: 15,
+            width: 2,
+            height: 1,
+        })
+    );
+    // Completely outside.
+    assert_eq!(ClipRect::new(16, 0, 4, 5, 16, 16), None);
+    assert_eq!(ClipRect::new(0, -5, 4, 5, 16, 16), None);
+    assert_eq!(ClipRect::new(0, 0, 0, 5, 16, 16), None);
+}
@@ -0,0 +1,209 @@
+// Optional instrumentation of loading and rendering, enabled with the `stats`
+// feature. Without the feature the `count!` and `timed!` macros expand to
+// nothing, so instrumented code paths are unchanged.
+
+#[cfg(feature = "stats")]
+use crate::{layer::parse_blend_mode, parse::CHUNK_TYPE_NAMES, BlendMode};
+#[cfg(feature = "stats")]
+use std::{
+    cell::Cell,
+    sync::atomic::{AtomicU64, Ordering},
+    time::{Duration, Instant},
+};
+
+// Adds `$n` to the given counter (optionally an element of a counter array).
+macro_rules! count {
+    ($counter:ident $([$index:expr])?, $n:expr) => {
+        #[cfg(feature = "stats")]
+        $crate::stats::COUNTERS.$counter$([$index])?.fetch_add(
+            $n as u64,
+            std::sync::atomic::Ordering::Relaxed,
+        );
+    };
+}
+
+// Evaluates `$body` and adds the time it took to the given phase.
+macro_rules! timed {
+    ($phase:ident, $body:expr) => {{
+        #[cfg(feature = "stats")]
+        let _timer = $crate::stats::Timer::new(&$crate::stats::COUNTERS.$phase);
+        $body
+    }};
+}
+
+pub(crate) use {count, timed};
+
+/// Timings and counters collected while loading and rendering files.
+///
+/// Only available with the `stats` feature. The counters are global and
+/// shared by all threads, so everything the process loads or renders between
+/// two calls of [Stats::take] ends up in the same `Stats`.
+///
+/// Times are exclusive: time spent decompressing cels while reading them only
+/// counts towards `inflate`. Work done on several threads at once (e.g., with
+/// [LoadOptions::parallel](crate::LoadOptions::parallel)) adds up, so the sum
+/// can exceed the elapsed time.
+///
+/// # Example
+///
+/// ```
+/// # use asefile::{AsepriteFile, Stats};
+/// # use std::path::Path;
+/// # let path = Path::new("./tests/data/basic-16x16.aseprite");
+/// Stats::take();
+/// let ase = AsepriteFile::read_file(&path).unwrap();
+/// let image = ase.frame(0).image();
+/// let stats = Stats::take();
+/// println!("inflate: {:?}, composite: {:?}", stats.inflate, stats.composite);
+/// ```
+#[cfg(feature = "stats")]
+#[derive(Debug, Clone, Default)]
+pub struct Stats {
+    /// Time spent reading chunks from the input.
+    pub read: Duration,
+    /// Time spent decompressing zlib data of cels, tilesets, and tilemaps.
+    pub inflate: Duration,
+    /// Time spent turning decompressed bytes into pixels.
+    pub convert: Duration,
+    /// Time spent validating parsed chunks, e.g., checking that indexed
+    /// pixels refer to existing palette entries.
+    pub validate: Duration,
+    /// Time spent blending cels onto images.
+    pub composite: Duration,
+    /// Number of zlib-compressed bytes that were decompressed.
+    pub compressed_bytes: u64,
+    /// Number of bytes produced by decompression.
+    pub decompressed_bytes: u64,
+    /// Number of chunks read, by chunk type (e.g., `"Cel"` or `"Layer"`).
+    /// Only chunk types that occurred are listed.
+    pub chunks: Vec<(&'static str, u64)>,
+    /// Number of cels blended, by the blend mode of their layer. Only blend
+    /// modes that occurred are listed.
+    pub cels_blended: Vec<(BlendMode, u64)>,
+}
+
+#[cfg(feature = "stats")]
+impl Stats {
+    /// Returns the statistics collected since the last call and resets all
+    /// counters.
+    pub fn take() -> Stats {
+        let c = &COUNTERS;
+        let take = |counter: &AtomicU64| counter.swap(0, Ordering::Relaxed);
+        let nanos = |counter: &AtomicU64| Duration::from_nanos(take(counter));
+        Stats {
+            read: nanos(&c.read),
+            inflate: nanos(&c.inflate),
+            convert: nanos(&c.convert),
+            validate: nanos(&c.validate),
+            composite: nanos(&c.composite),
+            compressed_bytes: take(&c.compressed_bytes),
+            decompressed_bytes: take(&c.decompressed_bytes),
+            chunks: CHUNK_TYPE_NAMES
+                .iter()
+                .zip(&c.chunks)
+                .map(|(name, counter)| (*name, take(counter)))
+                .filter(|(_, n)| *n > 0)
+                .collect(),
+            cels_blended: c
+                .cels_blended
+                .iter()
+                .enumerate()
+                .filter_map(|(id, counter)| {
+                    let mode = parse_blend_mode(id as u16).ok()?;
+                    Some((mode, take(counter)))
+                })
+                .filter(|(_, n)| *n > 0)
+                .collect(),
+        }
+    }
+}
+
+#[cfg(feature = "stats")]
+pub(crate) struct Counters {
+    // Times in nanoseconds.
+    pub(crate) read: AtomicU64,
+    pub(crate) inflate: AtomicU64,
+    pub(crate) convert: AtomicU64,
+    pub(crate) validate: AtomicU64,
+    pub(crate) composite: AtomicU64,
+    pub(crate) compressed_bytes: AtomicU64,
+    pub(crate) decompressed_bytes: AtomicU64,
+    // Indexed by `ChunkType as usize`.
+    pub(crate) chunks: [AtomicU64; CHUNK_TYPE_NAMES.len()],
+    // Indexed by `BlendMode as usize`, which matches the file format id.
+    pub(crate) cels_blended: [AtomicU64; 19],
+}
+
+#[cfg(feature = "stats")]
+#[allow(clippy::declare_interior_mutable_const)]
+const ZERO: AtomicU64 = AtomicU64::new(0);
+
+#[cfg(feature = "stats")]
+pub(crate) static COUNTERS: Counters = Counters {
+    read: ZERO,
+    inflate: ZERO,
+    convert: ZERO,
+    validate: ZERO,
+    composite: ZERO,
+    compressed_bytes: ZERO,
+    decompressed_bytes: ZERO,
+    chunks: [ZERO; CHUNK_TYPE_NAMES.len()],
+    cels_blended: [ZERO; 19],
+};
+
+#[cfg(feature = "stats")]
+thread_local! {
+    // Time spent in timers nested inside the innermost running timer on this
+    // thread. Subtracted from the outer timer to keep times exclusive.
+    static NESTED_NANOS: Cell<u64> = const { Cell::new(0) };
+}
+
+// Adds the time between its creation and drop to a phase.
+#[cfg(feature = "stats")]
+pub(crate) struct Timer {
+    phase: &'static AtomicU64,
+    start: Instant,
+    outer_nested: u64,
+}
+
+#[cfg(feature = "stats")]
+impl Timer {
+    pub(crate) fn new(phase: &'static AtomicU64) -> Self {
+        Self {
+            phase,
+            start: Instant::now(),
+            outer_nested: NESTED_NANOS.with(|nested| nested.replace(0)),
+        }
+    }
+}
+
+#[cfg(feature = "stats")]
+impl Drop for Timer {
+    fn drop(&mut self) {
+        let elapsed = self.start.elapsed().as_nanos() as u64;
+        let nested = NESTED_NANOS.with(|nested| nested.replace(self.outer_nested + elapsed));
+        self.phase
+            .fetch_add(elapsed.saturating_sub(nested), Ordering::Relaxed);
+    }
+}
+
+#[cfg(feature = "stats")]
+#[test]
+fn test_nested_timers_are_exclusive() {
+    static OUTER: AtomicU64 = ZERO;
+    static INNER: AtomicU64 = ZERO;
+    let sleep = |ms| std::thread::sleep(Duration::from_millis(ms));
+    {
+        let _outer = Timer::new(&OUTER);
+        sleep(1);
+        {
+            let _inner = Timer::new(&INNER);
+            sleep(20);
+        }
+        sleep(1);
+    }
+    let outer = OUTER.load(Ordering::Relaxed);
+    let inner = INNER.load(Ordering::Relaxed);
+    assert!(inner >= 20_000_000);
+    assert!(outer >= 2_000_000 && outer < inner);
+}
@@ -0,0 +1,112 @@
+use std::io::Read;
+
+use crate::{cel::CelId, parse::StreamParser, AsepriteFile, Frame, PixelFormat, Result};
+
+/// Reads an Aseprite file one frame at a time.
+///
+/// [AsepriteFile::read] decompresses the cels of all frames up front and
+/// keeps them in memory. A `FrameStream` reads each frame only when it is
+/// requested and keeps only the cels drawn by the current frame
+/// decompressed. Cels of earlier frames stay compressed because later frames
+/// may still link to them. Memory use is thus roughly the size of the file
+/// plus one decompressed frame, even for very long animations.
+///
+/// Rendering an earlier frame through the current [Frame] decompresses its
+/// cels too, and they stay decompressed when the stream moves on. Call
+/// [FrameStream::release_decoded_pixels] to free them.
+///
+/// Layers, tilesets, and the palette are read with the first frame. A
+/// palette chunk in a later frame applies from that frame on. Layers or
+/// tilesets after the first frame are not supported.
+///
+/// Create a stream with [AsepriteFile::stream] or
+/// [AsepriteFile::stream_file].
+///
+/// # Example
+///
+/// ```
+/// # use asefile::AsepriteFile;
+/// # use std::path::Path;
+/// # let path = Path::new("./tests/data/linked_cels.aseprite");
+/// let mut stream = AsepriteFile::stream_file(&path).unwrap();
+/// while let Some(frame) = stream.next_frame().unwrap() {
+///     let image = frame.image();
+///     // ...
+/// }
+/// ```
+pub struct FrameStream<R: Read> {
+    file: AsepriteFile,
+    parser: StreamParser<R>,
+    // The most recently returned frame.
+    current: Option<u32>,
+    // Cels that may hold decompressed pixels.
+    decoded: Vec<CelId>,
+}
+
+impl<R: Read> FrameStream<R> {
+    pub(crate) fn new(file: AsepriteFile, parser: StreamParser<R>) -> Self {
+        Self {
+            file,
+            parser,
+            current: None,
+            decoded: Vec::new(),
+        }
+    }
+
+    /// Width in pixels.
+    pub fn width(&self) -> usize {
+        self.file.width()
+    }
+
+    /// Height in pixels.
+    pub fn height(&self) -> usize {
+        self.file.height()
+    }
+
+    /// Total number of frames in the file.
+    pub fn num_frames(&self) -> u32 {
+        self.file.num_frames()
+    }
+
+    /// Pixel format of the file.
+    pub fn pixel_format(&self) -> PixelFormat {
+        self.file.pixel_format()
+    }
+
+    /// Reads the next frame. Returns `None` after the last frame.
+    ///
+    /// The returned [Frame] can be rendered and its cels inspected like any
+    /// other frame. Earlier frames can also be reached through it, but frames
+    /// that have not been read yet are empty. Only the pixels of the previous
+    /// frame are released here, not those of earlier frames rendered since.
+    pub fn next_frame(&mut self) -> Result<Option<Frame<'_>>> {
+        let frame = match self.current {
+            // The first frame was read along with the header.
+            None if self.file.num_frames() > 0 => 0,
+            None => return Ok(None),
+            Some(_) => match self.parser.parse_next_frame(&mut self.file)? {
+                Some(frame) => frame as u32,
+                None => return Ok(None),
+            },
+        };
+        self.current = Some(frame);
+
+        // Release the pixels drawn by the previous frame unless this frame
+        // draws them again.
+        let sources = self.file.framedata.frame_sources(frame as u16);
+        for cel_id in self.decoded.drain(..) {
+            if !sources.contains(&cel_id) {
+                self.file.framedata.release_decoded(cel_id);
+            }
+        }
+        self.decoded = sources;
+
+        Ok(Some(self.file.frame(frame)))
+    }
+
+    /// Frees the decompressed pixels of all cels read so far, including those
+    /// of earlier frames. They are decompressed again when needed.
+    pub fn release_decoded_pixels(&mut self) {
+        self.file.framedata.release_all_decoded();
+    }
+}
@@ -1,7 +1,10 @@
-use image::Pixel;
+use image::{Pixel, RgbaImage};
 
-use crate::*;
-use std::path::PathBuf;
+use crate::{
+    cel::{CelContent, CelId, RawCel},
+    *,
+};
+use std::{path::PathBuf, sync::Arc};
 
 fn load_test_file(name: &str) -> AsepriteFile {
     let mut path = PathBuf::new();
@@ -15,6 +18,11 @@ fn load_test_file(name: &str) -> AsepriteFile {
     // parse::read_aseprite(reader).unwrap()
 }
 
+fn load_test_file_with_options(name: &str, options: &LoadOptions) -> AsepriteFile {
+    let path = PathBuf::from(format!("tests/data/{}.aseprite", name));
+    AsepriteFile::read_file_with_options(&path, options).unwrap()
+}
+
 fn compare_with_reference_image(img: image::RgbaImage, filename: &str) {
     let mut reference_path = PathBuf::new();
     reference_path.push("tests");
@@ -383,6 +391,401 @@ fn tilemap_grayscale() {
     compare_with_reference_image(img, "tilemap_grayscale");
 }
 
+#[test]
+fn lazy_cels() {
+    let options = LoadOptions {
+        lazy_cels: true,
+        ..Default::default()
+    };
+    let f = load_test_file_with_options("linked_cels", &options);
+    compare_with_reference_image(f.frame(2).image(), "linked_cels_03");
+    compare_with_reference_image(f.frame(0).image(), "linked_cels_01");
+
+    let f = load_test_file_with_options("indexed", &options);
+    compare_with_reference_image(f.frame(0).image(), "indexed_01");
+
+    let mut f = load_test_file_with_options("tilemap_indexed", &options);
+    compare_with_reference_image(f.frame(0).image(), "tilemap_indexed");
+    // Released pixels are decompressed again when needed.
+    f.release_decoded_pixels();
+    compare_with_reference_image(f.frame(0).image(), "tilemap_indexed");
+
+    let f = load_test_file_with_options("tileset", &options);
+    let tileset = f.tilesets().get(0).expect("No tileset found");
+    compare_with_reference_image(tileset.tile_image(1), "tileset_1");
+}
+
+#[test]
+fn parallel_load() {
+    let options = LoadOptions {
+        parallel: true,
+        ..Default::default()
+    };
+    for name in &["linked_cels", "indexed", "grayscale", "tilemap_indexed"] {
+        let sequential = load_test_file(name);
+        let parallel = load_test_file_with_options(name, &options);
+        // Chunks read from a `Read` are owned rather than borrowed.
+        let path = PathBuf::from(format!("tests/data/{}.aseprite", name));
+        let file = std::fs::File::open(path).unwrap();
+        let parallel_read = AsepriteFile::read_with_options(file, &options).unwrap();
+        for frame in 0..sequential.num_frames() {
+            let image = sequential.frame(frame).image();
+            assert_eq!(parallel.frame(frame).image(), image);
+            assert_eq!(parallel_read.frame(frame).image(), image);
+        }
+    }
+
+    let f = load_test_file_with_options("tileset", &options);
+    let tileset = f.tilesets().get(0).expect("No tileset found");
+    compare_with_reference_image(tileset.image(), "tileset");
+}
+
+#[test]
+#[should_panic(expected = "Image size does not match sprite size")]
+fn render_frames_into_checks_image_size() {
+    let f = load_test_file("linked_cels");
+    let mut images = f.render_frames(0..2);
+    images[1] = RgbaImage::new(1, 1);
+    f.render_frames_into(0..2, &mut images);
+}
+
+#[test]
+fn file_is_send_and_sync() {
+    fn assert_send_sync<T: Send + Sync>() {}
+    assert_send_sync::<AsepriteFile>();
+}
+
+#[test]
+fn render_frames() {
+    let f = load_test_file("linked_cels");
+    let images = f.render_all_frames();
+    assert_eq!(images.len(), 3);
+    compare_with_reference_image(images[0].clone(), "linked_cels_01");
+    compare_with_reference_image(images[1].clone(), "linked_cels_02");
+    compare_with_reference_image(images[2].clone(), "linked_cels_03");
+
+    // Reused images must not keep their old contents.
+    let mut images = f.render_frames(1..3);
+    images.reverse();
+    f.render_frames_into(1..3, &mut images);
+    compare_with_reference_image(images[1].clone(), "linked_cels_03");
+
+    let shared = std::sync::Arc::new(load_test_file("layers_and_tags"));
+    let handles: Vec<_> = (0..4)
+        .map(|frame| {
+            let f = shared.clone();
+            std::thread::spawn(move || f.frame(frame).image())
+        })
+        .collect();
+    for (frame, handle) in handles.into_iter().enumerate() {
+        let image = handle.join().unwrap();
+        compare_with_reference_image(image, &format!("layers_and_tags_{:02}", frame + 1));
+    }
+}
+
+#[test]
+fn render_into_with_context() {
+    let mut context = RenderContext::new();
+    // Reuse the context (and its palette lookup table) across files.
+    for name in &[
+        "indexed",
+        "util_indexed",
+        "tilemap_indexed",
+        "grayscale",
+        "indexed",
+    ] {
+        let f = load_test_file(name);
+        let mut image = RgbaImage::from_pixel(
+            f.width() as u32,
+            f.height() as u32,
+            image::Rgba([1, 2, 3, 4]),
+        );
+        f.render_frame_into(0, &mut image, &mut context);
+        assert_eq!(image, f.frame(0).image());
+    }
+
+    // Render all frames side by side into one buffer, with some padding.
+    let f = load_test_file("linked_cels");
+    let (width, height) = (f.width(), f.height());
+    let stride = (width * 3 + 1) * 4;
+    let mut atlas = vec![0xff_u8; stride * height];
+    for frame in 0..3 {
+        let offset = frame as usize * width * 4;
+        f.render_frame_into_buffer(frame, &mut atlas[offset..], stride, &mut context);
+    }
+    for frame in 0..3 {
+        let offset = frame * width * 4;
+        let data = (0..height)
+            .flat_map(|y| &atlas[offset + y * stride..offset + y * stride + width * 4])
+            .copied()
+            .collect();
+        let image = RgbaImage::from_raw(width as u32, height as u32, data).unwrap();
+        compare_with_reference_image(image, &format!("linked_cels_{:02}", frame + 1));
+    }
+    assert!(
+        (0..height).all(|y| atlas[y * stride + width * 12..(y + 1) * stride]
+            .iter()
+            .all(|&b| b == 0xff))
+    );
+}
+
+#[test]
+fn frame_cache() {
+    let f = load_test_file("linked_cels");
+    let mut cache = FrameCache::new(&f);
+    assert!(cache.is_empty());
+    let images: Vec<_> = (0..f.num_frames())
+        .map(|frame| cache.frame(frame))
+        .collect();
+    for (frame, image) in images.iter().enumerate() {
+        assert_eq!(**image, f.frame(frame as u32).image());
+    }
+    // Asking again must not render anything new.
+    let num_unique = cache.len();
+    for (frame, image) in images.iter().enumerate() {
+        assert!(std::sync::Arc::ptr_eq(image, &cache.frame(frame as u32)));
+    }
+    assert_eq!(cache.len(), num_unique);
+}
+
+#[test]
+fn render_options() {
+    let f = load_test_file("layers_and_tags");
+    let all = RenderOptions::new();
+    assert_eq!(f.frame(0).image_with_options(&all), f.frame(0).image());
+
+    // Hiding layers through the file's flags must give the same result as
+    // deselecting them. Groups stay selected, because hiding a group in the
+    // file would also hide the layers inside.
+    let mut expected = load_test_file("layers_and_tags");
+    let keep = |layer: &Layer| layer.layer_type() == layer::LayerType::Group || layer.id() % 2 == 0;
+    for layer in f.layers().filter(|layer| !keep(layer)) {
+        expected.layers.layers[layer.id() as usize]
+            .flags
+            .remove(LayerFlags::VISIBLE);
+    }
+    let options = RenderOptions::new().only_layers_where(&f, keep);
+    let mut context = RenderContext::new();
+    for frame in 0..f.num_frames() {
+        let expected_image = expected.frame(frame).image();
+        assert_eq!(f.frame(frame).image_with_options(&options), expected_image);
+        let mut image = f.frame(frame).image();
+        f.render_frame_into_with_options(frame, &mut image, &options, &mut context);
+        assert_eq!(image, expected_image);
+    }
+
+    // Showing the normally hidden layers must match a file where they are
+    // all visible.
+    for layer in &mut expected.layers.layers {
+        layer.flags.insert(LayerFlags::VISIBLE);
+    }
+    let options = RenderOptions::new().include_hidden_layers(true);
+    for frame in 0..f.num_frames() {
+        assert_eq!(
+            f.frame(frame).image_with_options(&options),
+            expected.frame(frame).image()
+        );
+    }
+}
+
+#[test]
+fn render_frame_trimmed() {
+    for name in &[
+        "linked_cels",
+        "cel_overflow",
+        "tilemap",
+        "layers_and_tags",
+        "basic-16x16",
+    ] {
+        let f = load_test_file(name);
+        for frame in 0..f.num_frames() {
+            let full = f.frame(frame).image();
+            let (trimmed, (x, y)) = f.render_frame_trimmed(frame);
+            let (width, height) = trimmed.dimensions();
+            assert!(x + width <= full.width() && y + height <= full.height());
+            for (px, py, color) in full.enumerate_pixels() {
+                let inside = (x..x + width).contains(&px) && (y..y + height).contains(&py);
+                if inside {
+                    assert_eq!(color, trimmed.get_pixel(px - x, py - y));
+                } else {
+                    assert_eq!(color[3], 0, "{} frame {} at {},{}", name, frame, px, py);
+                }
+            }
+        }
+    }
+}
+
+#[test]
+fn stream_frames() {
+    for name in &[
+        "linked_cels",
+        "layers_and_tags",
+        "indexed",
+        "tilemap_multi",
+        "user_data",
+    ] {
+        let f = load_test_file(name);
+        let path = format!("tests/data/{}.aseprite", name);
+        let mut stream = AsepriteFile::stream_file(&PathBuf::from(path)).unwrap();
+        assert_eq!(stream.num_frames(), f.num_frames());
+        let mut num_frames = 0;
+        while let Some(frame) = stream.next_frame().unwrap() {
+            assert_eq!(frame.image(), f.frame(num_frames).image(), "{}", name);
+            assert_eq!(frame.duration(), f.frame(num_frames).duration());
+            num_frames += 1;
+            // Linked cels in later frames decompress their targets again.
+            if num_frames % 2 == 0 {
+                stream.release_decoded_pixels();
+            }
+        }
+        assert_eq!(num_frames, f.num_frames());
+        assert!(stream.next_frame().unwrap().is_none());
+    }
+}
+
+#[test]
+fn read_files() {
+    let names = [
+        "blend_normal",
+        "blend_multiply",
+        "indexed",
+        "missing",
+        "blend_normal",
+    ];
+    let paths: Vec<_> = names
+        .iter()
+        .map(|name| format!("tests/data/{}.aseprite", name))
+        .collect();
+    let files = AsepriteFile::read_files(&paths, &LoadOptions::default());
+    assert_eq!(files.len(), names.len());
+    assert!(files[3].is_err());
+    for (name, file) in names.iter().zip(&files) {
+        if let Ok(file) = file {
+            let f = load_test_file(name);
+            assert_eq!(file.frame(0).image(), f.frame(0).image(), "{}", name);
+        }
+    }
+
+    let palette = |i: usize| files[i].as_ref().unwrap().palette.as_ref().unwrap();
+    assert_eq!(palette(0), palette(1));
+    assert!(Arc::ptr_eq(palette(0), palette(1)));
+    assert!(Arc::ptr_eq(palette(0), palette(4)));
+    assert!(!Arc::ptr_eq(palette(0), palette(2)));
+}
+
+#[test]
+fn share_identical_cels() {
+    let options = LoadOptions {
+        share_identical_cels: true,
+        ..Default::default()
+    };
+    let paths = ["tests/data/linked_cels.aseprite"; 2];
+    let files = AsepriteFile::read_files(&paths, &options);
+    let (a, b) = (files[0].as_ref().unwrap(), files[1].as_ref().unwrap());
+    let f = load_test_file("linked_cels");
+    let mut num_shared = 0;
+    for frame in 0..f.num_frames() {
+        assert_eq!(a.frame(frame).image(), f.frame(frame).image());
+        for layer in 0..f.num_layers() {
+            let cel_id = CelId {
+                frame: frame as u16,
+                layer: layer as u16,
+            };
+            let hash = f.frame(frame).layer(layer).content_hash();
+            assert_eq!(a.frame(frame).layer(layer).content_hash(), hash);
+            assert_eq!(b.frame(frame).layer(layer).content_hash(), hash);
+            let pixels = |file: &AsepriteFile| match file.framedata.cel(cel_id) {
+                Some(RawCel {
+                    content: CelContent::Raw(image),
+                    ..
+                }) => match &image.pixels {
+                    pixel::Pixels::Shared(shared) => Some(shared.clone()),
+                    pixels => panic!("Pixels not shared: {:?}", pixels),
+                },
+                _ => None,
+            };
+            if let (Some(a), Some(b)) = (pixels(a), pixels(b)) {
+                assert!(Arc::ptr_eq(&a, &b));
+                num_shared += 1;
+            }
+        }
+    }
+    assert!(num_shared > 0);
+
+    // Linked cels have the hash of the cel they link to.
+    let cel = |frame, layer| f.frame(frame).layer(layer).content_hash();
+    assert!(cel(0, 0).is_some());
+    assert_eq!(cel(0, 0), cel(1, 0));
+    assert_ne!(cel(0, 0), cel(0, 1));
+}
+
+#[test]
+fn render_frame_scaled() {
+    for name in &[
+        "basic-16x16",
+        "big",
+        "blend_multiply",
+        "grayscale",
+        "indexed",
+        "linked_cels",
+        "tilemap",
+        "tilemap_indexed",
+    ] {
+        let f = load_test_file(name);
+        for frame in 0..f.num_frames() {
+            let full = f.frame(frame).image();
+            for factor in [1, 2, 3, 8] {
+                let scaled = f.render_frame_scaled(frame, factor);
+                let (width, height) = full.dimensions();
+                assert_eq!(
+                    scaled.dimensions(),
+                    (
+                        (width + factor - 1) / factor,
+                        (height + factor - 1) / factor
+                    )
+                );
+                for (x, y, pixel) in scaled.enumerate_pixels() {
+                    let expected = full.get_pixel(x * factor, y * factor);
+                    assert_eq!(
+                        pixel, expected,
+                        "{} frame {} factor {}",
+                        name, frame, factor
+                    );
+                }
+            }
+        }
+    }
+}
+
+#[test]
+fn read_bytes() {
+    for name in &[
+        "linked_cels",
+        "indexed",
+        "grayscale",
+        "tilemap",
+        "user_data",
+    ] {
+        let data = std::fs::read(format!("tests/data/{}.aseprite", name)).unwrap();
+        let from_slice = AsepriteFile::read_bytes(&data).unwrap();
+        let from_reader = AsepriteFile::read(&data[..]).unwrap();
+        assert_eq!(from_slice.num_frames(), from_reader.num_frames());
+        for frame in 0..from_reader.num_frames() {
+            assert_eq!(
+                from_slice.frame(frame).image(),
+                from_reader.frame(frame).image()
+            );
+        }
+        assert_eq!(
+            from_slice.layer(0).user_data(),
+            from_reader.layer(0).user_data()
+        );
+    }
+
+    let data = std::fs::read("tests/data/basic-16x16.aseprite").unwrap();
+    assert!(AsepriteFile::read_bytes(&data[..data.len() - 1]).is_err());
+}
+
 #[test]
 fn tileset_export() {
     let f = load_test_file("tileset");
@@ -537,6 +940,44 @@ fn extrude_border() {
     compare_with_reference_image(img, "util_extrude");
 }
 
+#[cfg(feature = "utils")]
+#[test]
+fn build_atlas() {
+    use crate::util::{build_atlas, extrude_border, AtlasOptions};
+    let files = [
+        &load_test_file("linked_cels"),
+        &load_test_file("layers_and_tags"),
+    ];
+    let options = AtlasOptions {
+        extrude_border: true,
+        ..Default::default()
+    };
+    let atlas = build_atlas(&files, &options);
+    let num_frames = files.iter().map(|f| f.num_frames() as usize).sum();
+    assert_eq!(atlas.frames.len(), num_frames);
+
+    for frame in &atlas.frames {
+        let (trimmed, offset) = files[frame.file].render_frame_trimmed(frame.frame);
+        assert_eq!(frame.offset, offset);
+        assert_eq!((frame.width, frame.height), trimmed.dimensions());
+        if frame.width == 0 {
+            continue;
+        }
+        for (x, y, pixel) in extrude_border(trimmed).enumerate_pixels() {
+            let atlas_pixel = atlas.image.get_pixel(frame.x + x - 1, frame.y + y - 1);
+            assert_eq!(atlas_pixel, pixel, "{:?}", frame);
+        }
+    }
+
+    // Frames that show the same cels share their image.
+    let key = |f: &util::AtlasFrame| (f.file, files[f.file].frame_content_key(f.frame as u16));
+    for (i, a) in atlas.frames.iter().enumerate() {
+        for b in atlas.frames[..i].iter().filter(|b| b.width > 0) {
+            assert_eq!(key(a) == key(b), (a.x, a.y) == (b.x, b.y));
+        }
+    }
+}
+
 #[cfg(feature = "utils")]
 #[test]
 fn compute_indexed() {
@@ -560,6 +1001,43 @@ fn compute_indexed() {
     assert_eq!(data[7], 13);
 }
 
+#[cfg(feature = "utils")]
+#[test]
+fn frame_to_indexed_image() {
+    use crate::util;
+    let names = ["util_indexed", "indexed", "tilemap_indexed", "linked_cels"];
+    let files: Vec<_> = names.iter().map(|name| load_test_file(name)).collect();
+    for (name, f) in names.iter().zip(&files) {
+        // Also map with the palettes of the other files, which put the same
+        // colors at other indices or lack some of them.
+        for (palette_name, palette_file) in names.iter().zip(&files) {
+            let mapper = util::PaletteMapper::new(
+                palette_file.palette().unwrap(),
+                util::MappingOptions {
+                    transparent: palette_file.transparent_color_index(),
+                    failure: 7,
+                },
+            );
+            for frame in 0..f.num_frames() {
+                let expected = util::to_indexed_image(f.frame(frame).image(), &mapper);
+                let actual = util::frame_to_indexed_image(f, frame, &mapper);
+                assert_eq!(
+                    actual, expected,
+                    "{} frame {} with palette of {}",
+                    name, frame, palette_name
+                );
+            }
+        }
+    }
+    // Composited from indices without going through RGBA.
+    let mut identity = [0; 256];
+    for (i, index) in identity.iter_mut().enumerate() {
+        *index = i as u8;
+    }
+    assert!(files[0].frame_indices(0, &identity, 0).is_some());
+    assert!(files[3].frame_indices(0, &identity, 0).is_none());
+}
+
 /*
 #[test]
 fn gen_random_pixels() {
@@ -582,3 +1060,44 @@ fn gen_random_pixels() {
     img.save(&Path::new("tests/data/random-256x256.png")).unwrap();
 }
 // */
+
+fn scan_test_file(name: &str) -> AsepriteMetadata {
+    let path = PathBuf::from(format!("tests/data/{}.aseprite", name));
+    AsepriteFile::scan_file(&path).unwrap()
+}
+
+#[test]
+fn scan_matches_full_load() {
+    for name in &["layers_and_tags", "slice_advanced", "user_data", "tilemap"] {
+        let f = load_test_file(name);
+        let meta = scan_test_file(name);
+        assert_eq!(meta.size(), f.size());
+        assert_eq!(meta.num_frames(), f.num_frames());
+        assert_eq!(meta.pixel_format(), f.pixel_format());
+        for frame in 0..f.num_frames() {
+            assert_eq!(meta.frame_duration(frame), f.frame(frame).duration());
+        }
+        assert_eq!(meta.num_layers(), f.num_layers());
+        for (layer, meta_layer) in f.layers().zip(meta.layers()) {
+            assert_eq!(meta_layer.name(), layer.name());
+            assert_eq!(meta_layer.flags(), layer.flags());
+            assert_eq!(meta_layer.blend_mode(), layer.blend_mode());
+            assert_eq!(meta_layer.is_visible(), layer.is_visible());
+            assert_eq!(
+                meta_layer.parent().map(|l| l.id()),
+                layer.parent().map(|l| l.id())
+            );
+            assert_eq!(meta_layer.user_data(), layer.user_data());
+        }
+        assert_eq!(meta.tags().len() as u32, f.num_tags());
+        for (id, tag) in meta.tags().iter().enumerate() {
+            let expected = f.tag(id as u32);
+            assert_eq!(tag.name(), expected.name());
+            assert_eq!(tag.from_frame(), expected.from_frame());
+            assert_eq!(tag.to_frame(), expected.to_frame());
+            assert_eq!(tag.user_data(), expected.user_data());
+        }
+        assert_eq!(format!("{:?}", meta.slices()), format!("{:?}", f.slices()));
+        assert_eq!(meta.sprite_user_data(), f.sprite_user_data());
+    }
+}
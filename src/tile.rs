@@ -1,5 +1,9 @@
-use crate::{reader::AseReader, tilemap::TileBitmaskHeader, Result};
-use std::{io::Read, ops::Index};
+use crate::{
+    reader::{AseReader, SliceReader},
+    tilemap::TileBitmaskHeader,
+    Result,
+};
+use std::ops::Index;
 
 #[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord, Hash)]
 pub(crate) struct TileId(pub u32);
@@ -8,7 +12,7 @@ pub(crate) struct TileId(pub u32);
 ///
 /// Note that the Aseprite file format also enables rotating or flipping tiles.
 /// But since the GUI does not yet support those (as of v1.3-beta5) we do not
-/// yet expose these attributes.
+/// yet expose these attributes. They are applied when rendering, though.
 #[derive(Debug, Clone)]
 pub struct Tile {
     pub(crate) id: TileId,
@@ -31,6 +35,12 @@ impl Tile {
         self.id.0
     }
 
+    // The tile's flip flags as an index in `0..8`. Bit 0 is the x flip, bit 1
+    // the y flip, and bit 2 the diagonal flip.
+    pub(crate) fn orientation(&self) -> usize {
+        self.flip_x as usize | (self.flip_y as usize) << 1 | (self.rotate_90cw as usize) << 2
+    }
+
     pub(crate) fn new(chunk: &[u8], header: &TileBitmaskHeader) -> Result<Self> {
         AseReader::new(chunk)
             .dword()
@@ -51,8 +61,8 @@ impl Tile {
 pub(crate) struct Tiles(Vec<Tile>);
 
 impl Tiles {
-    pub(crate) fn unzip<T: Read>(
-        reader: AseReader<T>,
+    pub(crate) fn unzip(
+        reader: SliceReader,
         expected_tile_count: usize,
         header: &TileBitmaskHeader,
     ) -> Result<Self> {
@@ -4,7 +4,7 @@ use image::RgbaImage;
 
 use crate::{
     cel::CelContent,
-    reader::AseReader,
+    reader::{AseReader, SliceReader},
     tile::{self, Tile, EMPTY_TILE},
     AsepriteParseError, Cel, Result, Tileset,
 };
@@ -119,7 +119,7 @@ impl TilemapData {
         Some(&self.tiles[index])
     }
 
-    pub(crate) fn parse_chunk<R: Read>(mut reader: AseReader<R>) -> Result<Self> {
+    pub(crate) fn parse_chunk(mut reader: SliceReader) -> Result<Self> {
         let width = reader.word()?;
         let height = reader.word()?;
         let bits_per_tile = reader.word()?;
@@ -1,11 +1,19 @@
-use std::{collections::HashMap, error::Error, fmt, io::Read, sync::Arc};
+use std::{
+    borrow::Cow,
+    collections::HashMap,
+    error::Error,
+    fmt,
+    io::Read,
+    sync::{Arc, OnceLock},
+};
 
 use crate::{
     pixel::{Pixels, RawPixels},
-    AsepriteParseError, ColorPalette, PixelFormat, Result,
+    tile::Tile,
+    AsepriteParseError, ColorPalette, LoadOptions, PixelFormat, Result,
 };
 use bitflags::bitflags;
-use image::RgbaImage;
+use image::{Rgba, RgbaImage};
 
 use crate::{external_file::ExternalFileId, reader::AseReader};
 
@@ -118,6 +126,85 @@ pub struct Tileset<P = Pixels> {
     pub(crate) name: String,
     pub(crate) external_file: Option<ExternalTilesetReference>,
     pub(crate) pixels: Option<P>,
+    // Built on first render, see `Tileset::tile_pixels`.
+    pub(crate) rgba_cache: OnceLock<RgbaTiles>,
+}
+
+// Data derived from a tileset's pixels for rendering.
+#[derive(Debug)]
+pub(crate) struct RgbaTiles {
+    // All tiles converted to RGBA, one after another. `None` if the tileset
+    // already stores RGBA pixels, which are then used directly.
+    converted: Option<Vec<Rgba<u8>>>,
+    // For each tile, whether all of its pixels are fully opaque.
+    opaque: Vec<bool>,
+    // All tiles flipped according to `Tile::orientation` (minus one), built
+    // the first time a tile with that orientation is drawn.
+    transformed: [OnceLock<Vec<Rgba<u8>>>; 7],
+}
+
+/// RGBA pixels of all tiles in a tileset, ready for rendering.
+pub(crate) struct TilePixels<'a> {
+    pixels: &'a [Rgba<u8>],
+    cache: &'a RgbaTiles,
+    tile_count: u32,
+    pub(crate) tile_size: TileSize,
+}
+
+impl<'a> TilePixels<'a> {
+    /// The pixels of the given tile, row by row and with its flip flags
+    /// applied, and whether they are all fully opaque. `None` if there is no
+    /// such tile.
+    pub(crate) fn tile(&self, tile: &Tile) -> Option<(&'a [Rgba<u8>], bool)> {
+        let pixels_per_tile = self.tile_size.pixels_per_tile() as usize;
+        let tile_id = tile.id.0 as usize;
+        let pixels = match tile.orientation() {
+            0 => self.pixels,
+            orientation => self.cache.transformed[orientation - 1].get_or_init(|| {
+                transform_tiles(self.pixels, self.tile_count, self.tile_size, orientation)
+            }),
+        };
+        let start = tile_id * pixels_per_tile;
+        let pixels = pixels.get(start..start + pixels_per_tile)?;
+        Some((pixels, self.cache.opaque[tile_id]))
+    }
+}
+
+// Copies all tiles with the flips of the given `Tile::orientation` applied.
+// As in Tiled, the diagonal flip (swapping x and y) happens first, followed by
+// the horizontal and vertical flips. The diagonal flip is ignored for tiles
+// that are not square since the result would not fit the tile grid.
+fn transform_tiles(
+    pixels: &[Rgba<u8>],
+    tile_count: u32,
+    tile_size: TileSize,
+    orientation: usize,
+) -> Vec<Rgba<u8>> {
+    let width = tile_size.width() as usize;
+    let height = tile_size.height() as usize;
+    let flip_x = orientation & 1 != 0;
+    let flip_y = orientation & 2 != 0;
+    let diagonal = orientation & 4 != 0 && width == height;
+    let pixels_per_tile = width * height;
+    let mut result = Vec::with_capacity(pixels.len());
+    for tile in pixels
+        .chunks_exact(pixels_per_tile)
+        .take(tile_count as usize)
+    {
+        for y in 0..height {
+            let y = if flip_y { height - 1 - y } else { y };
+            for x in 0..width {
+                let x = if flip_x { width - 1 - x } else { x };
+                let index = if diagonal {
+                    x * width + y
+                } else {
+                    y * width + x
+                };
+                result.push(tile[index]);
+            }
+        }
+    }
+    result
 }
 
 impl<P> Tileset<P> {
@@ -164,6 +251,7 @@ impl Tileset<RawPixels> {
     pub(crate) fn parse_chunk(
         data: &[u8],
         pixel_format: PixelFormat,
+        options: &LoadOptions,
     ) -> Result<Tileset<RawPixels>> {
         let mut reader = AseReader::new(data);
         let id = reader.dword()?;
@@ -172,6 +260,12 @@ impl Tileset<RawPixels> {
         let tile_count = reader.dword()?;
         let tile_width = reader.word()?;
         let tile_height = reader.word()?;
+        if tile_width == 0 || tile_height == 0 {
+            return Err(AsepriteParseError::InvalidInput(format!(
+                "Invalid tile size in Tileset {}: {}x{}",
+                id, tile_width, tile_height
+            )));
+        }
         let tile_size = TileSize {
             width: tile_width,
             height: tile_height,
@@ -194,7 +288,8 @@ impl Tileset<RawPixels> {
                 let _compressed_length = reader.dword()?;
                 let expected_pixel_count =
                     (tile_count * (tile_height as u32) * (tile_width as u32)) as usize;
-                RawPixels::from_compressed(reader, pixel_format, expected_pixel_count).map(Some)?
+                RawPixels::from_compressed(reader, pixel_format, expected_pixel_count, options)
+                    .map(Some)?
             }
         };
         Ok(Tileset {
@@ -206,11 +301,52 @@ impl Tileset<RawPixels> {
             name,
             external_file,
             pixels,
+            rgba_cache: OnceLock::new(),
         })
     }
 }
 
 impl Tileset<Pixels> {
+    // The tiles as RGBA. Indexed and grayscale tilesets are converted once,
+    // on first use, and then kept along with the tileset.
+    pub(crate) fn tile_pixels(&self) -> Option<TilePixels<'_>> {
+        let pixels = self.pixels.as_ref()?;
+        let pixels_per_tile = self.tile_size.pixels_per_tile() as usize;
+        let cache = self.rgba_cache.get_or_init(|| {
+            let rgba = pixels.clone_as_image_rgba();
+            let opaque = (0..self.tile_count as usize)
+                .map(|tile| {
+                    let start = tile * pixels_per_tile;
+                    rgba.get(start..start + pixels_per_tile)
+                        .map(|tile| tile.iter().all(|px| px[3] == 255))
+                        .unwrap_or(false)
+                })
+                .collect();
+            let converted = match rgba {
+                Cow::Borrowed(_) => None,
+                Cow::Owned(rgba) => Some(rgba),
+            };
+            RgbaTiles {
+                converted,
+                opaque,
+                transformed: Default::default(),
+            }
+        });
+        let pixels = match &cache.converted {
+            Some(converted) => converted.as_slice(),
+            None => match pixels.clone_as_image_rgba() {
+                Cow::Borrowed(rgba) => rgba.as_slice(),
+                Cow::Owned(_) => unreachable!("RGBA tileset was converted"),
+            },
+        };
+        Some(TilePixels {
+            pixels,
+            cache,
+            tile_count: self.tile_count,
+            tile_size: self.tile_size,
+        })
+    }
+
     /// Get the image for the given tile.
     pub fn tile_image(&self, tile_index: u32) -> RgbaImage {
         assert!(tile_index < self.tile_count());
@@ -252,21 +388,36 @@ impl Tileset<Pixels> {
 
 /// A map from tileset ids (`u32`) to [Tileset]s.
 #[derive(Debug)]
-pub struct TilesetsById<P = Pixels>(HashMap<TilesetId, Tileset<P>>);
+pub struct TilesetsById<P = Pixels> {
+    tilesets: Vec<Tileset<P>>,
+    // Mapping: tileset id -> index in `tilesets`. Rendering refers to
+    // tilesets by index, see `DrawCel`.
+    indices: HashMap<TilesetId, usize>,
+}
 
 impl<P> TilesetsById<P> {
     pub(crate) fn new() -> Self {
-        Self(HashMap::new())
+        Self {
+            tilesets: Vec::new(),
+            indices: HashMap::new(),
+        }
     }
 
     pub(crate) fn add(&mut self, tileset: Tileset<P>) {
-        self.0.insert(TilesetId::from_raw(tileset.id), tileset);
+        let id = TilesetId::from_raw(tileset.id);
+        match self.indices.get(&id) {
+            Some(&index) => self.tilesets[index] = tileset,
+            None => {
+                self.indices.insert(id, self.tilesets.len());
+                self.tilesets.push(tileset);
+            }
+        }
     }
 
     /// Number of entries.
     #[allow(clippy::len_without_is_empty)]
     pub fn len(&self) -> u32 {
-        self.0.len() as u32
+        self.tilesets.len() as u32
     }
 
     // /// Returns a reference to the underlying HashMap value.
@@ -276,7 +427,29 @@ impl<P> TilesetsById<P> {
 
     /// Get a reference to a [Tileset] from an id, if the entry exists.
     pub fn get(&self, id: u32) -> Option<&Tileset<P>> {
-        self.0.get(&TilesetId::from_raw(id))
+        self.index_of(id).map(|index| &self.tilesets[index])
+    }
+
+    pub(crate) fn index_of(&self, id: u32) -> Option<usize> {
+        self.indices.get(&TilesetId::from_raw(id)).copied()
+    }
+
+    // The tileset at an index returned by `index_of`.
+    pub(crate) fn by_index(&self, index: usize) -> &Tileset<P> {
+        &self.tilesets[index]
+    }
+}
+
+impl TilesetsById<Pixels> {
+    // Frees the decoded pixels of lazily loaded tilesets and the RGBA copies
+    // made for rendering.
+    pub(crate) fn release_decoded(&mut self) {
+        for tileset in self.tilesets.iter_mut() {
+            if let Some(pixels) = &mut tileset.pixels {
+                pixels.release_decoded();
+            }
+            tileset.rgba_cache.take();
+        }
     }
 }
 
@@ -286,8 +459,8 @@ impl TilesetsById<RawPixels> {
         pixel_format: &PixelFormat,
         palette: Option<Arc<ColorPalette>>,
     ) -> Result<TilesetsById<Pixels>> {
-        let mut result = HashMap::with_capacity(self.0.capacity());
-        for (id, tileset) in self.0.into_iter() {
+        let mut tilesets = Vec::with_capacity(self.tilesets.len());
+        for tileset in self.tilesets.into_iter() {
             // Validates that all Tilesets contain their own pixel data.
             // External file references currently not supported.
             let _ = tileset.pixels.as_ref().ok_or_else(|| {
@@ -302,21 +475,22 @@ impl TilesetsById<RawPixels> {
                 .unwrap()
                 .validate(palette.clone(), pixel_format, false)?;
 
-            result.insert(
-                id,
-                Tileset {
-                    pixels: Some(pixels),
-                    id: tileset.id,
-                    empty_tile_is_id_zero: tileset.empty_tile_is_id_zero,
-                    tile_count: tileset.tile_count,
-                    tile_size: tileset.tile_size,
-                    base_index: tileset.base_index,
-                    name: tileset.name,
-                    external_file: tileset.external_file,
-                },
-            );
+            tilesets.push(Tileset {
+                pixels: Some(pixels),
+                id: tileset.id,
+                empty_tile_is_id_zero: tileset.empty_tile_is_id_zero,
+                tile_count: tileset.tile_count,
+                tile_size: tileset.tile_size,
+                base_index: tileset.base_index,
+                name: tileset.name,
+                external_file: tileset.external_file,
+                rgba_cache: OnceLock::new(),
+            });
         }
-        Ok(TilesetsById(result))
+        Ok(TilesetsById {
+            tilesets,
+            indices: self.indices,
+        })
     }
 }
 
@@ -347,3 +521,56 @@ impl Error for TilesetImageError {
         None
     }
 }
+
+#[test]
+fn test_transform_tiles() {
+    let px = |v: u8| Rgba([v, 0, 0, 255]);
+    // One 2x2 tile:
+    //   1 2
+    //   3 4
+    let tile: Vec<Rgba<u8>> = [1, 2, 3, 4].iter().map(|&v| px(v)).collect();
+    let size = TileSize {
+        width: 2,
+        height: 2,
+    };
+    let expected: [[u8; 4]; 8] = [
+        [1, 2, 3, 4],
+        [2, 1, 4, 3], // x flip
+        [3, 4, 1, 2], // y flip
+        [4, 3, 2, 1], // x and y flip (180 degrees)
+        [1, 3, 2, 4], // diagonal flip
+        [3, 1, 4, 2], // diagonal and x flip (90 degrees clockwise)
+        [2, 4, 1, 3], // diagonal and y flip (90 degrees counter-clockwise)
+        [4, 2, 3, 1], // all flips
+    ];
+    for (orientation, expected) in expected.iter().enumerate() {
+        let expected: Vec<Rgba<u8>> = expected.iter().map(|&v| px(v)).collect();
+        assert_eq!(
+            transform_tiles(&tile, 1, size, orientation),
+            expected,
+            "orientation {}",
+            orientation
+        );
+    }
+}
+
+#[test]
+fn test_parse_chunk_rejects_empty_tiles() {
+    for &(width, height) in &[(0u16, 8u16), (8, 0)] {
+        let mut data = Vec::new();
+        data.extend_from_slice(&1u32.to_le_bytes()); // id
+        data.extend_from_slice(&0u32.to_le_bytes()); // flags
+        data.extend_from_slice(&4u32.to_le_bytes()); // tile count
+        data.extend_from_slice(&width.to_le_bytes());
+        data.extend_from_slice(&height.to_le_bytes());
+        data.extend_from_slice(&[0; 2 + 14]); // base index, reserved
+        data.extend_from_slice(&0u16.to_le_bytes()); // empty name
+        let result = Tileset::parse_chunk(&data, PixelFormat::Rgba, &LoadOptions::default());
+        assert!(
+            matches!(result, Err(AsepriteParseError::InvalidInput(_))),
+            "{}x{}",
+            width,
+            height
+        );
+    }
+}
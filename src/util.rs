@@ -11,9 +11,9 @@
 
 use image::RgbaImage;
 use nohash::IntMap;
-use std::iter::once;
+use std::{collections::HashMap, iter::once};
 
-use crate::ColorPalette;
+use crate::{cel::CelId, parallel, AsepriteFile, ColorPalette, RenderContext, RenderOptions};
 
 /// Add a 1 pixel border around the input image by duplicating the outmost
 /// pixels.
@@ -126,3 +126,325 @@ pub fn to_indexed_image(image: RgbaImage, mapper: &PaletteMapper) -> ((u32, u32)
         .collect();
     (image.dimensions(), data)
 }
+
+/// Render a frame of a file as an indexed image.
+///
+/// Returns the same image as calling [to_indexed_image] on
+/// [Frame::image](crate::Frame::image), but is much faster for indexed files
+/// where compositing never mixes colors: all visible layers and cels use
+/// [BlendMode::Normal](crate::BlendMode::Normal) at full opacity, there are
+/// no tilemaps, and all palette colors other than the transparent color are
+/// opaque. For those, the palette indices of the cels are composited directly
+/// without building an RGBA image first and translated to the indices of
+/// `mapper` through a table of the file's 256 palette colors. Any other file
+/// takes the slower route through RGBA.
+///
+/// # Example
+///
+/// ```
+/// # use asefile::AsepriteFile;
+/// # use std::path::Path;
+/// # let asefile_path = Path::new("./tests/data/util_indexed.aseprite");
+/// # let ase = AsepriteFile::read_file(&asefile_path).unwrap();
+/// use asefile::util::{frame_to_indexed_image, MappingOptions, PaletteMapper};
+/// let mapper = PaletteMapper::new(
+///     ase.palette().unwrap(),
+///     MappingOptions {
+///         transparent: ase.transparent_color_index(),
+///         failure: 0,
+///     }
+/// );
+/// let ((w, h), data) = frame_to_indexed_image(&ase, 0, &mapper);
+/// assert_eq!(data.len(), (w * h) as usize);
+/// ```
+///
+/// # Panics
+///
+/// Panics if the frame does not exist.
+pub fn frame_to_indexed_image(
+    file: &AsepriteFile,
+    frame: u32,
+    mapper: &PaletteMapper,
+) -> ((u32, u32), Vec<u8>) {
+    assert!(frame < file.num_frames(), "Frame out of range");
+    let data = file.palette().and_then(|palette| {
+        // Where `mapper` sends each color of the file's palette, so indices
+        // can be translated without looking at their colors.
+        let mut remap = [0; 256];
+        for (index, color) in remap.iter_mut().zip(palette.rgba_table().iter()) {
+            let [r, g, b, a] = color.0;
+            *index = mapper.lookup(r, g, b, a);
+        }
+        file.frame_indices(frame as u16, &remap, mapper.transparent)
+    });
+    match data {
+        Some(data) => ((file.width() as u32, file.height() as u32), data),
+        None => to_indexed_image(file.frame(frame).image(), mapper),
+    }
+}
+
+/// Configuration of [build_atlas].
+#[derive(Debug, Clone)]
+pub struct AtlasOptions {
+    /// Width of the atlas in pixels. If `None`, the smallest power of two
+    /// that fits the widest frame and makes the atlas roughly square.
+    pub width: Option<u32>,
+    /// Number of transparent pixels between two frames in the atlas.
+    pub padding: u32,
+    /// Only store the smallest rectangle that contains all visible cels of
+    /// each frame, like [AsepriteFile::render_frame_trimmed].
+    pub trim: bool,
+    /// Surround each frame with a 1 pixel border that duplicates its
+    /// outermost pixels, like [extrude_border].
+    pub extrude_border: bool,
+}
+
+impl Default for AtlasOptions {
+    fn default() -> Self {
+        Self {
+            width: None,
+            padding: 1,
+            trim: true,
+            extrude_border: false,
+        }
+    }
+}
+
+/// A texture atlas holding the frames of one or more files. Created with
+/// [build_atlas].
+#[derive(Debug)]
+pub struct Atlas {
+    /// The packed image.
+    pub image: RgbaImage,
+    /// The location of every frame, ordered by file and then by frame.
+    pub frames: Vec<AtlasFrame>,
+}
+
+/// The location of a single frame in an [Atlas].
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct AtlasFrame {
+    /// Index of the file in the slice passed to [build_atlas].
+    pub file: usize,
+    /// Index of the frame in its file.
+    pub frame: u32,
+    /// Left edge of the frame's image in the atlas, not counting an extruded
+    /// border.
+    pub x: u32,
+    /// Top edge of the frame's image in the atlas, not counting an extruded
+    /// border.
+    pub y: u32,
+    /// Width of the frame's image. Less than the sprite's width if the frame
+    /// was trimmed, 0 if it was trimmed and has no visible cels.
+    pub width: u32,
+    /// Height of the frame's image. See `width`.
+    pub height: u32,
+    /// Position of the frame's image in the sprite. Non-zero only if the
+    /// frame was trimmed.
+    pub offset: (u32, u32),
+}
+
+// A distinct image in the atlas. Several frames may share one.
+struct Region {
+    file: usize,
+    frame: u16,
+    // In sprite coordinates, as (x, y, width, height).
+    bounds: (u32, u32, u32, u32),
+    // Position of the image in the atlas.
+    x: u32,
+    y: u32,
+}
+
+// A row of regions that share the same rows of the atlas.
+struct Shelf {
+    y: u32,
+    height: u32,
+    regions: Vec<usize>,
+}
+
+/// Pack all frames of the given files into a single texture atlas.
+///
+/// Frames that show the same cels (e.g., because all of their cels are
+/// linked) are stored only once and share a location in the atlas. Each
+/// frame is rendered directly into its place in the atlas, in parallel on
+/// all available cores.
+///
+/// Frames are packed into rows, from tallest to shortest. This works well
+/// for animations, where frames tend to have similar sizes. Use a dedicated
+/// rectangle packer and [AsepriteFile::render_frame_into_buffer] for more
+/// control.
+///
+/// # Example
+///
+/// ```
+/// # use asefile::AsepriteFile;
+/// # use std::path::Path;
+/// # let path = Path::new("./tests/data/linked_cels.aseprite");
+/// use asefile::util::{build_atlas, AtlasOptions};
+/// let ase = AsepriteFile::read_file(&path).unwrap();
+/// let atlas = build_atlas(&[&ase], &AtlasOptions::default());
+/// for frame in &atlas.frames {
+///     println!("frame {} at {}, {}", frame.frame, frame.x, frame.y);
+/// }
+/// ```
+///
+/// # Panics
+///
+/// Panics if `options.width` is too small to fit the widest frame.
+pub fn build_atlas(files: &[&AsepriteFile], options: &AtlasOptions) -> Atlas {
+    let mut context = RenderContext::new();
+    let mut unique: HashMap<(usize, Vec<CelId>), usize> = HashMap::new();
+    let mut regions: Vec<Region> = Vec::new();
+    let mut frames = Vec::new();
+    for (file_index, file) in files.iter().enumerate() {
+        let full = (0, 0, file.width() as u32, file.height() as u32);
+        for frame in 0..file.num_frames() as u16 {
+            let key = (file_index, file.frame_content_key(frame));
+            let region = *unique.entry(key).or_insert_with(|| {
+                let bounds = if options.trim {
+                    file.frame_bounds(frame, &RenderOptions::default(), &mut context)
+                        .unwrap_or((0, 0, 0, 0))
+                } else {
+                    full
+                };
+                regions.push(Region {
+                    file: file_index,
+                    frame,
+                    bounds,
+                    x: 0,
+                    y: 0,
+                });
+                regions.len() - 1
+            });
+            frames.push((file_index, frame as u32, region));
+        }
+    }
+
+    let border = options.extrude_border as u32;
+    let (width, shelves) = pack_shelves(&mut regions, border, options);
+    let height = shelves.last().map_or(0, |shelf| shelf.y + shelf.height);
+    let mut image = RgbaImage::new(width, height);
+
+    // Shelves don't share any rows, so they can be rendered in parallel.
+    let stride = width as usize * 4;
+    let mut jobs = Vec::with_capacity(shelves.len());
+    let mut rest: &mut [u8] = &mut image;
+    let mut rest_y = 0;
+    for shelf in &shelves {
+        let (_, band) = rest.split_at_mut((shelf.y - rest_y) as usize * stride);
+        let (band, tail) = band.split_at_mut(shelf.height as usize * stride);
+        jobs.push((band, shelf));
+        rest = tail;
+        rest_y = shelf.y + shelf.height;
+    }
+    parallel::for_each_with(jobs, RenderContext::new, |context, (band, shelf)| {
+        for &index in &shelf.regions {
+            let region = &regions[index];
+            let (_, _, width, height) = region.bounds;
+            let (x, y) = (region.x as usize, (region.y - shelf.y) as usize);
+            let start = y * stride + x * 4;
+            files[region.file].render_region_into_buffer(
+                region.frame,
+                region.bounds,
+                &mut band[start..],
+                stride,
+                context,
+            );
+            if border > 0 {
+                extrude_region(band, stride, (x, y, width as usize, height as usize));
+            }
+        }
+    });
+
+    let frames = frames
+        .into_iter()
+        .map(|(file, frame, region)| {
+            let region = &regions[region];
+            let (offset_x, offset_y, width, height) = region.bounds;
+            AtlasFrame {
+                file,
+                frame,
+                x: region.x,
+                y: region.y,
+                width,
+                height,
+                offset: (offset_x, offset_y),
+            }
+        })
+        .collect();
+    Atlas { image, frames }
+}
+
+// Places all non-empty regions into shelves, tallest first, and returns the
+// width of the atlas along with the shelves from top to bottom.
+fn pack_shelves(regions: &mut [Region], border: u32, options: &AtlasOptions) -> (u32, Vec<Shelf>) {
+    let size = |region: &Region| {
+        let (_, _, width, height) = region.bounds;
+        (width + 2 * border, height + 2 * border)
+    };
+    let mut order: Vec<usize> = (0..regions.len())
+        .filter(|&index| {
+            let (_, _, width, height) = regions[index].bounds;
+            width > 0 && height > 0
+        })
+        .collect();
+    order.sort_by_key(|&index| std::cmp::Reverse(size(&regions[index]).1));
+
+    let widest = order
+        .iter()
+        .map(|&i| size(&regions[i]).0)
+        .max()
+        .unwrap_or(0);
+    let width = options.width.unwrap_or_else(|| {
+        let area: u64 = order
+            .iter()
+            .map(|&i| size(&regions[i]))
+            .map(|(w, h)| (w + options.padding) as u64 * (h + options.padding) as u64)
+            .sum();
+        let side = (area as f64).sqrt().ceil() as u32;
+        side.max(widest).next_power_of_two()
+    });
+    assert!(widest <= width, "Atlas is narrower than the widest frame");
+
+    let mut shelves: Vec<Shelf> = Vec::new();
+    let mut x = 0;
+    for index in order {
+        let (w, h) = size(&regions[index]);
+        match shelves.last_mut() {
+            Some(shelf) if x + w <= width => shelf.regions.push(index),
+            last => {
+                let y = last.map_or(0, |shelf| shelf.y + shelf.height + options.padding);
+                shelves.push(Shelf {
+                    y,
+                    height: h,
+                    regions: vec![index],
+                });
+                x = 0;
+            }
+        }
+        let shelf = shelves.last().unwrap();
+        regions[index].x = x + border;
+        regions[index].y = shelf.y + border;
+        x += w + options.padding;
+    }
+    (width, shelves)
+}
+
+// Copies the outermost pixels of the image at `(x, y, width, height)` into
+// the 1 pixel border around it.
+fn extrude_region(
+    band: &mut [u8],
+    stride: usize,
+    (x, y, width, height): (usize, usize, usize, usize),
+) {
+    for row in y..y + height {
+        let start = row * stride + x * 4;
+        let end = start + width * 4;
+        band.copy_within(start..start + 4, start - 4);
+        band.copy_within(end - 4..end, end);
+    }
+    let row_bytes = (width + 2) * 4;
+    let first = y * stride + (x - 1) * 4;
+    band.copy_within(first..first + row_bytes, first - stride);
+    let last = (y + height - 1) * stride + (x - 1) * 4;
+    band.copy_within(last..last + row_bytes, last + stride);
+}